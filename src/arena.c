@@ -0,0 +1,178 @@
+/*
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <sys/mman.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libHX/defs.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/**
+ * struct pmt_arena_chunk - one block of arena memory
+ * @next:	previously filled chunk
+ * @size:	usable bytes after the header
+ * @used:	bytes handed out so far
+ */
+struct pmt_arena_chunk {
+	struct pmt_arena_chunk *next;
+	size_t size, used;
+};
+
+enum {
+	ARENA_ALIGN      = 2 * sizeof(void *),
+	ARENA_CHUNK_SIZE = 8192,
+};
+
+#define ARENA_HDR_SIZE \
+	((sizeof(struct pmt_arena_chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+static inline char *chunk_data(struct pmt_arena_chunk *c)
+{
+	return reinterpret_cast(char *, c) + ARENA_HDR_SIZE;
+}
+
+void pmt_arena_init(struct pmt_arena *arena, unsigned int flags)
+{
+	arena->head  = NULL;
+	arena->flags = flags;
+}
+
+struct pmt_arena *pmt_arena_new(unsigned int flags)
+{
+	struct pmt_arena *arena = malloc(sizeof(*arena));
+
+	if (arena != NULL)
+		pmt_arena_init(arena, flags);
+	return arena;
+}
+
+/**
+ * arena_chunk_new -
+ * @arena:	arena to grow
+ * @min:	minimum usable size
+ *
+ * Secret chunks are obtained with mmap() so they are page-aligned and can be
+ * locked as a whole; they are also excluded from core dumps where possible.
+ */
+static struct pmt_arena_chunk *arena_chunk_new(struct pmt_arena *arena,
+    size_t min)
+{
+	struct pmt_arena_chunk *c;
+	size_t size = ARENA_CHUNK_SIZE;
+
+	if (min + ARENA_HDR_SIZE > size)
+		size = min + ARENA_HDR_SIZE;
+
+	if (arena->flags & PMT_ARENA_SECRET) {
+		long pagesize = sysconf(_SC_PAGESIZE);
+
+		if (pagesize <= 0)
+			pagesize = 4096;
+		size = (size + pagesize - 1) & ~(pagesize - 1);
+		c = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (c == MAP_FAILED)
+			return NULL;
+		if (mlock(c, size) < 0)
+			w4rn("mlock arena: %s\n", strerror(errno));
+#ifdef MADV_DONTDUMP
+		madvise(c, size, MADV_DONTDUMP);
+#endif
+	} else {
+		if ((c = malloc(size)) == NULL)
+			return NULL;
+	}
+	c->size = size - ARENA_HDR_SIZE;
+	c->used = 0;
+	c->next = arena->head;
+	arena->head = c;
+	return c;
+}
+
+/**
+ * pmt_arena_alloc -
+ * @arena:	arena to allocate from
+ * @size:	number of bytes
+ *
+ * Returns suitably aligned memory that remains valid until the arena is
+ * released. There is no way to free individual allocations.
+ */
+void *pmt_arena_alloc(struct pmt_arena *arena, size_t size)
+{
+	struct pmt_arena_chunk *c = arena->head;
+	void *ret;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (c == NULL || c->size - c->used < size) {
+		c = arena_chunk_new(arena, size);
+		if (c == NULL) {
+			l0g("%s: %s\n", __func__, strerror(errno));
+			return NULL;
+		}
+	}
+	ret = chunk_data(c) + c->used;
+	c->used += size;
+	return ret;
+}
+
+void *pmt_arena_zalloc(struct pmt_arena *arena, size_t size)
+{
+	void *ret = pmt_arena_alloc(arena, size);
+
+	if (ret != NULL)
+		memset(ret, 0, size);
+	return ret;
+}
+
+char *pmt_arena_strdup(struct pmt_arena *arena, const char *src)
+{
+	size_t len;
+	char *ret;
+
+	if (src == NULL)
+		return NULL;
+	len = strlen(src) + 1;
+	if ((ret = pmt_arena_alloc(arena, len)) != NULL)
+		memcpy(ret, src, len);
+	return ret;
+}
+
+/**
+ * pmt_arena_release -
+ * @arena:	arena to empty
+ *
+ * Releases all memory of @arena at once. Secret arenas are wiped first.
+ * The arena can be reused afterwards.
+ */
+void pmt_arena_release(struct pmt_arena *arena)
+{
+	struct pmt_arena_chunk *c, *next;
+	size_t total;
+
+	for (c = arena->head; c != NULL; c = next) {
+		next = c->next;
+		total = c->size + ARENA_HDR_SIZE;
+		if (arena->flags & PMT_ARENA_SECRET) {
+			memset(chunk_data(c), 0, c->used);
+			munlock(c, total);
+			munmap(c, total);
+		} else {
+			free(c);
+		}
+	}
+	arena->head = NULL;
+}
+
+void pmt_arena_delete(struct pmt_arena *arena)
+{
+	if (arena == NULL)
+		return;
+	pmt_arena_release(arena);
+	free(arena);
+}
@@ -0,0 +1,109 @@
+/*
+ *	Optional backends, loaded on demand
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include "config.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libHX/defs.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * Every program that loads the PAM stack (sudo, su, cron, sshd) would map and
+ * relocate libcryptsetup, OpenSSL, libmount and PCRE2 if pam_mount linked
+ * them, although most of those programs never mount anything. The code that
+ * needs them therefore lives in small modules in CMT_BACKEND_DIR, which are
+ * only dlopen()ed by the first call that really needs one. They stay loaded
+ * for the rest of the process; libcryptsetup and OpenSSL do not take well
+ * to being unloaded.
+ *
+ * A module "foo-bar.so" provides its operations table as "foo_bar_ops".
+ */
+struct ehd_backend {
+	char name[32];
+	const void *ops;
+};
+
+static struct ehd_backend ehd_backends[8];
+static const char *ehd_backend_path = CMT_BACKEND_DIR;
+static pthread_mutex_t ehd_backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const void *ehd_backend_open(const char *name)
+{
+	char path[256], sym[48], *p;
+	const void *ops;
+	void *handle;
+
+	snprintf(path, sizeof(path), "%s/%s.so", ehd_backend_path, name);
+	snprintf(sym, sizeof(sym), "%s_ops", name);
+	for (p = sym; *p != '\0'; ++p)
+		if (*p == '-')
+			*p = '_';
+
+	if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		l0g("could not load backend: %s\n", dlerror());
+		return NULL;
+	}
+	if ((ops = dlsym(handle, sym)) == NULL) {
+		l0g("%s: %s\n", path, dlerror());
+		dlclose(handle);
+		return NULL;
+	}
+	w4rn("loaded backend %s\n", path);
+	return ops;
+}
+
+/**
+ * ehd_backend_dir - load backend modules from elsewhere
+ * @dir:	directory, which must stay valid
+ *
+ * For programs that run from the build tree (bench-*). This is deliberately
+ * not taken from the environment, which a setuid mount.crypt could be handed
+ * by anyone. Only affects modules that have not been loaded yet.
+ */
+EXPORT_SYMBOL void ehd_backend_dir(const char *dir)
+{
+	pthread_mutex_lock(&ehd_backend_lock);
+	ehd_backend_path = dir;
+	pthread_mutex_unlock(&ehd_backend_lock);
+}
+
+/**
+ * ehd_backend_load - get the operations table of a backend module
+ * @name:	module name, e.g. "cmt-dmcrypt"
+ *
+ * Loads the module on first use. Returns %NULL if it is not installed or
+ * broken (which is logged, once).
+ */
+EXPORT_SYMBOL const void *ehd_backend_load(const char *name)
+{
+	struct ehd_backend *be;
+	const void *ops = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&ehd_backend_lock);
+	for (i = 0; i < ARRAY_SIZE(ehd_backends); ++i) {
+		be = &ehd_backends[i];
+		if (*be->name == '\0') {
+			/* Failures are remembered too, so as to log once. */
+			HX_strlcpy(be->name, name, sizeof(be->name));
+			be->ops = ehd_backend_open(name);
+		} else if (strcmp(be->name, name) != 0) {
+			continue;
+		}
+		ops = be->ops;
+		break;
+	}
+	pthread_mutex_unlock(&ehd_backend_lock);
+	return ops;
+}
@@ -0,0 +1,313 @@
+/*
+ *	Microbenchmark of configuration parsing and volume conditions
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libHX/defs.h>
+#include <libHX/init.h>
+#include <libHX/option.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * In-memory NSS: these definitions take precedence over the C library's,
+ * so that the measurement does not depend on nsswitch.conf, nscd or a
+ * directory server. The user "bench" has primary group "users" and is a
+ * member of g0..g31.
+ */
+enum {
+	BC_UID = 1000,
+	BC_GID = 100,
+	BC_SGRP_BASE = 2000,
+	BC_NSGRP = 32,
+};
+
+static struct passwd bc_pw = {
+	.pw_name = "bench", .pw_passwd = "x", .pw_uid = BC_UID,
+	.pw_gid = BC_GID, .pw_gecos = "", .pw_dir = "/home/bench",
+	.pw_shell = "/bin/sh",
+};
+
+struct passwd *getpwnam(const char *name)
+{
+	if (strcmp(name, bc_pw.pw_name) == 0)
+		return &bc_pw;
+	errno = 0;
+	return NULL;
+}
+
+struct passwd *getpwuid(uid_t uid)
+{
+	if (uid == bc_pw.pw_uid)
+		return &bc_pw;
+	errno = 0;
+	return NULL;
+}
+
+struct group *getgrgid(gid_t gid)
+{
+	static char name[16];
+	static char *members[] = {"bench", NULL};
+	static struct group gr = {.gr_name = name, .gr_passwd = "x",
+	                          .gr_mem = members};
+
+	if (gid == BC_GID)
+		HX_strlcpy(name, "users", sizeof(name));
+	else if (gid >= BC_SGRP_BASE && gid < BC_SGRP_BASE + BC_NSGRP)
+		snprintf(name, sizeof(name), "g%u", gid - BC_SGRP_BASE);
+	else {
+		errno = 0;
+		return NULL;
+	}
+	gr.gr_gid = gid;
+	return &gr;
+}
+
+struct group *getgrnam(const char *name)
+{
+	unsigned int n;
+
+	if (strcmp(name, "users") == 0)
+		return getgrgid(BC_GID);
+	if (sscanf(name, "g%u", &n) == 1 && n < BC_NSGRP)
+		return getgrgid(BC_SGRP_BASE + n);
+	errno = 0;
+	return NULL;
+}
+
+int getgrouplist(const char *user, gid_t group, gid_t *groups, int *ngroups)
+{
+	int n = 1 + BC_NSGRP, i;
+
+	if (strcmp(user, bc_pw.pw_name) != 0)
+		n = 1;
+	if (*ngroups < n) {
+		*ngroups = n;
+		return -1;
+	}
+	groups[0] = (n > 1) ? BC_GID : group;
+	for (i = 1; i < n; ++i)
+		groups[i] = BC_SGRP_BASE + i - 1;
+	*ngroups = n;
+	return n;
+}
+
+/*
+ * Benchmark proper
+ */
+static unsigned int bc_volumes = 200, bc_depth = 8, bc_iter = 200;
+
+static bool bc_get_options(int *argc, const char ***argv)
+{
+	static const struct HXoption options_table[] = {
+		{.sh = 'D', .type = HXTYPE_UINT, .ptr = &bc_depth,
+		 .help = "Nesting depth of boolean conditions", .htyp = "n"},
+		{.sh = 'i', .type = HXTYPE_UINT, .ptr = &bc_iter,
+		 .help = "Iterations per scenario", .htyp = "n"},
+		{.sh = 'n', .type = HXTYPE_UINT, .ptr = &bc_volumes,
+		 .help = "Volumes per configuration", .htyp = "n"},
+		HXOPT_AUTOHELP,
+		HXOPT_TABLEEND,
+	};
+	if (HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) !=
+	    HXOPT_ERR_SUCCESS)
+		return false;
+	if (bc_iter == 0) {
+		fprintf(stderr, "-i must be positive\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * bc_gen_nested - emit a condition tree that evaluates to true
+ * @depth:	remaining depth
+ *
+ * Cycles through <and>, <or>, <not> and <xor> so that every evaluator is
+ * exercised and no branch can be short-circuited away.
+ */
+static void bc_gen_nested(FILE *fp, unsigned int depth)
+{
+	if (depth == 0) {
+		fprintf(fp, "<user>bench</user>");
+		return;
+	}
+	switch (depth % 4) {
+	case 0:
+		fprintf(fp, "<and>");
+		bc_gen_nested(fp, depth - 1);
+		fprintf(fp, "<uid>%u</uid></and>", BC_UID);
+		break;
+	case 1:
+		fprintf(fp, "<or><gid>9999</gid>");
+		bc_gen_nested(fp, depth - 1);
+		fprintf(fp, "</or>");
+		break;
+	case 2:
+		fprintf(fp, "<not><not>");
+		bc_gen_nested(fp, depth - 1);
+		fprintf(fp, "</not></not>");
+		break;
+	case 3:
+		fprintf(fp, "<xor>");
+		bc_gen_nested(fp, depth - 1);
+		fprintf(fp, "<pgrp>g0</pgrp></xor>");
+		break;
+	}
+}
+
+enum bc_scenario {
+	BC_FLAT,
+	BC_NESTED,
+	BC_REGEX,
+};
+
+static bool bc_write(const char *file, enum bc_scenario sc)
+{
+	unsigned int i;
+	FILE *fp;
+
+	if ((fp = fopen(file, "w")) == NULL) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return false;
+	}
+	fprintf(fp, "<?xml version=\"1.0\"?>\n<pam_mount>\n"
+	        "<debug enable=\"0\" />\n");
+	for (i = 0; i < bc_volumes; ++i) {
+		fprintf(fp, "<volume%s fstype=\"tmpfs\" path=\"none\" "
+		        "mountpoint=\"~/v%u\" options=\"size=%uk,mode=0700\">",
+		        sc == BC_FLAT ? " user=\"bench\"" : "", i, 64 + i);
+		if (sc == BC_NESTED)
+			bc_gen_nested(fp, bc_depth);
+		else if (sc == BC_REGEX)
+			fprintf(fp, "<user regex=\"1\" icase=\"1\">^BEN.*</user>"
+			        "<sgrp regex=\"1\">^g3[01]$</sgrp>");
+		fprintf(fp, "</volume>\n");
+	}
+	fprintf(fp, "</pam_mount>\n");
+	return fclose(fp) == 0;
+}
+
+static int bc_cmp(const void *a, const void *b)
+{
+	uint64_t x = *static_cast(const uint64_t *, a);
+	uint64_t y = *static_cast(const uint64_t *, b);
+	return (x > y) - (x < y);
+}
+
+static void bc_report(const char *what, uint64_t *v)
+{
+	qsort(v, bc_iter, sizeof(*v), bc_cmp);
+	printf(" %s p50=%llu p99=%llu", what,
+	       static_cast(unsigned long long, v[bc_iter/2]),
+	       static_cast(unsigned long long, v[(bc_iter * 99) / 100]));
+}
+
+static bool bc_run(const char *name, enum bc_scenario sc)
+{
+	char file[] = "/tmp/pmt-bench-config.XXXXXX";
+	uint64_t *parse, *expand, *auth;
+	unsigned long long t0, t1, t2;
+	struct config config;
+	unsigned int i, nvol = 0;
+	bool ok = true;
+	int fd;
+
+	if ((fd = mkstemp(file)) < 0) {
+		perror("mkstemp");
+		return false;
+	}
+	close(fd);
+	parse  = calloc(bc_iter, sizeof(*parse));
+	expand = calloc(bc_iter, sizeof(*expand));
+	auth   = calloc(bc_iter, sizeof(*auth));
+	if (parse == NULL || expand == NULL || auth == NULL ||
+	    !bc_write(file, sc)) {
+		ok = false;
+		goto out;
+	}
+
+	for (i = 0; i < bc_iter && ok; ++i) {
+		initconfig(&config);
+		config.user = xstrdup(bc_pw.pw_name);
+		t0 = ehd_trace_clock();
+		ok = readconfig(file, true, &config, PMT_CONF_ALL);
+		t1 = ehd_trace_clock();
+		ok = ok && expandconfig(&config);
+		t2 = ehd_trace_clock();
+		parse[i]  = (t1 - t0) / 1000;
+		expand[i] = (t2 - t1) / 1000;
+		nvol = config.volume_list.items;
+		/* freeconfig() drops a libHX reference, as in clean_config() */
+		HX_init();
+		freeconfig(&config);
+
+		/* what the auth stage reads */
+		initconfig(&config);
+		config.user = xstrdup(bc_pw.pw_name);
+		t0 = ehd_trace_clock();
+		ok = ok && readconfig(file, true, &config, PMT_CONF_AUTH);
+		auth[i] = (ehd_trace_clock() - t0) / 1000;
+		HX_init();
+		freeconfig(&config);
+	}
+	if (!ok) {
+		fprintf(stderr, "%s: configuration failed to load\n", name);
+		goto out;
+	}
+	if (nvol != bc_volumes)
+		fprintf(stderr, "%s: only %u of %u volumes matched\n",
+		        name, nvol, bc_volumes);
+	printf("%-7s", name);
+	bc_report("readconfig", parse);
+	bc_report("expandconfig", expand);
+	bc_report("readconfig(auth)", auth);
+	printf(" us\n");
+ out:
+	unlink(file);
+	free(parse);
+	free(expand);
+	free(auth);
+	return ok;
+}
+
+int main(int argc, const char **argv)
+{
+	int ret;
+
+	ret = HX_init();
+	if (ret <= 0) {
+		fprintf(stderr, "HX_init: %s\n", strerror(errno));
+		abort();
+	}
+	/* use the backend modules from the build tree */
+	ehd_backend_dir(BENCH_BACKEND_DIR);
+	if (!bc_get_options(&argc, &argv))
+		return EXIT_FAILURE;
+	ehd_logctl(EHD_LOGFT_NOSYSLOG, EHD_LOG_SET);
+
+	printf("%u volumes, condition depth %u, %u iterations\n",
+	       bc_volumes, bc_depth, bc_iter);
+	ret = EXIT_SUCCESS;
+	if (!bc_run("flat", BC_FLAT))
+		ret = EXIT_FAILURE;
+	if (!bc_run("nested", BC_NESTED))
+		ret = EXIT_FAILURE;
+	if (!bc_run("regex", BC_REGEX))
+		ret = EXIT_FAILURE;
+	HX_exit();
+	return ret;
+}
@@ -0,0 +1,388 @@
+/*
+ *	Benchmark of loop and dm-crypt setup/teardown
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libHX/defs.h>
+#include <libHX/init.h>
+#include <libHX/option.h>
+#include <libHX/string.h>
+#include <libcryptsetup.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * Each iteration runs ehd_load() and ehd_unload() on a sparse container
+ * file, the same way mount.crypt does minus the mount. The stage times come
+ * from the trace records libcryptmount already produces (see <trace> in
+ * pam_mount.conf(5)); they are written to a scratch file and read back.
+ */
+enum be_stage {
+	BE_LOOP,
+	BE_LOOPWAIT,
+	BE_CRYPTLOAD,
+	BE_KDF,
+	BE_ACTIVATE,
+	BE_UNLOCK,
+	BE_DMWAIT,
+	BE_LOAD,
+	BE_UNLOAD,
+	__BE_MAX,
+};
+
+static const char *const be_stage_name[] = {
+	[BE_LOOP]      = "loop setup",
+	[BE_LOOPWAIT]  = "loop node wait",
+	[BE_CRYPTLOAD] = "crypt_load",
+	[BE_KDF]       = "kdf",
+	[BE_ACTIVATE]  = "activate",
+	[BE_UNLOCK]    = "kdf+activate",
+	[BE_DMWAIT]    = "dm node wait",
+	[BE_LOAD]      = "ehd_load",
+	[BE_UNLOAD]    = "ehd_unload",
+};
+
+static unsigned int be_iter = 20, be_size = 32, be_itertime, be_keybits = 256;
+static char *be_type = "luks1", *be_cipher = "aes-xts-plain64";
+static char *be_dir = "/tmp";
+static const char be_password[] = "bench-ehd";
+
+static bool be_get_options(int *argc, const char ***argv)
+{
+	static const struct HXoption options_table[] = {
+		{.sh = 'T', .type = HXTYPE_UINT, .ptr = &be_itertime,
+		 .help = "LUKS KDF iteration time (default: library default)",
+		 .htyp = "ms"},
+		{.sh = 'c', .type = HXTYPE_STRING, .ptr = &be_cipher,
+		 .help = "Cipher (cryptsetup name)", .htyp = "spec"},
+		{.sh = 'd', .type = HXTYPE_STRING, .ptr = &be_dir,
+		 .help = "Directory for the container file", .htyp = "dir"},
+		{.sh = 'i', .type = HXTYPE_UINT, .ptr = &be_iter,
+		 .help = "Iterations", .htyp = "n"},
+		{.sh = 'k', .type = HXTYPE_UINT, .ptr = &be_keybits,
+		 .help = "Key size", .htyp = "bits"},
+		{.sh = 's', .type = HXTYPE_UINT, .ptr = &be_size,
+		 .help = "Container size", .htyp = "MiB"},
+		{.sh = 't', .type = HXTYPE_STRING, .ptr = &be_type,
+		 .help = "Container type: luks1, luks2 or plain", .htyp = "type"},
+		HXOPT_AUTOHELP,
+		HXOPT_TABLEEND,
+	};
+	if (HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) !=
+	    HXOPT_ERR_SUCCESS)
+		return false;
+	if (be_iter == 0 || be_size == 0 || be_keybits == 0) {
+		fprintf(stderr, "-i, -k and -s must be positive\n");
+		return false;
+	}
+	if (strcmp(be_type, "luks1") != 0 && strcmp(be_type, "luks2") != 0 &&
+	    strcmp(be_type, "plain") != 0) {
+		fprintf(stderr, "Unknown container type \"%s\"\n", be_type);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * be_format - write a LUKS header to @file
+ */
+static bool be_format(const char *file)
+{
+	const char *type = CRYPT_LUKS1;
+	struct crypt_device *cd;
+	char cipher[32], *mode;
+	int ret;
+
+	if (strcmp(be_type, "luks2") == 0) {
+#ifdef CRYPT_LUKS2
+		type = CRYPT_LUKS2;
+#else
+		fprintf(stderr, "libcryptsetup has no LUKS2 support\n");
+		return false;
+#endif
+	}
+	HX_strlcpy(cipher, be_cipher, sizeof(cipher));
+	mode = strchr(cipher, '-');
+	if (mode != NULL)
+		*mode++ = '\0';
+	else
+		mode = "plain";
+
+	ret = crypt_init(&cd, file);
+	if (ret < 0) {
+		fprintf(stderr, "crypt_init: %s: %s\n", file, strerror(-ret));
+		return false;
+	}
+	if (be_itertime != 0)
+		crypt_set_iteration_time(cd, be_itertime);
+	ret = crypt_format(cd, type, cipher, mode, NULL, NULL,
+	      (be_keybits + CHAR_BIT - 1) / CHAR_BIT, NULL);
+	if (ret < 0)
+		fprintf(stderr, "crypt_format: %s\n", strerror(-ret));
+	else if ((ret = crypt_keyslot_add_by_volume_key(cd, CRYPT_ANY_SLOT,
+	    NULL, 0, be_password, strlen(be_password))) < 0)
+		fprintf(stderr, "crypt_keyslot_add_by_volume_key: %s\n",
+		        strerror(-ret));
+	crypt_free(cd);
+	return ret >= 0;
+}
+
+/**
+ * be_container - create the sparse container file
+ * @file:	mkstemp() template, receives the name
+ */
+static bool be_container(char *file)
+{
+	int fd;
+
+	if ((fd = mkstemp(file)) < 0) {
+		fprintf(stderr, "mkstemp %s: %s\n", file, strerror(errno));
+		return false;
+	}
+	if (ftruncate(fd, static_cast(off_t, be_size) << 20) < 0) {
+		fprintf(stderr, "ftruncate: %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return strcmp(be_type, "plain") == 0 || be_format(file);
+}
+
+static struct ehd_mount_request *be_request(const char *file)
+{
+	struct ehd_mount_request *rq;
+	char name[32];
+
+	snprintf(name, sizeof(name), "bench-ehd-%u",
+	         static_cast(unsigned int, getpid()));
+	if ((rq = ehd_mtreq_new()) == NULL)
+		return NULL;
+	if (ehd_mtreq_set(rq, EHD_MTREQ_CONTAINER, file) < 0 ||
+	    ehd_mtreq_set(rq, EHD_MTREQ_CRYPTONAME, name) < 0 ||
+	    ehd_mtreq_set(rq, EHD_MTREQ_FS_CIPHER, be_cipher) < 0 ||
+	    ehd_mtreq_set(rq, EHD_MTREQ_FS_HASH, "sha512") < 0 ||
+	    ehd_mtreq_set(rq, EHD_MTREQ_TRUNC_KEYSIZE,
+	    be_keybits / CHAR_BIT) < 0 ||
+	    ehd_mtreq_set(rq, EHD_MTREQ_KEY_SIZE, strlen(be_password)) < 0 ||
+	    ehd_mtreq_set(rq, EHD_MTREQ_KEY_DATA, be_password) < 0 ||
+	    ehd_mtreq_set(rq, EHD_MTREQ_READONLY, EHD_LOSETUP_RW) < 0 ||
+	    ehd_mtreq_set(rq, EHD_MTREQ_LAST_STAGE,
+	    EHD_MTREQ_STAGE_CRYPTO) < 0) {
+		ehd_mtreq_free(rq);
+		return NULL;
+	}
+	return rq;
+}
+
+/**
+ * be_parse - take the stage times out of one trace record
+ * @line:	"trace <tag> pid=N rc=N total=N stage[:label]@start=dur ..."
+ * @v:		receives the durations, in microseconds
+ *
+ * devwait occurs twice; the one before "crypt" is for the loop device.
+ */
+static void be_parse(char *line, uint64_t *v)
+{
+	bool crypt_seen = false;
+	unsigned long long dur;
+	char *tok, *at, *colon;
+
+	for (tok = strtok(line, " \n"); tok != NULL; tok = strtok(NULL, " \n")) {
+		if ((at = strrchr(tok, '@')) == NULL ||
+		    sscanf(at, "@%*u=%llu", &dur) != 1)
+			continue;
+		*at = '\0';
+		if ((colon = strchr(tok, ':')) != NULL)
+			*colon = '\0';
+		if (strcmp(tok, "loop") == 0)
+			v[BE_LOOP] = dur;
+		else if (strcmp(tok, "devwait") == 0)
+			v[crypt_seen ? BE_DMWAIT : BE_LOOPWAIT] = dur;
+		else if (strcmp(tok, "cryptload") == 0)
+			v[BE_CRYPTLOAD] = dur;
+		else if (strcmp(tok, "kdf") == 0)
+			v[BE_KDF] = dur;
+		else if (strcmp(tok, "activate") == 0)
+			v[BE_ACTIVATE] = dur;
+		else if (strcmp(tok, "kdf+activate") == 0)
+			v[BE_UNLOCK] = dur;
+		else if (strcmp(tok, "crypt") == 0)
+			crypt_seen = true;
+	}
+}
+
+static bool be_all_zero(const uint64_t *v, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		if (v[i] != 0)
+			return false;
+	return true;
+}
+
+static int be_cmp(const void *a, const void *b)
+{
+	uint64_t x = *static_cast(const uint64_t *, a);
+	uint64_t y = *static_cast(const uint64_t *, b);
+	return (x > y) - (x < y);
+}
+
+static void be_report(const char *what, uint64_t *v, size_t n)
+{
+	qsort(v, n, sizeof(*v), be_cmp);
+	printf("%-14s p50=%llu p99=%llu max=%llu us\n", what,
+	       static_cast(unsigned long long, v[n/2]),
+	       static_cast(unsigned long long, v[(n * 99) / 100]),
+	       static_cast(unsigned long long, v[n-1]));
+}
+
+static bool be_run(const char *file, const char *tracefile)
+{
+	struct ehd_mount_request *rq;
+	struct ehd_mount_info *mt;
+	unsigned long long t0, t1;
+	uint64_t *v, *stage;
+	unsigned int i, s;
+	hxmc_t *line = NULL;
+	bool ok = true;
+	FILE *fp;
+	int ret;
+
+	if ((rq = be_request(file)) == NULL) {
+		fprintf(stderr, "ehd_mtreq_set: %s\n", strerror(errno));
+		return false;
+	}
+	v = calloc(__BE_MAX * be_iter, sizeof(*v));
+	stage = malloc(be_iter * sizeof(*stage));
+	if (v == NULL || stage == NULL) {
+		perror("malloc");
+		ok = false;
+		goto out;
+	}
+
+	ehd_trace_sink(tracefile);
+	for (i = 0; i < be_iter && ok; ++i) {
+		ehd_trace_begin("bench-ehd");
+		t0 = ehd_trace_clock();
+		ret = ehd_load(rq, &mt);
+		t1 = ehd_trace_clock();
+		if (ret <= 0) {
+			fprintf(stderr, "ehd_load: %s\n",
+			        strerror(ret < 0 ? -ret : ENXIO));
+			ehd_trace_end(ret);
+			ok = false;
+			break;
+		}
+		v[BE_LOAD * be_iter + i] = (t1 - t0) / 1000;
+		ret = ehd_unload(mt);
+		v[BE_UNLOAD * be_iter + i] = (ehd_trace_clock() - t1) / 1000;
+		ehd_mtinfo_free(mt);
+		free(mt);
+		ehd_trace_end(ret);
+		if (ret <= 0) {
+			fprintf(stderr, "ehd_unload: %s\n", strerror(-ret));
+			ok = false;
+		}
+	}
+	if (!ok)
+		goto out;
+
+	if ((fp = fopen(tracefile, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", tracefile, strerror(errno));
+		ok = false;
+		goto out;
+	}
+	for (i = 0; i < be_iter && HX_getl(&line, fp) != NULL; ++i) {
+		uint64_t d[__BE_MAX] = {};
+
+		be_parse(line, d);
+		for (s = 0; s < BE_LOAD; ++s)
+			v[s * be_iter + i] = d[s];
+	}
+	HXmc_free(line);
+	fclose(fp);
+
+	for (s = 0; s < __BE_MAX; ++s) {
+		/* plain mappings have no header and no KDF */
+		if (s == BE_CRYPTLOAD && strcmp(be_type, "plain") == 0)
+			continue;
+		if (s == BE_KDF && strcmp(be_type, "plain") == 0)
+			continue;
+		/* LUKS without keycache is timed as one kdf+activate */
+		if ((s == BE_KDF || s == BE_ACTIVATE || s == BE_UNLOCK) &&
+		    be_all_zero(&v[s * be_iter], be_iter))
+			continue;
+		memcpy(stage, &v[s * be_iter], be_iter * sizeof(*stage));
+		be_report(be_stage_name[s], stage, be_iter);
+	}
+ out:
+	free(v);
+	free(stage);
+	ehd_mtreq_free(rq);
+	return ok;
+}
+
+int main(int argc, const char **argv)
+{
+	hxmc_t *file = NULL, *tracefile = NULL;
+	int ret;
+
+	ret = HX_init();
+	if (ret <= 0) {
+		fprintf(stderr, "HX_init: %s\n", strerror(errno));
+		abort();
+	}
+	/* use the backend modules from the build tree */
+	ehd_backend_dir(BENCH_BACKEND_DIR);
+	if (!be_get_options(&argc, &argv))
+		return EXIT_FAILURE;
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s: loop and dm-crypt setup needs root\n",
+		        HX_basename(*argv));
+		return EXIT_FAILURE;
+	}
+	ret = cryptmount_init();
+	if (ret <= 0) {
+		fprintf(stderr, "cryptmount_init: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	ehd_logctl(EHD_LOGFT_NOSYSLOG, EHD_LOG_SET);
+
+	file = HXmc_strinit(be_dir);
+	HXmc_strcat(&file, "/pmt-bench-ehd.XXXXXX");
+	tracefile = HXmc_strinit(be_dir);
+	HXmc_strcat(&tracefile, "/pmt-bench-ehd.trace.XXXXXX");
+	ret = mkstemp(tracefile);
+	if (ret < 0) {
+		fprintf(stderr, "mkstemp %s: %s\n", tracefile, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	close(ret);
+
+	ret = EXIT_FAILURE;
+	if (be_container(file)) {
+		printf("%u iterations, %s %s/%u, %u MiB sparse container in "
+		       "%s\n", be_iter, be_type, be_cipher, be_keybits,
+		       be_size, be_dir);
+		if (be_run(file, tracefile))
+			ret = EXIT_SUCCESS;
+		unlink(file);
+	}
+	unlink(tracefile);
+	HXmc_free(file);
+	HXmc_free(tracefile);
+	cryptmount_exit();
+	HX_exit();
+	return ret;
+}
@@ -0,0 +1,44 @@
+/*
+ *	Stand-in for mount/umount/fsck/ofl/pmvarrun in bench-session
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Usage: bench-helper <role> <delay_us> [args...]
+ *
+ * Sleeps for the given time to simulate a slow file server or fsck, then
+ * succeeds. "mount" drains the password from stdin like a real helper would;
+ * "pmvarrun" prints a login count derived from the operation argument.
+ */
+int main(int argc, const char **argv)
+{
+	unsigned long delay;
+	struct timespec ts;
+	char buf[256];
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s role delay_us [args...]\n", *argv);
+		return EXIT_FAILURE;
+	}
+	if (strcmp(argv[1], "mount") == 0)
+		while (read(STDIN_FILENO, buf, sizeof(buf)) > 0)
+			;
+	delay = strtoul(argv[2], NULL, 0);
+	if (delay > 0) {
+		ts.tv_sec  = delay / 1000000;
+		ts.tv_nsec = (delay % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+	if (strcmp(argv[1], "pmvarrun") == 0)
+		printf("%d\n", argc > 3 && strtol(argv[3], NULL, 0) > 0);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,467 @@
+/*
+ *	Contention benchmark of pmvarrun and the cmtab/smtab files
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libHX/defs.h>
+#include <libHX/init.h>
+#include <libHX/io.h>
+#include <libHX/option.h>
+#include <libHX/string.h>
+#include "cmt-internal.h"
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * This program is built with RUNDIR pointing into the build directory, and
+ * mtab.c with an SMTAB of its own, so that nothing here touches the live
+ * /run/pam_mount, cmtab or /etc/mtab. BENCH_PMVARRUN is pmvarrun compiled
+ * with the same RUNDIR.
+ */
+enum bm_op {
+	BM_INC,
+	BM_DEC,
+	BM_CADD,
+	BM_SADD,
+	BM_CGET,
+	BM_SREM,
+	BM_CREM,
+	__BM_MAX,
+};
+
+static const char *const bm_op_name[] = {
+	[BM_INC]  = "pmvarrun +1",
+	[BM_DEC]  = "pmvarrun -1",
+	[BM_CADD] = "cmtab_add",
+	[BM_SADD] = "smtab_add",
+	[BM_CGET] = "cmtab_get",
+	[BM_SREM] = "smtab_remove",
+	[BM_CREM] = "cmtab_remove",
+};
+
+static unsigned int bm_jobs = 16, bm_iter = 500, bm_preload = 100;
+static const char bm_refdir[] = RUNDIR "/pam_mount";
+
+static bool bm_get_options(int *argc, const char ***argv)
+{
+	static const struct HXoption options_table[] = {
+		{.sh = 'i', .type = HXTYPE_UINT, .ptr = &bm_iter,
+		 .help = "Operations per worker and phase", .htyp = "n"},
+		{.sh = 'j', .type = HXTYPE_UINT, .ptr = &bm_jobs,
+		 .help = "Concurrent workers", .htyp = "n"},
+		{.sh = 'p', .type = HXTYPE_UINT, .ptr = &bm_preload,
+		 .help = "Entries that stay in the mtabs throughout", .htyp = "n"},
+		HXOPT_AUTOHELP,
+		HXOPT_TABLEEND,
+	};
+	if (HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) !=
+	    HXOPT_ERR_SUCCESS)
+		return false;
+	if (bm_iter == 0 || bm_jobs == 0) {
+		fprintf(stderr, "-i and -j must be positive\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * bm_clean - empty the benchmark run directory
+ */
+static void bm_clean(const char *user)
+{
+	hxmc_t *refcount = HXmc_strinit(bm_refdir);
+
+	HXmc_strcat(&refcount, "/");
+	HXmc_strcat(&refcount, user);
+	unlink(refcount);
+	HXmc_free(refcount);
+	rmdir(bm_refdir);
+	unlink(pmt_cmtab_path());
+	unlink(pmt_smtab_path());
+	HX_mkdir(RUNDIR, S_IRWXU);
+}
+
+/**
+ * bm_pmvarrun - run pmvarrun like pam_mount does and read the new count
+ * @user:	user whose login count to change
+ * @amount:	increment
+ * @count:	receives the count printed by pmvarrun
+ */
+static bool bm_pmvarrun(const char *user, long amount, long *count)
+{
+	char arg[24], buf[24];
+	ssize_t have = 0, ret;
+	int fd[2], status;
+	pid_t pid;
+
+	if (pipe(fd) < 0)
+		return false;
+	snprintf(arg, sizeof(arg), "%ld", amount);
+	pid = fork();
+	if (pid == 0) {
+		dup2(fd[1], STDOUT_FILENO);
+		close(fd[0]);
+		close(fd[1]);
+		execl(BENCH_PMVARRUN, "pmvarrun", "-u", user, "-o", arg, NULL);
+		_exit(127);
+	}
+	close(fd[1]);
+	if (pid < 0) {
+		close(fd[0]);
+		return false;
+	}
+	while (have < sizeof(buf) - 1 &&
+	    (ret = read(fd[0], buf + have, sizeof(buf) - 1 - have)) > 0)
+		have += ret;
+	buf[have] = '\0';
+	close(fd[0]);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		return false;
+	return sscanf(buf, "%ld", count) == 1;
+}
+
+/**
+ * bm_worker_pmvarrun - alternate login and logout of the same user
+ *
+ * With @bm_jobs workers, a count outside 1..jobs after an increment (or
+ * 0..jobs-1 after a decrement) means an update was lost or duplicated.
+ */
+static void bm_worker_pmvarrun(const char *user, uint64_t **lat,
+    uint32_t *anomalies)
+{
+	unsigned long long t0;
+	unsigned int i;
+	long count;
+	bool ok;
+
+	for (i = 0; i < bm_iter; ++i) {
+		t0 = ehd_trace_clock();
+		ok = bm_pmvarrun(user, 1, &count);
+		lat[BM_INC][i] = (ehd_trace_clock() - t0) / 1000;
+		if (!ok || count < 1 || count > bm_jobs)
+			++*anomalies;
+
+		t0 = ehd_trace_clock();
+		ok = bm_pmvarrun(user, -1, &count);
+		lat[BM_DEC][i] = (ehd_trace_clock() - t0) / 1000;
+		if (!ok || count < 0 || count >= bm_jobs)
+			++*anomalies;
+	}
+}
+
+static void bm_entry(struct ehd_mount_info *mt, const char *tag,
+    unsigned int k)
+{
+	static char mountpoint[64], container[64], crypto[64];
+
+	snprintf(mountpoint, sizeof(mountpoint), "/bench/%s/m%u", tag, k);
+	snprintf(container, sizeof(container), "/bench/img/%s-%u", tag, k);
+	snprintf(crypto, sizeof(crypto), "/dev/mapper/bench-%s-%u", tag, k);
+	memset(mt, 0, sizeof(*mt));
+	mt->mountpoint    = mountpoint;
+	mt->container     = container;
+	mt->crypto_device = crypto;
+}
+
+/**
+ * bm_lookup - check that @mt is recorded in both cmtab and smtab
+ */
+static bool bm_lookup(const struct ehd_mount_info *mt)
+{
+	char *mountpoint, *container, *loop_device, *crypto_device;
+	bool ok;
+	int ret;
+
+	ret = pmt_cmtab_get(mt->mountpoint, CMTABF_MOUNTPOINT, &mountpoint,
+	      &container, &loop_device, &crypto_device);
+	if (ret <= 0)
+		return false;
+	ok = ret == PMT_BY_CRYPTODEV && loop_device == NULL &&
+	     strcmp(container, mt->container) == 0 &&
+	     strcmp(crypto_device, mt->crypto_device) == 0;
+	free(mountpoint);
+	free(container);
+	free(loop_device);
+	free(crypto_device);
+	return ok;
+}
+
+/**
+ * bm_worker_mtab - the mount.crypt/umount.crypt bookkeeping sequence
+ *
+ * Each iteration records a new container in cmtab and smtab, looks it up
+ * and removes it again, while all other workers do the same.
+ */
+static void bm_worker_mtab(unsigned int w, uint64_t **lat,
+    uint32_t *anomalies)
+{
+	struct ehd_mount_info mt;
+	unsigned long long t0;
+	char tag[16];
+	unsigned int i;
+	int ret;
+
+	snprintf(tag, sizeof(tag), "w%u", w);
+	for (i = 0; i < bm_iter; ++i) {
+		bm_entry(&mt, tag, i);
+
+		t0 = ehd_trace_clock();
+		ret = pmt_cmtab_add(&mt);
+		lat[BM_CADD][i] = (ehd_trace_clock() - t0) / 1000;
+		if (ret <= 0)
+			++*anomalies;
+
+		t0 = ehd_trace_clock();
+		ret = pmt_smtab_add(mt.crypto_device, mt.mountpoint,
+		      "ext4", "rw");
+		lat[BM_SADD][i] = (ehd_trace_clock() - t0) / 1000;
+		if (ret <= 0)
+			++*anomalies;
+
+		t0 = ehd_trace_clock();
+		ret = bm_lookup(&mt);
+		lat[BM_CGET][i] = (ehd_trace_clock() - t0) / 1000;
+		if (!ret)
+			++*anomalies;
+
+		t0 = ehd_trace_clock();
+		ret = pmt_smtab_remove(mt.mountpoint, SMTABF_MOUNTPOINT);
+		lat[BM_SREM][i] = (ehd_trace_clock() - t0) / 1000;
+		if (ret != 1)
+			++*anomalies;
+
+		t0 = ehd_trace_clock();
+		ret = pmt_cmtab_remove(mt.mountpoint);
+		lat[BM_CREM][i] = (ehd_trace_clock() - t0) / 1000;
+		if (ret != 1)
+			++*anomalies;
+	}
+}
+
+static int bm_cmp(const void *a, const void *b)
+{
+	uint64_t x = *static_cast(const uint64_t *, a);
+	uint64_t y = *static_cast(const uint64_t *, b);
+	return (x > y) - (x < y);
+}
+
+static void bm_report(const char *what, uint64_t *v, size_t n)
+{
+	qsort(v, n, sizeof(*v), bm_cmp);
+	printf("%-14s p50=%llu p99=%llu max=%llu us\n", what,
+	       static_cast(unsigned long long, v[n/2]),
+	       static_cast(unsigned long long, v[(n * 99) / 100]),
+	       static_cast(unsigned long long, v[n-1]));
+}
+
+static unsigned int bm_count_lines(const char *file)
+{
+	unsigned int n = 0;
+	hxmc_t *line = NULL;
+	FILE *fp;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		return 0;
+	while (HX_getl(&line, fp) != NULL)
+		++n;
+	HXmc_free(line);
+	fclose(fp);
+	return n;
+}
+
+/**
+ * bm_phase - run one kind of worker on all cores and report
+ * @first:	first operation of the phase
+ * @last:	last operation of the phase
+ *
+ * Returns the number of anomalies reported by the workers.
+ */
+static unsigned long bm_phase(const char *user, enum bm_op first,
+    enum bm_op last)
+{
+	size_t per_op = static_cast(size_t, bm_iter) * bm_jobs, i;
+	uint64_t *lat[__BM_MAX], *samples;
+	unsigned long long t0, elapsed;
+	unsigned long anomalies = 0;
+	uint32_t *wanom;
+	unsigned int w, op;
+	pid_t pid;
+
+	samples = mmap(NULL, __BM_MAX * per_op * sizeof(*samples) +
+	          bm_jobs * sizeof(*wanom), PROT_READ | PROT_WRITE,
+	          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (samples == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	wanom = reinterpret_cast(uint32_t *, &samples[__BM_MAX * per_op]);
+
+	t0 = ehd_trace_clock();
+	for (w = 0; w < bm_jobs; ++w) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		} else if (pid > 0) {
+			continue;
+		}
+		for (op = 0; op < __BM_MAX; ++op)
+			lat[op] = &samples[op * per_op + w * bm_iter];
+		if (first == BM_INC)
+			bm_worker_pmvarrun(user, lat, &wanom[w]);
+		else
+			bm_worker_mtab(w, lat, &wanom[w]);
+		_exit(EXIT_SUCCESS);
+	}
+	while (wait(NULL) > 0)
+		;
+	elapsed = ehd_trace_clock() - t0;
+
+	for (op = first; op <= last; ++op)
+		bm_report(bm_op_name[op], &samples[op * per_op], per_op);
+	printf("throughput     %.1f ops/s\n",
+	       per_op * (last - first + 1) * 1e9 / elapsed);
+	for (i = 0; i < bm_jobs; ++i)
+		anomalies += wanom[i];
+	munmap(samples, __BM_MAX * per_op * sizeof(*samples) +
+	       bm_jobs * sizeof(*wanom));
+	return anomalies;
+}
+
+/**
+ * bm_check_refcount - the login count must be back to zero
+ *
+ * pmvarrun unlinks the file when the count drops to zero (or blanks it
+ * if it may not unlink), so both count as consistent.
+ */
+static bool bm_check_refcount(const char *user)
+{
+	hxmc_t *file = HXmc_strinit(bm_refdir);
+	char buf[24] = {};
+	bool ok = true;
+	ssize_t ret;
+	int fd;
+
+	HXmc_strcat(&file, "/");
+	HXmc_strcat(&file, user);
+	if ((fd = open(file, O_RDONLY)) >= 0) {
+		ret = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		ok = ret == 0 || (ret > 0 && strtol(buf, NULL, 0) == 0);
+		if (!ok)
+			fprintf(stderr, "%s: final count is %s\n", file, buf);
+	}
+	HXmc_free(file);
+	return ok;
+}
+
+/**
+ * bm_check_mtab - only the preloaded entries may be left, all intact
+ */
+static bool bm_check_mtab(void)
+{
+	struct ehd_mount_info mt;
+	unsigned int i, lines;
+	bool ok = true;
+
+	lines = bm_count_lines(pmt_cmtab_path());
+	if (lines != bm_preload) {
+		fprintf(stderr, "%s: %u lines, expected %u\n",
+		        pmt_cmtab_path(), lines, bm_preload);
+		ok = false;
+	}
+	lines = bm_count_lines(pmt_smtab_path());
+	if (lines != bm_preload) {
+		fprintf(stderr, "%s: %u lines, expected %u\n",
+		        pmt_smtab_path(), lines, bm_preload);
+		ok = false;
+	}
+	for (i = 0; i < bm_preload; ++i) {
+		bm_entry(&mt, "static", i);
+		if (!bm_lookup(&mt)) {
+			fprintf(stderr, "preloaded entry %s lost or damaged\n",
+			        mt.mountpoint);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+int main(int argc, const char **argv)
+{
+	struct ehd_mount_info mt;
+	const struct passwd *pw;
+	unsigned long anomalies;
+	unsigned int i;
+	char *user;
+	int ret;
+
+	ret = HX_init();
+	if (ret <= 0) {
+		fprintf(stderr, "HX_init: %s\n", strerror(errno));
+		abort();
+	}
+	if (!bm_get_options(&argc, &argv))
+		return EXIT_FAILURE;
+	if ((pw = getpwuid(getuid())) == NULL) {
+		fprintf(stderr, "Cannot determine invoking user\n");
+		return EXIT_FAILURE;
+	}
+	user = HX_strdup(pw->pw_name);
+	ehd_logctl(EHD_LOGFT_NOSYSLOG, EHD_LOG_SET);
+	bm_clean(user);
+	ret = EXIT_SUCCESS;
+	printf("%u worker(s) x %u operations, %u preloaded mtab entries, "
+	       "rundir " RUNDIR "\n", bm_jobs, bm_iter, bm_preload);
+
+	/* pmvarrun chowns the count file to root's group, as in real use. */
+	if (geteuid() != 0) {
+		fprintf(stderr, "Note: not running as root; skipping the "
+		        "pmvarrun phase.\n");
+	} else {
+		anomalies = bm_phase(user, BM_INC, BM_DEC);
+		if (!bm_check_refcount(user))
+			++anomalies;
+		printf("pmvarrun       %lu anomalies\n", anomalies);
+		if (anomalies > 0)
+			ret = EXIT_FAILURE;
+	}
+
+	for (i = 0; i < bm_preload; ++i) {
+		bm_entry(&mt, "static", i);
+		if (pmt_cmtab_add(&mt) <= 0 ||
+		    pmt_smtab_add(mt.crypto_device, mt.mountpoint,
+		    "ext4", "rw") <= 0) {
+			fprintf(stderr, "Could not preload the mtabs\n");
+			return EXIT_FAILURE;
+		}
+	}
+	anomalies = bm_phase(user, BM_CADD, BM_CREM);
+	if (!bm_check_mtab())
+		++anomalies;
+	printf("mtab           %lu anomalies\n", anomalies);
+	if (anomalies > 0)
+		ret = EXIT_FAILURE;
+
+	bm_clean(user);
+	free(user);
+	HX_exit();
+	return ret;
+}
@@ -0,0 +1,430 @@
+/*
+ *	Benchmark of the complete open/close session path
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#	include <linux/perf_event.h>
+#endif
+#include <libHX/defs.h>
+#include <libHX/init.h>
+#include <libHX/option.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * A minimal stand-in for libpam, just enough for pam_mount.c. Linking the
+ * module sources into this program (instead of dlopening pam_mount.so
+ * through the real libpam) keeps the measurement free of PAM stack noise.
+ */
+struct pam_handle {
+	const char *user;
+	const void *authtok;
+	struct {
+		char name[32];
+		void *data;
+		void (*cleanup)(pam_handle_t *, void *, int);
+	} data[8];
+	unsigned int ndata;
+};
+
+int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt)
+{
+	*user = pamh->user;
+	return PAM_SUCCESS;
+}
+
+int pam_get_item(const pam_handle_t *pamh, int type, const void **item)
+{
+	if (type != PAM_AUTHTOK)
+		return PAM_SERVICE_ERR;
+	*item = pamh->authtok;
+	return PAM_SUCCESS;
+}
+
+int pam_set_item(pam_handle_t *pamh, int type, const void *item)
+{
+	if (type != PAM_AUTHTOK)
+		return PAM_SERVICE_ERR;
+	pamh->authtok = item;
+	return PAM_SUCCESS;
+}
+
+int pam_get_data(const pam_handle_t *pamh, const char *name,
+    const void **data)
+{
+	unsigned int i;
+
+	for (i = 0; i < pamh->ndata; ++i)
+		if (strcmp(pamh->data[i].name, name) == 0) {
+			*data = pamh->data[i].data;
+			return PAM_SUCCESS;
+		}
+	return PAM_NO_MODULE_DATA;
+}
+
+int pam_set_data(pam_handle_t *pamh, const char *name, void *data,
+    void (*cleanup)(pam_handle_t *, void *, int))
+{
+	unsigned int i;
+
+	for (i = 0; i < pamh->ndata; ++i)
+		if (strcmp(pamh->data[i].name, name) == 0)
+			break;
+	if (i == ARRAY_SIZE(pamh->data))
+		return PAM_SERVICE_ERR;
+	if (i < pamh->ndata && pamh->data[i].cleanup != NULL)
+		pamh->data[i].cleanup(pamh, pamh->data[i].data, 0);
+	else if (i == pamh->ndata)
+		++pamh->ndata;
+	HX_strlcpy(pamh->data[i].name, name, sizeof(pamh->data[i].name));
+	pamh->data[i].data    = data;
+	pamh->data[i].cleanup = cleanup;
+	return PAM_SUCCESS;
+}
+
+const char *pam_getenv(pam_handle_t *pamh, const char *name)
+{
+	return NULL;
+}
+
+int pam_putenv(pam_handle_t *pamh, const char *name_value)
+{
+	return PAM_SUCCESS;
+}
+
+const char *pam_strerror(pam_handle_t *pamh, int errnum)
+{
+	return "PAM error";
+}
+
+static void bench_pam_end(pam_handle_t *pamh)
+{
+	while (pamh->ndata > 0) {
+		--pamh->ndata;
+		if (pamh->data[pamh->ndata].cleanup != NULL)
+			pamh->data[pamh->ndata].cleanup(pamh,
+				pamh->data[pamh->ndata].data, PAM_SUCCESS);
+	}
+}
+
+/*
+ * Benchmark proper
+ */
+struct bench_sample {
+	uint64_t open_us, close_us;
+};
+
+static unsigned int bn_volumes = 4, bn_conds = 2, bn_iter = 100;
+static unsigned int bn_jobs = 1, bn_delay;
+static char *bn_workdir;
+
+static bool bn_get_options(int *argc, const char ***argv)
+{
+	static const struct HXoption options_table[] = {
+		{.sh = 'd', .type = HXTYPE_UINT, .ptr = &bn_delay,
+		 .help = "Helper latency in microseconds", .htyp = "usec"},
+		{.sh = 'i', .type = HXTYPE_UINT, .ptr = &bn_iter,
+		 .help = "Sessions per worker", .htyp = "n"},
+		{.sh = 'j', .type = HXTYPE_UINT, .ptr = &bn_jobs,
+		 .help = "Concurrent workers", .htyp = "n"},
+		{.sh = 'm', .type = HXTYPE_UINT, .ptr = &bn_conds,
+		 .help = "User conditions per volume", .htyp = "n"},
+		{.sh = 'n', .type = HXTYPE_UINT, .ptr = &bn_volumes,
+		 .help = "Number of volumes", .htyp = "n"},
+		{.sh = 'w', .type = HXTYPE_STRING, .ptr = &bn_workdir,
+		 .help = "Directory for mountpoints", .htyp = "dir"},
+		HXOPT_AUTOHELP,
+		HXOPT_TABLEEND,
+	};
+	if (HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) !=
+	    HXOPT_ERR_SUCCESS)
+		return false;
+	if (bn_iter == 0 || bn_jobs == 0) {
+		fprintf(stderr, "-i and -j must be positive\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * bn_write_config - generate the configuration read by pam_mount.c
+ *
+ * Every volume carries @bn_conds conditions, all of which are true for
+ * the invoking user, so that all of them need to be evaluated.
+ */
+static bool bn_write_config(const struct passwd *pw, const char *group)
+{
+	static const char *const roles[] = {
+		"lclmount", "mount", "umount", "umount", "fsck", "fsck",
+		"ofl", "ofl", "pmvarrun", "pmvarrun",
+	};
+	static const char *const argtail[] = {
+		"%(VOLUME) %(MNTPT)", "%(MNTPT)", "%(FSCKTARGET)", "%(MNTPT)",
+		"%(OPERATION)",
+	};
+	unsigned int i, j;
+	char mnt[256];
+	FILE *fp;
+
+	if ((fp = fopen(CONFIGFILE, "w")) == NULL) {
+		fprintf(stderr, "%s: %s\n", CONFIGFILE, strerror(errno));
+		return false;
+	}
+	fprintf(fp, "<?xml version=\"1.0\"?>\n<pam_mount>\n"
+	        "<debug enable=\"0\" />\n<mkmountpoint enable=\"0\" />\n"
+	        "<logout wait=\"0\" hup=\"yes\" />\n");
+	for (i = 0; i < ARRAY_SIZE(roles); i += 2)
+		fprintf(fp, "<%s>%s %s %u %s</%s>\n", roles[i], BENCH_HELPER,
+		        roles[i+1], bn_delay, argtail[i/2], roles[i]);
+
+	for (i = 0; i < bn_volumes; ++i) {
+		snprintf(mnt, sizeof(mnt), "%s/v%u", bn_workdir, i);
+		if (mkdir(mnt, S_IRWXU) < 0 && errno != EEXIST) {
+			fprintf(stderr, "mkdir %s: %s\n", mnt, strerror(errno));
+			fclose(fp);
+			return false;
+		}
+		fprintf(fp, "<volume fstype=\"ext4\" path=\"/dev/null\" "
+		        "mountpoint=\"%s\"%s>\n", mnt,
+		        geteuid() != 0 ? " noroot=\"1\"" : "");
+		for (j = 0; j < bn_conds; ++j)
+			switch (j % 4) {
+			case 0:
+				fprintf(fp, "\t<user>%s</user>\n", pw->pw_name);
+				break;
+			case 1:
+				fprintf(fp, "\t<uid>%u-%u</uid>\n",
+				        static_cast(unsigned int, pw->pw_uid),
+				        static_cast(unsigned int, pw->pw_uid));
+				break;
+			case 2:
+				fprintf(fp, "\t<pgrp>%s</pgrp>\n", group);
+				break;
+			case 3:
+				fprintf(fp, "\t<not><user>%s-not</user></not>\n",
+				        pw->pw_name);
+				break;
+			}
+		fprintf(fp, "</volume>\n");
+	}
+	fprintf(fp, "</pam_mount>\n");
+	return fclose(fp) == 0;
+}
+
+/**
+ * bn_syscall_counter - count syscalls of this process and its children
+ *
+ * Uses the raw_syscalls:sys_enter tracepoint, which needs tracefs and
+ * sufficient perf_event privileges. Returns -1 if unavailable.
+ */
+static int bn_syscall_counter(void)
+{
+#ifdef __linux__
+	static const char *const idfile[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	};
+	struct perf_event_attr attr;
+	unsigned long long id;
+	unsigned int i;
+	FILE *fp = NULL;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(idfile) && fp == NULL; ++i)
+		fp = fopen(idfile[i], "r");
+	if (fp == NULL)
+		return -1;
+	ret = fscanf(fp, "%llu", &id);
+	fclose(fp);
+	if (ret != 1)
+		return -1;
+	memset(&attr, 0, sizeof(attr));
+	attr.type    = PERF_TYPE_TRACEPOINT;
+	attr.size    = sizeof(attr);
+	attr.config  = id;
+	attr.inherit = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static void bn_worker(unsigned int w, struct bench_sample *out,
+    int64_t *syscalls, const char *user)
+{
+	struct pam_handle pamh;
+	unsigned long long t0, t1, t2;
+	uint64_t count = 0;
+	unsigned int i;
+	int fd;
+
+	fd = bn_syscall_counter();
+	for (i = 0; i < bn_iter; ++i) {
+		memset(&pamh, 0, sizeof(pamh));
+		pamh.user    = user;
+		pamh.authtok = "benchpw";
+		pam_sm_authenticate(&pamh, 0, 0, NULL);
+		t0 = ehd_trace_clock();
+		pam_sm_open_session(&pamh, 0, 0, NULL);
+		t1 = ehd_trace_clock();
+		pam_sm_close_session(&pamh, 0, 0, NULL);
+		t2 = ehd_trace_clock();
+		bench_pam_end(&pamh);
+		out[i].open_us  = (t1 - t0) / 1000;
+		out[i].close_us = (t2 - t1) / 1000;
+	}
+	if (fd >= 0 && read(fd, &count, sizeof(count)) == sizeof(count))
+		syscalls[w] = count;
+	else
+		syscalls[w] = -1;
+}
+
+static int bn_cmp(const void *a, const void *b)
+{
+	uint64_t x = *static_cast(const uint64_t *, a);
+	uint64_t y = *static_cast(const uint64_t *, b);
+	return (x > y) - (x < y);
+}
+
+static void bn_report(const char *what, uint64_t *v, size_t n)
+{
+	qsort(v, n, sizeof(*v), bn_cmp);
+	printf("%-14s p50=%llu p99=%llu max=%llu us\n", what,
+	       static_cast(unsigned long long, v[n/2]),
+	       static_cast(unsigned long long, v[(n * 99) / 100]),
+	       static_cast(unsigned long long, v[n-1]));
+}
+
+static int bn_run(const char *user)
+{
+	size_t total = static_cast(size_t, bn_iter) * bn_jobs, i;
+	unsigned long long t0, elapsed;
+	struct bench_sample *samples;
+	int64_t *syscalls, sc_sum = 0;
+	uint64_t *v;
+	unsigned int w;
+	pid_t pid;
+
+	samples = mmap(NULL, total * sizeof(*samples) +
+	          bn_jobs * sizeof(*syscalls), PROT_READ | PROT_WRITE,
+	          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (samples == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+	syscalls = reinterpret_cast(int64_t *, &samples[total]);
+
+	t0 = ehd_trace_clock();
+	for (w = 0; w < bn_jobs; ++w) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		} else if (pid == 0) {
+			bn_worker(w, &samples[w * bn_iter], syscalls, user);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	while (wait(NULL) > 0)
+		;
+	elapsed = ehd_trace_clock() - t0;
+
+	printf("%u worker(s) x %u sessions, %u volumes, %u conditions, "
+	       "helper delay %u us\n", bn_jobs, bn_iter, bn_volumes,
+	       bn_conds, bn_delay);
+	if ((v = malloc(total * sizeof(*v))) == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < total; ++i)
+		v[i] = samples[i].open_us;
+	bn_report("open_session", v, total);
+	for (i = 0; i < total; ++i)
+		v[i] = samples[i].close_us;
+	bn_report("close_session", v, total);
+	for (i = 0; i < total; ++i)
+		v[i] = samples[i].open_us + samples[i].close_us;
+	bn_report("session", v, total);
+	printf("throughput     %.1f sessions/s\n", total * 1e9 / elapsed);
+
+	for (w = 0; w < bn_jobs; ++w) {
+		if (syscalls[w] < 0) {
+			sc_sum = -1;
+			break;
+		}
+		sc_sum += syscalls[w];
+	}
+	if (sc_sum >= 0)
+		printf("syscalls       %.1f per session\n",
+		       static_cast(double, sc_sum) / total);
+	else
+		printf("syscalls       n/a (raw_syscalls tracepoint not "
+		       "accessible)\n");
+	free(v);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, const char **argv)
+{
+	char tmpl[] = "/tmp/pmt-bench.XXXXXX";
+	const struct passwd *pw;
+	const struct group *gr;
+	char *user, *group;
+	int ret;
+
+	ret = HX_init();
+	if (ret <= 0) {
+		fprintf(stderr, "HX_init: %s\n", strerror(errno));
+		abort();
+	}
+	/* use the backend modules from the build tree */
+	ehd_backend_dir(BENCH_BACKEND_DIR);
+	if (!bn_get_options(&argc, &argv))
+		return EXIT_FAILURE;
+	if (bn_workdir == NULL && (bn_workdir = mkdtemp(tmpl)) == NULL) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	if ((pw = getpwuid(getuid())) == NULL) {
+		fprintf(stderr, "Cannot determine invoking user\n");
+		return EXIT_FAILURE;
+	}
+	user = HX_strdup(pw->pw_name);
+	gr = getgrgid(pw->pw_gid);
+	group = HX_strdup(gr != NULL ? gr->gr_name : "");
+	if (geteuid() != 0)
+		fprintf(stderr, "Note: not running as root; helpers that "
+		        "pam_mount always starts as root (umount, pmvarrun) "
+		        "will fail.\n");
+	if (!bn_write_config(pw, group))
+		return EXIT_FAILURE;
+
+	/* pam_mount must not flood syslog from a benchmark. */
+	ehd_logctl(EHD_LOGFT_NOSYSLOG, EHD_LOG_SET);
+	ret = bn_run(user);
+	free(user);
+	free(group);
+	HX_exit();
+	return ret;
+}
@@ -5,6 +5,10 @@
 #include <libHX/string.h>
 #include "libcryptmount.h"
 
+/* OpenSSL's EVP_CIPHER and EVP_MD */
+struct evp_cipher_st;
+struct evp_md_st;
+
 /**
  * struct ehd_mount - EHD mount info
  * @container:		path to disk image
@@ -41,6 +45,8 @@ struct ehd_mount_info {
 + * @last_stage:		stop after setup of given component
  * @readonly:		whether to create a readonly vfsmount
  * @allow_discards:	allow fs trim requests
+ * @keycache:		seconds to keep the LUKS volume key in the kernel
+ * 			keyring (0: do not cache)
  */
 struct ehd_mount_request {
 	char *container, *crypto_name, *fstype, *mount_opts, *mountpoint;
@@ -48,17 +54,48 @@ struct ehd_mount_request {
 	void *key_data;
 	ehd_hook_fn_t loop_hook, crypto_hook;
 	void *hook_priv;
-	unsigned int key_size, trunc_keysize;
+	unsigned int key_size, trunc_keysize, keycache;
 	enum ehd_mtreq_stage last_stage;
 	bool readonly, allow_discards;
 };
 
+/**
+ * struct ehd_keydec_request - parameter agglomerator for ehd_kdreq_final
+ * @keyfile:	path to the key file
+ * @digest:	digest used for the key file
+ * @cipher:	cipher used for the key file
+ * @password:	password to unlock the key material
+ */
+struct ehd_keydec_request {
+	char *keyfile, *digest, *cipher, *password;
+	const struct evp_cipher_st *s_cipher;
+	const struct evp_md_st *s_digest;
+	const unsigned char *d_salt, *d_text;
+	hxmc_t *d_result;
+	unsigned int d_keysize;
+};
+
+/**
+ * struct ehd_crypto_ops - crypto device backend
+ * @is_luks:	check for a LUKS header (optional)
+ * @verify:	check a key against an active mapping (optional)
+ *
+ * dm-crypt is provided by the "cmt-dmcrypt" module, see backend.c.
+ */
 struct ehd_crypto_ops {
+	int (*is_luks)(const char *, bool);
 	int (*load)(const struct ehd_mount_request *, struct ehd_mount_info *);
 	int (*unload)(const struct ehd_mount_info *);
+	int (*verify)(const struct ehd_mount_request *, const char *);
+};
+
+/**
+ * struct ehd_keydec_ops - key file decryption, the "cmt-openssl" module
+ */
+struct ehd_keydec_ops {
+	int (*run)(struct ehd_keydec_request *, hxmc_t **);
 };
 
 extern const struct ehd_crypto_ops ehd_cgd_ops;
-extern const struct ehd_crypto_ops ehd_dmcrypt_ops;
 
 #endif /* _CMT_INTERNAL_H */
@@ -6,20 +6,32 @@
  *	as published by the Free Software Foundation; either version 2.1
  *	of the License, or (at your option) any later version.
  */
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <linux/keyctl.h>
 #include <libHX/ctype_helper.h>
 #include <libHX/defs.h>
 #include <libHX/proc.h>
 #include <libHX/string.h>
 #include <libcryptsetup.h>
+#include "config.h"
 #include "cmt-internal.h"
 #include "libcryptmount.h"
 #include "pam_mount.h"
+#ifdef HAVE_LIBCRYPTO
+#	include <openssl/crypto.h>
+#	include <openssl/evp.h>
+#	include <openssl/hmac.h>
+#	include <openssl/rand.h>
+#endif
 
 #ifndef CRYPT_LUKS
 	#define CRYPT_LUKS	NULL /* Passing NULL to crypt_load will
@@ -32,7 +44,7 @@
  * @path:	path to the crypto container
  * @blkdev:	path is definitely a block device
  */
-EXPORT_SYMBOL int ehd_is_luks(const char *path, bool blkdev)
+static int dmc_is_luks(const char *path, bool blkdev)
 {
 	struct crypt_device *cd;
 	const char *device = path;
@@ -88,12 +100,408 @@ static hxmc_t *dmc_crypto_name(const struct ehd_mount_request *req,
 	return ret;
 }
 
+/*
+ * Volume key cache
+ *
+ * After a LUKS volume has been unlocked with "keycache", its volume key is
+ * stored in a "user" key in the user keyring of the caller (root, as
+ * mount.crypt runs as root), described as "pam_mount:<LUKS UUID>". Later
+ * unlocks of the same volume activate with that key and skip the KDF --
+ * but only if the passphrase matches the verifier stored with it, so the
+ * cache does not unlock anything for someone who does not know the
+ * passphrase. The verifier is an HMAC-SHA256 of the passphrase keyed by the
+ * volume key; a plain hash would let anyone who gets to read it test
+ * passphrase guesses far faster than the LUKS KDF allows, whereas this one
+ * is worthless without the volume key itself. The key expires @timeout
+ * seconds after its last use or after the volume was last closed, whichever
+ * is later.
+ */
+#if defined(HAVE_LIBCRYPTO) && defined(__NR_add_key) && defined(__NR_keyctl)
+struct dmc_keycache_hdr {
+	uint32_t timeout;
+	unsigned char verifier[32];
+};
+
+static bool dmc_keycache_desc(struct crypt_device *cd, char *buf, size_t size)
+{
+	const char *uuid = crypt_get_uuid(cd);
+
+	if (uuid == NULL)
+		return false;
+	snprintf(buf, size, "pam_mount:%s", uuid);
+	return true;
+}
+
+static long dmc_key_find(const char *desc)
+{
+	return syscall(__NR_keyctl, KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING,
+	       "user", desc, 0);
+}
+
+static long dmc_keycache_find(struct crypt_device *cd)
+{
+	char desc[80];
+
+	if (!dmc_keycache_desc(cd, desc, sizeof(desc)))
+		return -1;
+	return dmc_key_find(desc);
+}
+
+static bool dmc_keycache_verifier(const struct ehd_mount_request *req,
+    const void *vk, size_t vk_size, unsigned char *out)
+{
+	/* SHA-256, so @out is sizeof(hdr->verifier) */
+	return HMAC(EVP_sha256(), vk, vk_size, req->key_data, req->key_size,
+	       out, NULL) != NULL;
+}
+
+/**
+ * dmc_keycache_get - fetch a cached volume key
+ * @vk:		buffer of @vk_size bytes for the key
+ *
+ * Returns true if a key for the volume was found and the passphrase in @req
+ * matches it.
+ */
+static bool dmc_keycache_get(struct crypt_device *cd,
+    const struct ehd_mount_request *req, char *vk, size_t vk_size)
+{
+	struct dmc_keycache_hdr *hdr;
+	unsigned char verifier[sizeof(hdr->verifier)];
+	size_t size = sizeof(*hdr) + vk_size;
+	bool ret = false;
+	long id, len;
+
+	if ((id = dmc_keycache_find(cd)) < 0)
+		return false;
+	if ((hdr = malloc(size)) == NULL)
+		return false;
+	len = syscall(__NR_keyctl, KEYCTL_READ, id, hdr, size);
+	if (len != size || !dmc_keycache_verifier(req, hdr + 1, vk_size,
+	    verifier) || CRYPTO_memcmp(verifier, hdr->verifier,
+	    sizeof(verifier)) != 0) {
+		w4rn("volume key cache: no usable entry\n");
+		goto out;
+	}
+	memcpy(vk, hdr + 1, vk_size);
+	syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, id, req->keycache);
+	ret = true;
+ out:
+	OPENSSL_cleanse(verifier, sizeof(verifier));
+	OPENSSL_cleanse(hdr, size);
+	free(hdr);
+	return ret;
+}
+
+/**
+ * dmc_keycache_put - cache a volume key after a successful unlock
+ */
+static void dmc_keycache_put(struct crypt_device *cd,
+    const struct ehd_mount_request *req, const char *vk, size_t vk_size)
+{
+	struct dmc_keycache_hdr *hdr;
+	size_t size = sizeof(*hdr) + vk_size;
+	char desc[80];
+	long id;
+
+	if (!dmc_keycache_desc(cd, desc, sizeof(desc)))
+		return;
+	if ((hdr = malloc(size)) == NULL)
+		return;
+	hdr->timeout = req->keycache;
+	if (!dmc_keycache_verifier(req, vk, vk_size, hdr->verifier))
+		goto out;
+	memcpy(hdr + 1, vk, vk_size);
+	id = syscall(__NR_add_key, "user", desc, hdr, size,
+	     KEY_SPEC_USER_KEYRING);
+	if (id < 0)
+		w4rn("volume key cache: add_key: %s\n", strerror(errno));
+	else
+		syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, id, req->keycache);
+ out:
+	OPENSSL_cleanse(hdr, size);
+	free(hdr);
+}
+
+/**
+ * dmc_keycache_drop - revoke a cached key that did not work
+ */
+static void dmc_keycache_drop(struct crypt_device *cd)
+{
+	long id = dmc_keycache_find(cd);
+
+	if (id >= 0)
+		syscall(__NR_keyctl, KEYCTL_REVOKE, id);
+}
+
+/**
+ * dmc_keycache_touch - restart the expiry when a volume is closed
+ * @name:	dm name of the active volume
+ */
+static void dmc_keycache_touch(const char *name)
+{
+	struct dmc_keycache_hdr *hdr = NULL;
+	struct crypt_device *cd;
+	long id, len;
+
+	if (crypt_init_by_name(&cd, name) < 0)
+		return;
+	if ((id = dmc_keycache_find(cd)) < 0)
+		goto out;
+	/* KEYCTL_READ copies nothing into a buffer that is too small. */
+	len = syscall(__NR_keyctl, KEYCTL_READ, id, NULL, 0);
+	if (len < static_cast(long, sizeof(*hdr)) ||
+	    (hdr = malloc(len)) == NULL)
+		goto out;
+	if (syscall(__NR_keyctl, KEYCTL_READ, id, hdr, len) == len)
+		syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, id, hdr->timeout);
+	OPENSSL_cleanse(hdr, len);
+	free(hdr);
+ out:
+	crypt_free(cd);
+}
+
+/*
+ * Mapping verifier
+ *
+ * When a LUKS mapping has been set up, a "user" key
+ * "pam_mount-verify:<dm name>" is put next to the key cache entries, holding
+ * the LUKS UUID, a random key and the HMAC-SHA256 of the passphrase under
+ * that random key. A later mount.crypt that wants to share the mapping, or
+ * mount one left by -p, compares against that instead of running the KDF
+ * again. Like the key cache, it is only readable by root; it is revoked when
+ * the mapping is closed.
+ */
+struct dmc_verifier {
+	char uuid[40];
+	unsigned char hkey[32];
+	unsigned char mac[32];
+};
+
+static void dmc_verifier_desc(char *buf, size_t size, const char *name)
+{
+	snprintf(buf, size, "pam_mount-verify:%s", name);
+}
+
+static bool dmc_verifier_mac(const struct ehd_mount_request *req,
+    const struct dmc_verifier *v, unsigned char *out)
+{
+	return HMAC(EVP_sha256(), v->hkey, sizeof(v->hkey), req->key_data,
+	       req->key_size, out, NULL) != NULL;
+}
+
+/**
+ * dmc_verifier_put - remember the passphrase that opened a mapping
+ * @name:	dm name of the mapping
+ *
+ * An entry that is already there, e.g. for the passphrase of another
+ * keyslot, is kept.
+ */
+static void dmc_verifier_put(struct crypt_device *cd,
+    const struct ehd_mount_request *req, const char *name)
+{
+	const char *uuid = crypt_get_uuid(cd);
+	struct dmc_verifier v;
+	char desc[80];
+
+	dmc_verifier_desc(desc, sizeof(desc), name);
+	if (uuid == NULL || dmc_key_find(desc) >= 0)
+		return;
+	memset(&v, 0, sizeof(v));
+	HX_strlcpy(v.uuid, uuid, sizeof(v.uuid));
+	if (RAND_bytes(v.hkey, sizeof(v.hkey)) == 1 &&
+	    dmc_verifier_mac(req, &v, v.mac) &&
+	    syscall(__NR_add_key, "user", desc, &v, sizeof(v),
+	    KEY_SPEC_USER_KEYRING) < 0)
+		w4rn("mapping verifier: add_key: %s\n", strerror(errno));
+	OPENSSL_cleanse(&v, sizeof(v));
+}
+
+/**
+ * dmc_verifier_check - compare a passphrase with the mapping's verifier
+ * @cd:		crypt device of the active mapping
+ * @name:	its dm name
+ *
+ * Returns 1 if it is the passphrase the mapping was made with, 0 if not, or
+ * -1 if there is no usable verifier.
+ */
+static int dmc_verifier_check(struct crypt_device *cd,
+    const struct ehd_mount_request *req, const char *name)
+{
+	const char *uuid = crypt_get_uuid(cd);
+	struct dmc_verifier v;
+	unsigned char mac[sizeof(v.mac)];
+	char desc[80];
+	long id;
+	int ret = -1;
+
+	dmc_verifier_desc(desc, sizeof(desc), name);
+	if (uuid == NULL || (id = dmc_key_find(desc)) < 0)
+		return -1;
+	/* A mapping of another volume under the same name: stale */
+	if (syscall(__NR_keyctl, KEYCTL_READ, id, &v, sizeof(v)) ==
+	    sizeof(v) && strcmp(v.uuid, uuid) == 0 &&
+	    dmc_verifier_mac(req, &v, mac))
+		ret = CRYPTO_memcmp(mac, v.mac, sizeof(mac)) == 0;
+	else
+		syscall(__NR_keyctl, KEYCTL_REVOKE, id);
+	OPENSSL_cleanse(&v, sizeof(v));
+	OPENSSL_cleanse(mac, sizeof(mac));
+	return ret;
+}
+
+static void dmc_verifier_drop(const char *name)
+{
+	char desc[80];
+	long id;
+
+	dmc_verifier_desc(desc, sizeof(desc), name);
+	if ((id = dmc_key_find(desc)) >= 0)
+		syscall(__NR_keyctl, KEYCTL_REVOKE, id);
+}
+#else
+static bool dmc_keycache_get(struct crypt_device *cd,
+    const struct ehd_mount_request *req, char *vk, size_t vk_size)
+{
+	w4rn("keycache requested, but built without OpenSSL\n");
+	return false;
+}
+
+static void dmc_keycache_put(struct crypt_device *cd,
+    const struct ehd_mount_request *req, const char *vk, size_t vk_size)
+{
+}
+
+static void dmc_keycache_drop(struct crypt_device *cd)
+{
+}
+
+static void dmc_keycache_touch(const char *name)
+{
+}
+
+static void dmc_verifier_put(struct crypt_device *cd,
+    const struct ehd_mount_request *req, const char *name)
+{
+}
+
+static int dmc_verifier_check(struct crypt_device *cd,
+    const struct ehd_mount_request *req, const char *name)
+{
+	return -1;
+}
+
+static void dmc_verifier_drop(const char *name)
+{
+}
+#endif
+
+/**
+ * dmc_reencrypting - check for an interrupted LUKS2 reencryption
+ *
+ * Such a device needs the recovery that crypt_activate_by_passphrase()
+ * does; a bare volume key is not enough.
+ */
+static bool dmc_reencrypting(struct crypt_device *cd)
+{
+#ifdef CRYPT_REENCRYPT_INITIALIZE_ONLY
+	return crypt_reencrypt_status(cd, NULL) != CRYPT_REENCRYPT_NONE;
+#else
+	return false;
+#endif
+}
+
+/**
+ * dmc_activate_luks - unlock a LUKS keyslot and create the mapping
+ * @cd:		crypt device with the header already loaded
+ * @flags:	%CRYPT_ACTIVATE_* flags
+ *
+ * Normally just crypt_activate_by_passphrase(), traced as one kdf+activate
+ * stage. Only with "keycache" is the volume key handled here, so that it
+ * can be taken from, or put into, the key cache; that is done in locked
+ * memory, and the KDF and the device-mapper work are then traced apart.
+ */
+static int dmc_activate_luks(struct crypt_device *cd,
+    const struct ehd_mount_request *req, const struct ehd_mount_info *mt,
+    unsigned int flags)
+{
+	unsigned long long t;
+	volatile char *p;
+	size_t vk_size;
+	char *vk;
+	int ret;
+
+	if (req->keycache == 0 || dmc_reencrypting(cd)) {
+		t = ehd_trace_clock();
+		ret = crypt_activate_by_passphrase(cd, mt->crypto_name,
+		      CRYPT_ANY_SLOT, req->key_data, req->key_size, flags);
+		ehd_trace_add(EHD_TRACE_UNLOCK, mt->crypto_name, t);
+		if (ret < 0)
+			fprintf(stderr, "crypt_activate_by_passphrase: %s\n",
+			        strerror(-ret));
+		return ret;
+	}
+
+	ret = crypt_get_volume_key_size(cd);
+	if (ret <= 0) {
+		fprintf(stderr, "Could not determine the volume key size\n");
+		return -EINVAL;
+	}
+	vk_size = ret;
+	if ((vk = malloc(vk_size)) == NULL)
+		return -errno;
+	if (mlock(vk, vk_size) < 0) {
+		ret = -errno;
+		fprintf(stderr, "mlock: %s\n", strerror(errno));
+		free(vk);
+		return ret;
+	}
+
+	t = ehd_trace_clock();
+	if (dmc_keycache_get(cd, req, vk, vk_size)) {
+		ehd_trace_add(EHD_TRACE_KDF, "keycache", t);
+		t = ehd_trace_clock();
+		ret = crypt_activate_by_volume_key(cd, mt->crypto_name, vk,
+		      vk_size, flags);
+		ehd_trace_add(EHD_TRACE_ACTIVATE, mt->crypto_name, t);
+		if (ret >= 0)
+			goto out;
+		w4rn("cached volume key rejected (%s), running the KDF\n",
+		     strerror(-ret));
+		dmc_keycache_drop(cd);
+		t = ehd_trace_clock();
+	}
+	ret = crypt_volume_key_get(cd, CRYPT_ANY_SLOT, vk, &vk_size,
+	      req->key_data, req->key_size);
+	ehd_trace_add(EHD_TRACE_KDF, mt->crypto_name, t);
+	if (ret < 0) {
+		fprintf(stderr, "crypt_volume_key_get: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	t = ehd_trace_clock();
+	ret = crypt_activate_by_volume_key(cd, mt->crypto_name, vk, vk_size,
+	      flags);
+	ehd_trace_add(EHD_TRACE_ACTIVATE, mt->crypto_name, t);
+	if (ret < 0)
+		fprintf(stderr, "crypt_activate_by_volume_key: %s\n",
+		        strerror(-ret));
+	else
+		dmc_keycache_put(cd, req, vk, vk_size);
+ out:
+	for (p = vk; p < vk + vk_size; ++p)
+		*p = '\0';
+	munlock(vk, vk_size);
+	free(vk);
+	return ret;
+}
+
 static bool dmc_run(const struct ehd_mount_request *req,
     struct ehd_mount_info *mt)
 {
 	struct crypt_device *cd;
 	unsigned int flags = 0;
 	char *cipher = NULL, *mode;
+	unsigned long long t;
 	int ret;
 
 	ret = crypt_init(&cd, mt->lower_device);
@@ -112,15 +520,14 @@ static bool dmc_run(const struct ehd_mount_request *req,
 #endif
 	}
 
+	t = ehd_trace_clock();
 	ret = crypt_load(cd, CRYPT_LUKS, NULL);
+	ehd_trace_add(EHD_TRACE_CRYPTLOAD, mt->crypto_name, t);
 	if (ret == 0) {
-		ret = crypt_activate_by_passphrase(cd, mt->crypto_name,
-		      CRYPT_ANY_SLOT, req->key_data, req->key_size, flags);
-		if (ret < 0) {
-			fprintf(stderr, "crypt_activate_by_passphrase: %s\n",
-			        strerror(-ret));
+		ret = dmc_activate_luks(cd, req, mt, flags);
+		if (ret < 0)
 			goto out;
-		}
+		dmc_verifier_put(cd, req, mt->crypto_name);
 	} else {
 		struct crypt_params_plain params = {.hash = req->fs_hash};
 
@@ -143,6 +550,7 @@ static bool dmc_run(const struct ehd_mount_request *req,
 			goto out;
 		}
 
+		t = ehd_trace_clock();
 		if (strcmp(req->fs_hash, "plain") == 0)
 			ret = crypt_activate_by_volume_key(cd, mt->crypto_name,
 			      req->key_data, req->key_size, flags);
@@ -150,6 +558,7 @@ static bool dmc_run(const struct ehd_mount_request *req,
 			ret = crypt_activate_by_passphrase(cd, mt->crypto_name,
 			      CRYPT_ANY_SLOT, req->key_data, req->key_size,
 			      flags);
+		ehd_trace_add(EHD_TRACE_ACTIVATE, mt->crypto_name, t);
 		if (ret < 0) {
 			fprintf(stderr, "crypt_activate: %s\n", strerror(-ret));
 			if (ret == -EINVAL)
@@ -189,12 +598,64 @@ static int dmc_unload(const struct ehd_mount_info *mt)
 
 	cname = (mt->crypto_name != NULL) ? mt->crypto_name :
 	        HX_basename(mt->crypto_device);
+	dmc_keycache_touch(cname);
 	ret = crypt_deactivate(cd, cname);
+	if (ret >= 0)
+		dmc_verifier_drop(cname);
 	crypt_free(cd);
 	return (ret < 0) ? ret : 1;
 }
 
-const struct ehd_crypto_ops ehd_dmcrypt_ops = {
-	.load   = dmc_load,
-	.unload = dmc_unload,
+/**
+ * dmc_verify - check a passphrase against an active LUKS mapping
+ *
+ * The passphrase the mapping was made with is recognized from its verifier
+ * without any KDF work. Anything else (another keyslot's passphrase, or a
+ * mapping set up by other means) is tried on the keyslots, without
+ * activating anything. Plain mappings have no keyslot to check against, so
+ * they cannot be verified.
+ */
+static int dmc_verify(const struct ehd_mount_request *req,
+    const char *crypto_device)
+{
+	const char *name = HX_basename(crypto_device);
+	struct crypt_device *cd;
+	unsigned long long t;
+	const char *type;
+	int ret;
+
+	ret = crypt_init_by_name(&cd, name);
+	if (ret < 0)
+		return ret;
+	type = crypt_get_type(cd);
+	if (type == NULL || strncmp(type, "LUKS", 4) != 0) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+	t = ehd_trace_clock();
+	if (dmc_verifier_check(cd, req, name) > 0) {
+		ehd_trace_add(EHD_TRACE_KDF, "verifier", t);
+		ret = 1;
+		goto out;
+	}
+	ret = crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT,
+	      req->key_data, req->key_size, 0);
+	ehd_trace_add(EHD_TRACE_UNLOCK, name, t);
+	if (ret >= 0) {
+		dmc_verifier_put(cd, req, name);
+		ret = 1;
+	} else if (ret == -EPERM) {
+		ret = 0;
+	}
+ out:
+	crypt_free(cd);
+	return ret;
+}
+
+/* The "cmt-dmcrypt" module, see backend.c */
+EXPORT_SYMBOL const struct ehd_crypto_ops cmt_dmcrypt_ops = {
+	.is_luks = dmc_is_luks,
+	.load    = dmc_load,
+	.unload  = dmc_unload,
+	.verify  = dmc_verify,
 };
@@ -0,0 +1,123 @@
+/*
+ *	Key file decryption with OpenSSL
+ *	Copyright Jan Engelhardt, 2008-2011
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libHX/defs.h>
+#include <libHX/string.h>
+#include "config.h"
+#include "cmt-internal.h"
+#include "libcryptmount.h"
+#include "pam_mount.h"
+#include <openssl/evp.h>
+
+/*
+ * Built as the "cmt-openssl" module (see backend.c), so that only programs
+ * that decrypt a key file pay for loading libcrypto.
+ */
+#if OPENSSL_VERSION_NUMBER < 0x1010000fL
+static void __attribute__((constructor)) ossl_init(void)
+{
+	OpenSSL_add_all_algorithms();
+	OpenSSL_add_all_ciphers();
+	OpenSSL_add_all_digests();
+}
+#endif
+
+static int ehd_decrypt_key2(struct ehd_keydec_request *par)
+{
+	unsigned char key[EVP_MAX_KEY_LENGTH], iv[EVP_MAX_IV_LENGTH];
+	unsigned int out_cumul_len = 0;
+	EVP_CIPHER_CTX *ctx;
+	int out_len = 0;
+	hxmc_t *out;
+
+	if (EVP_BytesToKey(par->s_cipher, par->s_digest, par->d_salt,
+	    signed_cast(const unsigned char *, par->password),
+	    (par->password == NULL) ? 0 : strlen(par->password),
+	    1, key, iv) <= 0)
+		return EHD_KEYDEC_OTHER;
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL)
+		return EHD_KEYDEC_OTHER;
+
+	out = HXmc_meminit(NULL, par->d_keysize + EVP_CIPHER_block_size(par->s_cipher));
+	EVP_DecryptInit_ex(ctx, par->s_cipher, NULL, key, iv);
+	EVP_DecryptUpdate(ctx, signed_cast(unsigned char *,
+		&out[out_len]), &out_len, par->d_text, par->d_keysize);
+	out_cumul_len += out_len;
+	EVP_DecryptFinal_ex(ctx, signed_cast(unsigned char *,
+		&out[out_len]), &out_len);
+	out_cumul_len += out_len;
+	HXmc_setlen(&out, out_cumul_len);
+	EVP_CIPHER_CTX_free(ctx);
+
+	par->d_result = out;
+	return EHD_KEYDEC_SUCCESS;
+}
+
+static int ossl_keydec_run(struct ehd_keydec_request *par, hxmc_t **res)
+{
+	unsigned char *buf;
+	struct stat sb;
+	ssize_t i_ret;
+	int fd, ret;
+
+	if (par->digest == NULL)
+		return EHD_KEYDEC_NODIGEST;
+	if (par->cipher == NULL)
+		return EHD_KEYDEC_NOCIPHER;
+	par->s_digest = EVP_get_digestbyname(par->digest);
+	if (par->s_digest == NULL)
+		return EHD_KEYDEC_NODIGEST;
+	par->s_cipher = EVP_get_cipherbyname(par->cipher);
+	if (par->s_cipher == NULL)
+		return EHD_KEYDEC_NOCIPHER;
+
+	if ((fd = open(par->keyfile, O_RDONLY)) < 0)
+		return -errno;
+	if (fstat(fd, &sb) < 0) {
+		ret = -errno;
+		l0g("stat: %s\n", strerror(errno));
+		goto out;
+	}
+	if ((buf = malloc(sb.st_size)) == NULL) {
+		ret = -errno;
+		l0g("%s: malloc %zu: %s\n", __func__, sb.st_size,
+		    strerror(errno));
+		goto out;
+	}
+	if ((i_ret = read(fd, buf, sb.st_size)) != sb.st_size) {
+		ret = (i_ret < 0) ? -errno : EHD_KEYDEC_OTHER;
+		l0g("Incomplete read of %u bytes got %Zd bytes\n",
+		    sb.st_size, i_ret);
+		goto out2;
+	}
+
+	par->d_salt    = &buf[strlen("Salted__")];
+	par->d_text    = par->d_salt + PKCS5_SALT_LEN;
+	par->d_keysize = sb.st_size - (par->d_text - buf);
+	ret = ehd_decrypt_key2(par);
+	*res = par->d_result;
+ out2:
+	free(buf);
+ out:
+	close(fd);
+	return ret;
+}
+
+EXPORT_SYMBOL const struct ehd_keydec_ops cmt_openssl_ops = {
+	.run = ossl_keydec_run,
+};
@@ -25,27 +25,6 @@
 #include "cmt-internal.h"
 #include "libcryptmount.h"
 #include "pam_mount.h"
-#ifdef HAVE_LIBCRYPTO
-#	include <openssl/evp.h>
-#endif
-
-/**
- * struct ehd_keydec_request - parameter agglomerator for ehd_kdreq_final
- * @keyfile:	path to the key file
- * @digest:	digest used for the key file
- * @cipher:	cipher used for the key file
- * @password:	password to unlock the key material
- */
-struct ehd_keydec_request {
-	char *keyfile, *digest, *cipher, *password;
-#ifdef HAVE_LIBCRYPTO
-	const EVP_CIPHER *s_cipher;
-	const EVP_MD *s_digest;
-#endif
-	const unsigned char *d_salt, *d_text;
-	hxmc_t *d_result;
-	unsigned int d_keysize;
-};
 
 static pthread_mutex_t ehd_init_lock = PTHREAD_MUTEX_INITIALIZER;
 static unsigned long ehd_use_count;
@@ -67,14 +46,6 @@ EXPORT_SYMBOL int cryptmount_init(void)
 			pthread_mutex_unlock(&ehd_init_lock);
 			return ret;
 		}
-#ifdef HAVE_LIBCRYPTO
-#if OPENSSL_VERSION_NUMBER >= 0x1010000fL
-#else
-		OpenSSL_add_all_algorithms();
-		OpenSSL_add_all_ciphers();
-		OpenSSL_add_all_digests();
-#endif
-#endif
 	}
 	++ehd_use_count;
 	pthread_mutex_unlock(&ehd_init_lock);
@@ -211,6 +182,9 @@ EXPORT_SYMBOL int ehd_mtreq_set(struct ehd_mount_request *rq,
 	case EHD_MTREQ_ALLOW_DISCARDS:
 		rq->allow_discards = va_arg(args, unsigned int);
 		break;
+	case EHD_MTREQ_KEYCACHE:
+		rq->keycache = va_arg(args, unsigned int);
+		break;
 	}
 	switch (opt) {
 	case EHD_MTREQ_CONTAINER:
@@ -279,6 +253,17 @@ static int ehd_wait_for_file(const char *path)
 	return (ret == 0) ? 1 : ret;
 }
 
+static const struct ehd_crypto_ops *ehd_crypto_backend(void)
+{
+#ifdef HAVE_LIBCRYPTSETUP
+	return ehd_backend_load("cmt-dmcrypt");
+#elif defined(HAVE_DEV_CGDVAR_H)
+	return &ehd_cgd_ops;
+#else
+	return NULL;
+#endif
+}
+
 /**
  * ehd_load - set up crypto device for an EHD container
  * @req:	parameters for setting up the mount
@@ -287,9 +272,11 @@ static int ehd_wait_for_file(const char *path)
 EXPORT_SYMBOL int ehd_load(struct ehd_mount_request *req,
     struct ehd_mount_info **mtp)
 {
+	const struct ehd_crypto_ops *ops;
 	struct stat sb;
 	int saved_errno, ret;
 	struct ehd_mount_info *mt;
+	unsigned long long t;
 
 	if (stat(req->container, &sb) < 0) {
 		l0g("Could not stat %s: %s\n", req->container, strerror(errno));
@@ -307,8 +294,10 @@ EXPORT_SYMBOL int ehd_load(struct ehd_mount_request *req,
 	} else {
 		/* need losetup since cryptsetup needs block device */
 		w4rn("Setting up loop device for file %s\n", req->container);
+		t = ehd_trace_clock();
 		ret = ehd_loop_setup(req->container, &mt->loop_device,
 		      req->readonly);
+		ehd_trace_add(EHD_TRACE_LOOP, HX_basename(req->container), t);
 		if (ret == 0) {
 			l0g("Error: no free loop devices\n");
 			goto out_ser;
@@ -321,7 +310,9 @@ EXPORT_SYMBOL int ehd_load(struct ehd_mount_request *req,
 			mt->lower_device = mt->loop_device;
 		}
 
+		t = ehd_trace_clock();
 		ret = ehd_wait_for_file(mt->loop_device);
+		ehd_trace_add(EHD_TRACE_DEVWAIT, HX_basename(mt->loop_device), t);
 		if (ret <= 0)
 			goto out_ser;
 	}
@@ -334,17 +325,16 @@ EXPORT_SYMBOL int ehd_load(struct ehd_mount_request *req,
 	if (req->last_stage == EHD_MTREQ_STAGE_LOOP)
 		return 1;
 
-#ifdef HAVE_LIBCRYPTSETUP
-	ret = ehd_dmcrypt_ops.load(req, mt);
-#elif defined(HAVE_DEV_CGDVAR_H)
-	ret = ehd_cgd_ops.load(req, mt);
-#else
-	ret = -EOPNOTSUPP;
-#endif
+	t = ehd_trace_clock();
+	ops = ehd_crypto_backend();
+	ret = (ops != NULL) ? ops->load(req, mt) : -EOPNOTSUPP;
+	ehd_trace_add(EHD_TRACE_CRYPT, HX_basename(req->container), t);
 	if (ret <= 0)
 		goto out_ser;
 
+	t = ehd_trace_clock();
 	ret = ehd_wait_for_file(mt->crypto_device);
+	ehd_trace_add(EHD_TRACE_DEVWAIT, HX_basename(mt->crypto_device), t);
 	if (ret <= 0)
 		goto out_ser;
 
@@ -384,16 +374,12 @@ EXPORT_SYMBOL int ehd_load(struct ehd_mount_request *req,
  */
 EXPORT_SYMBOL int ehd_unload(struct ehd_mount_info *mt)
 {
+	const struct ehd_crypto_ops *ops;
 	int ret, ret2;
 
 	if (mt->crypto_device != NULL) {
-#ifdef HAVE_LIBCRYPTSETUP
-		ret = ehd_dmcrypt_ops.unload(mt);
-#elif defined(HAVE_DEV_CGDVAR_H)
-		ret = ehd_cgd_ops.unload(mt);
-#else
-		ret = -EOPNOTSUPP;
-#endif
+		ops = ehd_crypto_backend();
+		ret = (ops != NULL) ? ops->unload(mt) : -EOPNOTSUPP;
 	} else {
 		ret = 1;
 	}
@@ -406,97 +392,47 @@ EXPORT_SYMBOL int ehd_unload(struct ehd_mount_info *mt)
 	return ret;
 }
 
-#ifndef HAVE_LIBCRYPTSETUP
-EXPORT_SYMBOL int ehd_is_luks(const char *device, bool blkdev)
+/**
+ * ehd_is_luks - check if @path points to a LUKS volume (cf. normal dm-crypt)
+ * @path:	path to the crypto container
+ * @blkdev:	path is definitely a block device
+ */
+EXPORT_SYMBOL int ehd_is_luks(const char *path, bool blkdev)
 {
-	return -EINVAL;
+	const struct ehd_crypto_ops *ops = ehd_crypto_backend();
+
+	if (ops == NULL || ops->is_luks == NULL)
+		return -EINVAL;
+	return ops->is_luks(path, blkdev);
 }
-#endif
 
-#ifdef HAVE_LIBCRYPTO
-static int ehd_decrypt_key2(struct ehd_keydec_request *par)
+/**
+ * ehd_verify - check a key against a volume that is already unlocked
+ * @req:		request with the key (%EHD_MTREQ_KEY_DATA/_SIZE)
+ * @crypto_device:	the active crypto device of the volume
+ *
+ * Returns positive if the key in @req opens the volume, 0 if it does not,
+ * and negative errno if that could not be determined.
+ */
+EXPORT_SYMBOL int ehd_verify(const struct ehd_mount_request *req,
+    const char *crypto_device)
 {
-	unsigned char key[EVP_MAX_KEY_LENGTH], iv[EVP_MAX_IV_LENGTH];
-	unsigned int out_cumul_len = 0;
-	EVP_CIPHER_CTX *ctx;
-	int out_len = 0;
-	hxmc_t *out;
-
-	if (EVP_BytesToKey(par->s_cipher, par->s_digest, par->d_salt,
-	    signed_cast(const unsigned char *, par->password),
-	    (par->password == NULL) ? 0 : strlen(par->password),
-	    1, key, iv) <= 0)
-		return EHD_KEYDEC_OTHER;
-	ctx = EVP_CIPHER_CTX_new();
-	if (ctx == NULL)
-		return EHD_KEYDEC_OTHER;
-
-	out = HXmc_meminit(NULL, par->d_keysize + EVP_CIPHER_block_size(par->s_cipher));
-	EVP_DecryptInit_ex(ctx, par->s_cipher, NULL, key, iv);
-	EVP_DecryptUpdate(ctx, signed_cast(unsigned char *,
-		&out[out_len]), &out_len, par->d_text, par->d_keysize);
-	out_cumul_len += out_len;
-	EVP_DecryptFinal_ex(ctx, signed_cast(unsigned char *,
-		&out[out_len]), &out_len);
-	out_cumul_len += out_len;
-	HXmc_setlen(&out, out_cumul_len);
-	EVP_CIPHER_CTX_free(ctx);
-
-	par->d_result = out;
-	return EHD_KEYDEC_SUCCESS;
+	const struct ehd_crypto_ops *ops = ehd_crypto_backend();
+
+	if (ops == NULL || ops->verify == NULL)
+		return -EOPNOTSUPP;
+	return ops->verify(req, crypto_device);
 }
-#endif
 
 EXPORT_SYMBOL int
 ehd_keydec_run(struct ehd_keydec_request *par, hxmc_t **res)
 {
 #ifdef HAVE_LIBCRYPTO
-	unsigned char *buf;
-	struct stat sb;
-	ssize_t i_ret;
-	int fd, ret;
-
-	if (par->digest == NULL)
-		return EHD_KEYDEC_NODIGEST;
-	if (par->cipher == NULL)
-		return EHD_KEYDEC_NOCIPHER;
-	par->s_digest = EVP_get_digestbyname(par->digest);
-	if (par->s_digest == NULL)
-		return EHD_KEYDEC_NODIGEST;
-	par->s_cipher = EVP_get_cipherbyname(par->cipher);
-	if (par->s_cipher == NULL)
-		return EHD_KEYDEC_NOCIPHER;
-
-	if ((fd = open(par->keyfile, O_RDONLY)) < 0)
-		return -errno;
-	if (fstat(fd, &sb) < 0) {
-		ret = -errno;
-		l0g("stat: %s\n", strerror(errno));
-		goto out;
-	}
-	if ((buf = malloc(sb.st_size)) == NULL) {
-		ret = -errno;
-		l0g("%s: malloc %zu: %s\n", __func__, sb.st_size,
-		    strerror(errno));
-		goto out;
-	}
-	if ((i_ret = read(fd, buf, sb.st_size)) != sb.st_size) {
-		ret = (i_ret < 0) ? -errno : EHD_KEYDEC_OTHER;
-		l0g("Incomplete read of %u bytes got %Zd bytes\n",
-		    sb.st_size, i_ret);
-		goto out2;
-	}
+	const struct ehd_keydec_ops *ops = ehd_backend_load("cmt-openssl");
 
-	par->d_salt    = &buf[strlen("Salted__")];
-	par->d_text    = par->d_salt + PKCS5_SALT_LEN;
-	par->d_keysize = sb.st_size - (par->d_text - buf);
-	ret = ehd_decrypt_key2(par);
-	*res = par->d_result;
- out2:
-	free(buf);
- out:
-	close(fd);
-	return ret;
+	if (ops == NULL)
+		return -EOPNOTSUPP;
+	return ops->run(par, res);
 #else
 	l0g("%s called, but library built without openssl\n", __func__);
 	return -EINVAL;
@@ -76,6 +76,7 @@ enum ehd_mtreq_opt {
 	EHD_MTREQ_FSTYPE,
 	EHD_MTREQ_MOUNT_OPTS,
 	EHD_MTREQ_ALLOW_DISCARDS,
+	EHD_MTREQ_KEYCACHE,
 };
 
 enum ehd_mtinfo_opt {
@@ -112,6 +113,7 @@ extern void ehd_mtinfo_free(struct ehd_mount_info *);
 extern int ehd_load(struct ehd_mount_request *, struct ehd_mount_info **);
 extern int ehd_unload(struct ehd_mount_info *);
 extern int ehd_is_luks(const char *, bool);
+extern int ehd_verify(const struct ehd_mount_request *, const char *);
 
 extern struct ehd_keydec_request *ehd_kdreq_new(void);
 extern int ehd_kdreq_set(struct ehd_keydec_request *, enum ehd_kdreq_opt, ...);
@@ -122,6 +124,12 @@ extern const char *ehd_keydec_strerror(int);
 extern int ehd_cipherdigest_security(const char *);
 extern hxmc_t *ehd_get_password(const char *);
 
+/*
+ *	backend.c
+ */
+extern void ehd_backend_dir(const char *);
+extern const void *ehd_backend_load(const char *);
+
 /*
  *	log.c
  */
@@ -136,6 +144,23 @@ enum ehd_log_feature {
 	__EHD_LOGFT_MAX,
 };
 
+/**
+ * Structured fields for ehd_log_field().
+ * %EHD_LOGK_USER:	user being logged in or out
+ * %EHD_LOGK_VOLUME:	mountpoint of the volume being processed
+ * %EHD_LOGK_STAGE:	PAM stage or program phase
+ * %EHD_LOGK_ERRNO:	error number (next message only)
+ * %EHD_LOGK_DURATION:	duration in microseconds (next message only)
+ */
+enum ehd_log_key {
+	EHD_LOGK_USER = 0,
+	EHD_LOGK_VOLUME,
+	EHD_LOGK_STAGE,
+	EHD_LOGK_ERRNO,
+	EHD_LOGK_DURATION,
+	__EHD_LOGK_MAX,
+};
+
 enum {
 	EHD_LOG_UNSET = -1,
 	EHD_LOG_GET   = 0,
@@ -145,6 +170,40 @@ enum {
 extern int ehd_logctl(enum ehd_log_feature, ...);
 extern int ehd_dbg(const char *, ...);
 extern int ehd_err(const char *, ...);
+extern void ehd_log_field(enum ehd_log_key, const char *, ...);
+
+/*
+ *	trace.c
+ */
+/**
+ * Stages of login/logout processing that can be timed with ehd_trace_add.
+ * The first group is recorded by pam_mount, the second by mount.crypt.
+ */
+enum ehd_trace_stage {
+	EHD_TRACE_CONFIG = 0,
+	EHD_TRACE_EXPAND,
+	EHD_TRACE_SANITY,
+	EHD_TRACE_MOUNTCHECK,
+	EHD_TRACE_SPAWN,
+	EHD_TRACE_HELPER,
+	EHD_TRACE_FSCK,
+	EHD_TRACE_REFCOUNT,
+	EHD_TRACE_LOOP,
+	EHD_TRACE_CRYPT,
+	EHD_TRACE_DEVWAIT,
+	EHD_TRACE_CRYPTLOAD,
+	EHD_TRACE_KDF,
+	EHD_TRACE_ACTIVATE,
+	EHD_TRACE_UNLOCK,
+	__EHD_TRACE_MAX,
+};
+
+extern unsigned long long ehd_trace_clock(void);
+extern void ehd_trace_sink(const char *);
+extern void ehd_trace_begin(const char *);
+extern void ehd_trace_add(enum ehd_trace_stage, const char *,
+	unsigned long long);
+extern void ehd_trace_end(int);
 
 /*
  *	loop.c
@@ -6,17 +6,49 @@
  *	as published by the Free Software Foundation; either version 2.1
  *	of the License, or (at your option) any later version.
  */
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <assert.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <libHX/defs.h>
+#include <libHX/string.h>
 #include "libcryptmount.h"
 #include "pam_mount.h"
 
+enum {
+	EHD_LOG_MSGSIZE = 1024,
+	EHD_LOG_FIELDSIZE = 128,
+};
+
 static unsigned int ehd_log_ft[__EHD_LOGFT_MAX];
 
+/* Journal field names; ERRNO is a well-known journald field. */
+static const char *const ehd_log_keyname[] = {
+	[EHD_LOGK_USER]     = "PMT_USER",
+	[EHD_LOGK_VOLUME]   = "PMT_VOLUME",
+	[EHD_LOGK_STAGE]    = "PMT_STAGE",
+	[EHD_LOGK_ERRNO]    = "ERRNO",
+	[EHD_LOGK_DURATION] = "PMT_DURATION_USEC",
+};
+
+/* Fields attached to subsequent messages; see ehd_log_field(). */
+static char ehd_log_kv[__EHD_LOGK_MAX][EHD_LOG_FIELDSIZE];
+
+#ifdef __linux__
+/* -1: not yet tried; -2: no journal, use syslog(3) */
+static int ehd_journal_fd = -1;
+#endif
+
 EXPORT_SYMBOL int ehd_logctl(enum ehd_log_feature ft, ...)
 {
 	va_list ap;
@@ -37,24 +69,183 @@ EXPORT_SYMBOL int ehd_logctl(enum ehd_log_feature ft, ...)
 	return 1;
 }
 
+/**
+ * ehd_log_field - attach a structured field to log messages
+ * @key:	field to set
+ * @format:	printf(3)-style format for the value, or %NULL to clear it
+ *
+ * %EHD_LOGK_USER, %EHD_LOGK_VOLUME and %EHD_LOGK_STAGE stay set until
+ * changed. %EHD_LOGK_ERRNO and %EHD_LOGK_DURATION only apply to the next
+ * message. Fields are sent to the journal (when it is available); the
+ * syslog and stderr output is unchanged.
+ */
+EXPORT_SYMBOL void ehd_log_field(enum ehd_log_key key, const char *format, ...)
+{
+	va_list args;
+
+	if (key >= __EHD_LOGK_MAX)
+		return;
+	if (format == NULL) {
+		*ehd_log_kv[key] = '\0';
+		return;
+	}
+	va_start(args, format);
+	vsnprintf(ehd_log_kv[key], sizeof(ehd_log_kv[key]), format, args);
+	va_end(args);
+}
+
+#ifdef __linux__
+/**
+ * ehd_journal_put - append one field in journald's native protocol
+ *
+ * Always uses the length-prefixed form, so that values may contain
+ * newlines. Returns false if @buf would overflow.
+ */
+static bool ehd_journal_put(char *buf, size_t size, size_t *pos,
+    const char *key, const char *value, size_t vlen)
+{
+	size_t klen = strlen(key);
+	uint64_t len = vlen;
+	unsigned int i;
+
+	if (*pos + klen + 1 + sizeof(len) + vlen + 1 > size)
+		return false;
+	memcpy(&buf[*pos], key, klen);
+	*pos += klen;
+	buf[(*pos)++] = '\n';
+	for (i = 0; i < sizeof(len); ++i)
+		buf[(*pos)++] = (len >> (8 * i)) & 0xFF;
+	memcpy(&buf[*pos], value, vlen);
+	*pos += vlen;
+	buf[(*pos)++] = '\n';
+	return true;
+}
+
+/**
+ * ehd_journal_send - submit a message with fields to the journal
+ * @prio:	syslog priority
+ * @msg:	formatted message
+ * @len:	length of @msg
+ *
+ * Talks to the journal socket directly, which avoids a libsystemd
+ * dependency. Returns false if the journal is not reachable or @msg does
+ * not fit into one datagram, in which case the caller falls back to
+ * syslog(3).
+ */
+static bool ehd_journal_send(int prio, const char *msg, size_t len)
+{
+	static const struct sockaddr_un sa = {
+		.sun_family = AF_UNIX,
+		.sun_path   = "/run/systemd/journal/socket",
+	};
+	char buf[EHD_LOG_MSGSIZE + __EHD_LOGK_MAX * (EHD_LOG_FIELDSIZE + 32) +
+	         256], num[24];
+	size_t pos = 0;
+	unsigned int i;
+
+	if (ehd_journal_fd == -2)
+		return false;
+	if (ehd_journal_fd == -1) {
+		ehd_journal_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (ehd_journal_fd < 0) {
+			ehd_journal_fd = -2;
+			return false;
+		}
+	}
+
+	/* The journal adds its own line structure. */
+	if (len > 0 && msg[len-1] == '\n')
+		--len;
+	/* Overlong messages go to syslog(3) rather than lose their text. */
+	if (!ehd_journal_put(buf, sizeof(buf), &pos, "MESSAGE", msg, len))
+		return false;
+	snprintf(num, sizeof(num), "%d", prio);
+	ehd_journal_put(buf, sizeof(buf), &pos, "PRIORITY", num, strlen(num));
+	snprintf(num, sizeof(num), "%d", LOG_AUTH >> 3);
+	ehd_journal_put(buf, sizeof(buf), &pos, "SYSLOG_FACILITY",
+		num, strlen(num));
+	ehd_journal_put(buf, sizeof(buf), &pos, "SYSLOG_IDENTIFIER",
+		program_invocation_short_name,
+		strlen(program_invocation_short_name));
+	for (i = 0; i < __EHD_LOGK_MAX; ++i)
+		if (*ehd_log_kv[i] != '\0')
+			ehd_journal_put(buf, sizeof(buf), &pos,
+				ehd_log_keyname[i], ehd_log_kv[i],
+				strlen(ehd_log_kv[i]));
+
+	if (sendto(ehd_journal_fd, buf, pos, MSG_NOSIGNAL,
+	    reinterpret_cast(const struct sockaddr *, &sa), sizeof(sa)) >= 0)
+		return true;
+	if (errno == ENOENT || errno == ECONNREFUSED || errno == ENOTDIR) {
+		/* No journald on this system; do not try again. */
+		close(ehd_journal_fd);
+		ehd_journal_fd = -2;
+	}
+	return false;
+}
+#endif
+
+/**
+ * ehd_log_emit - common backend for ehd_err and ehd_dbg
+ * @prio:	syslog priority
+ *
+ * The message is formatted once into a stack buffer and the result is
+ * handed to the journal (or syslog) and stderr. Messages that do not fit
+ * are formatted again into a heap buffer; only if that allocation fails is
+ * the message cut short.
+ */
+static int ehd_log_emit(int prio, const char *format, va_list args)
+{
+	char stack_msg[EHD_LOG_MSGSIZE], *msg = stack_msg;
+	va_list retry;
+	size_t len;
+	int ret;
+
+	va_copy(retry, args);
+	ret = vsnprintf(stack_msg, sizeof(stack_msg), format, args);
+	if (ret < 0) {
+		va_end(retry);
+		return ret;
+	}
+	len = ret;
+	if (len >= sizeof(stack_msg)) {
+		msg = malloc(len + 1);
+		if (msg == NULL) {
+			msg = stack_msg;
+			len = sizeof(stack_msg) - 1;
+		} else {
+			vsnprintf(msg, len + 1, format, retry);
+		}
+	}
+	va_end(retry);
+
+	if (!ehd_log_ft[EHD_LOGFT_NOSYSLOG]) {
+#ifdef __linux__
+		if (!ehd_journal_send(prio, msg, len))
+#endif
+			syslog(LOG_AUTH | prio, "%s", msg);
+	}
+	fwrite(msg, len, 1, stderr);
+	if (msg != stack_msg)
+		free(msg);
+	*ehd_log_kv[EHD_LOGK_ERRNO]    = '\0';
+	*ehd_log_kv[EHD_LOGK_DURATION] = '\0';
+	return len;
+}
+
 /**
  * ehd_err - log an error/warning
  * @format:	printf(3)-style format specifier
  */
 EXPORT_SYMBOL int ehd_err(const char *format, ...)
 {
-	va_list args, arg2;
-	int ret = 0;
+	va_list args;
+	int ret;
 
 	assert(format != NULL);
 
 	va_start(args, format);
-	if (!ehd_log_ft[EHD_LOGFT_NOSYSLOG]) {
-		va_copy(arg2, args);
-		vsyslog(LOG_AUTH | LOG_ERR, format, arg2);
-		va_end(arg2);
-	}
-	ret = vfprintf(stderr, format, args);
+	ret = ehd_log_emit(LOG_ERR, format, args);
 	va_end(args);
 	return ret;
 }
@@ -67,24 +258,20 @@ EXPORT_SYMBOL int ehd_err(const char *format, ...)
  * Use this for debugging messages.
  *
  * Do not call this function directly; use the w4rn() macro instead, so that
- * file name and line number show up.
+ * file name and line number show up, and so that the arguments are not even
+ * evaluated when debugging is off.
  */
 EXPORT_SYMBOL int ehd_dbg(const char *format, ...)
 {
-	va_list args, arg2;
-	int ret = 0;
+	va_list args;
+	int ret;
 
 	assert(format != NULL);
 	if (!ehd_log_ft[EHD_LOGFT_DEBUG])
 		return 0;
 
 	va_start(args, format);
-	if (!ehd_log_ft[EHD_LOGFT_NOSYSLOG]) {
-		va_copy(arg2, args);
-		vsyslog(LOG_AUTH | LOG_ERR, format, arg2);
-		va_end(arg2);
-	}
-	ret = vfprintf(stderr, format, args);
+	ret = ehd_log_emit(LOG_DEBUG, format, args);
 	va_end(args);
 	return ret;
 }
@@ -0,0 +1,201 @@
+/*
+ *	Cache of validated per-user configuration files
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <libHX/defs.h>
+#include <libHX/io.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+#ifdef __APPLE__
+#	define st_ctim st_ctimespec
+#	define st_mtim st_mtimespec
+#endif
+
+/*
+ * The luserconf usually lives in a home directory on NFS or CIFS, so
+ * reading it at every login costs a couple of round trips plus the parse.
+ * Once it has been read, the elements that were accepted from it are
+ * stored in a root-only copy under the run directory, stamped with the
+ * identity (device, inode, mtime, ctime, size, owner) of the original. As
+ * long as a stat() of the original still matches that stamp, the copy is
+ * read instead. The ctime is in there because the user can set the mtime
+ * back with utimes(2), but not the ctime. The volumes in it still go through
+ * luserconf_volume_record_sane() at every login, as their conditions and
+ * mountpoints can change without the file changing.
+ */
+static const char pmt_lucache_dir[] = RUNDIR "/pam_mount/luserconf";
+static const char pmt_lucache_magic[] = "pam_mount-luserconf 2";
+
+/**
+ * struct pmt_luserconf_writer - cache entry under construction
+ * @doc:	accepted top-level elements, serialized
+ */
+struct pmt_luserconf_writer {
+	hxmc_t *doc;
+};
+
+/* The header is an XML comment, so the cache is a valid luserconf too. */
+static void lc_header(char *buf, size_t size, const struct stat *sb)
+{
+	snprintf(buf, size, "<!-- %s %llu %llu %lld %ld %lld %ld %lld %lu -->",
+	         pmt_lucache_magic,
+	         static_cast(unsigned long long, sb->st_dev),
+	         static_cast(unsigned long long, sb->st_ino),
+	         static_cast(long long, sb->st_mtim.tv_sec),
+	         static_cast(long, sb->st_mtim.tv_nsec),
+	         static_cast(long long, sb->st_ctim.tv_sec),
+	         static_cast(long, sb->st_ctim.tv_nsec),
+	         static_cast(long long, sb->st_size),
+	         static_cast(unsigned long, sb->st_uid));
+}
+
+static bool lc_path(char *buf, size_t size, const char *user)
+{
+	if (*user == '\0' || *user == '.' || strchr(user, '/') != NULL)
+		return false;
+	snprintf(buf, size, "%s/%s", pmt_lucache_dir, user);
+	return true;
+}
+
+/**
+ * pmt_luserconf_lookup - find an up-to-date copy of the luserconf
+ * @config:	configuration, with @config->luserconf set
+ * @path:	receives the path of the copy
+ * @size:	size of @path
+ *
+ * Returns true if @path may be read instead of @config->luserconf. This
+ * also stands in for pmt_fileop_owns(): the original has to be owned by the
+ * user logging in, as it was when the copy was made.
+ */
+bool pmt_luserconf_lookup(struct config *config, char *path, size_t size)
+{
+	const struct pmt_userinfo *ui;
+	char header[192];
+	struct stat sb, csb;
+	hxmc_t *line = NULL;
+	bool ret = false;
+	FILE *fp;
+
+	if (geteuid() != 0 || !lc_path(path, size, config->user))
+		return false;
+	ui = config_userinfo(config);
+	if (!ui->have_pw || stat(config->luserconf, &sb) < 0 ||
+	    !S_ISREG(sb.st_mode) || sb.st_uid != ui->uid)
+		return false;
+	if ((fp = fopen(path, "re")) == NULL)
+		return false;
+	if (fstat(fileno(fp), &csb) < 0 || !S_ISREG(csb.st_mode) ||
+	    csb.st_uid != 0 || (csb.st_mode & (S_IWGRP | S_IWOTH)))
+		goto out;
+	lc_header(header, sizeof(header), &sb);
+	if (HX_getl(&line, fp) == NULL)
+		goto out;
+	HX_chomp(line);
+	ret = strcmp(line, header) == 0;
+ out:
+	HXmc_free(line);
+	fclose(fp);
+	return ret;
+}
+
+struct pmt_luserconf_writer *pmt_luserconf_new(void)
+{
+	struct pmt_luserconf_writer *lc = malloc(sizeof(*lc));
+
+	if (lc == NULL)
+		return NULL;
+	if ((lc->doc = HXmc_strinit("")) == NULL) {
+		free(lc);
+		return NULL;
+	}
+	return lc;
+}
+
+void pmt_luserconf_free(struct pmt_luserconf_writer *lc)
+{
+	if (lc == NULL)
+		return;
+	HXmc_free(lc->doc);
+	free(lc);
+}
+
+/**
+ * pmt_luserconf_add - record an accepted top-level element
+ * @lc:		cache entry under construction
+ * @node:	child element of <pam_mount>
+ *
+ * Elements that were rejected (e.g. commands, which a user may not set)
+ * are not passed in, so they are not complained about again at every login.
+ */
+void pmt_luserconf_add(struct pmt_luserconf_writer *lc, xmlNode *node)
+{
+	xmlBuffer *buf = xmlBufferCreate();
+
+	if (buf == NULL)
+		return;
+	if (xmlNodeDump(buf, node->doc, node, 1, 0) >= 0) {
+		HXmc_strcat(&lc->doc, "\t");
+		HXmc_strcat(&lc->doc,
+			signed_cast(const char *, xmlBufferContent(buf)));
+		HXmc_strcat(&lc->doc, "\n");
+	}
+	xmlBufferFree(buf);
+}
+
+/**
+ * pmt_luserconf_write - store a completed cache entry
+ * @lc:		cache entry, freed by this function
+ * @user:	owner of the luserconf
+ * @sb:		identity of the luserconf, as taken before it was parsed
+ *
+ * Like the volume index, the entry is replaced atomically and failure is
+ * not fatal.
+ */
+void pmt_luserconf_write(struct pmt_luserconf_writer *lc, const char *user,
+    const struct stat *sb)
+{
+	char header[192], path[256], tmp[sizeof(path) + 16];
+	FILE *fp;
+	int fd;
+
+	if (!lc_path(path, sizeof(path), user))
+		goto out;
+	HX_mkdir(RUNDIR "/pam_mount", S_IRUGO | S_IXUGO | S_IWUSR);
+	HX_mkdir(pmt_lucache_dir, S_IRWXU);
+	snprintf(tmp, sizeof(tmp), "%s.%u", path,
+	         static_cast(unsigned int, getpid()));
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		w4rn("could not write %s: %s\n", tmp, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+	lc_header(header, sizeof(header), sb);
+	fprintf(fp, "%s\n<pam_mount>\n%s</pam_mount>\n", header, lc->doc);
+	if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+		w4rn("could not write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+	} else {
+		w4rn("cached luserconf as %s\n", path);
+	}
+ out:
+	pmt_luserconf_free(lc);
+}
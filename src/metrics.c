@@ -0,0 +1,285 @@
+/*
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <libHX/defs.h>
+#include <libHX/io.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+enum {
+	METRICS_VERSION = 1,
+	METRICS_SLOTS   = 128,
+	METRICS_BUCKETS = 10,
+};
+
+/* Upper bounds of the latency histogram buckets, in microseconds */
+static const uint64_t metrics_bucket_us[METRICS_BUCKETS] = {
+	10000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 30000000,
+};
+
+static const char *const metrics_type_name[] = {
+	[CMD_SMBMOUNT]   = "smbmount",
+	[CMD_CIFSMOUNT]  = "cifsmount",
+	[CMD_NCPMOUNT]   = "ncpmount",
+	[CMD_FUSEMOUNT]  = "fusemount",
+	[CMD_LCLMOUNT]   = "lclmount",
+	[CMD_CRYPTMOUNT] = "cryptmount",
+	[CMD_NFSMOUNT]   = "nfsmount",
+};
+
+/**
+ * struct pmt_metrics_slot - aggregate for one (type, server, operation)
+ * @used:	slot is taken
+ * @umount:	slot counts unmounts rather than mounts
+ * @count:	operations, indexed by outcome (0: success, 1: failure)
+ * @sum_us:	total latency, indexed by outcome
+ * @bucket:	non-cumulative histogram; the last one is +Inf
+ */
+struct pmt_metrics_slot {
+	uint32_t used, type, umount, pad;
+	char server[64];
+	uint64_t count[2], sum_us[2];
+	uint64_t bucket[2][METRICS_BUCKETS+1];
+};
+
+/**
+ * struct pmt_metrics_shm - layout of the shared segment
+ * @dropped:	operations not recorded because all slots were taken
+ */
+struct pmt_metrics_shm {
+	char magic[8];
+	uint32_t version, nslots;
+	uint64_t dropped;
+	struct pmt_metrics_slot slot[METRICS_SLOTS];
+};
+
+static const char metrics_magic[8] = "PMTMETR";
+
+const char *pmt_metrics_path(void)
+{
+	return RUNDIR "/pam_mount/.metrics";
+}
+
+static bool metrics_valid(const struct pmt_metrics_shm *m)
+{
+	return memcmp(m->magic, metrics_magic, sizeof(m->magic)) == 0 &&
+	       m->version == METRICS_VERSION && m->nslots == METRICS_SLOTS;
+}
+
+/**
+ * metrics_map - open and map the segment, taking the file lock
+ * @fd:		receives the file descriptor, to be passed to metrics_unmap()
+ * @create:	create and initialize the segment if needed
+ *
+ * A plain file in the tmpfs-backed run directory serves as the shared
+ * memory segment; flock() serializes the (short) updates of concurrent
+ * logins.
+ */
+static struct pmt_metrics_shm *metrics_map(int *fd, bool create)
+{
+	struct pmt_metrics_shm *m;
+	struct stat sb;
+
+	*fd = open(pmt_metrics_path(), (create ? O_RDWR | O_CREAT : O_RDONLY) |
+	      O_CLOEXEC, S_IRUGO | S_IWUSR);
+	if (*fd < 0 && create && errno == ENOENT) {
+		HX_mkdir(RUNDIR "/pam_mount", S_IRUGO | S_IXUGO | S_IWUSR);
+		*fd = open(pmt_metrics_path(), O_RDWR | O_CREAT | O_CLOEXEC,
+		      S_IRUGO | S_IWUSR);
+	}
+	if (*fd < 0)
+		return NULL;
+	if (flock(*fd, create ? LOCK_EX : LOCK_SH) < 0 ||
+	    fstat(*fd, &sb) < 0)
+		goto out;
+	if (sb.st_size == 0) {
+		errno = ENOENT;
+		if (!create || ftruncate(*fd, sizeof(*m)) < 0)
+			goto out;
+	} else if (sb.st_size != sizeof(*m)) {
+		errno = EINVAL;
+		goto out;
+	}
+	m = mmap(NULL, sizeof(*m), create ? PROT_READ | PROT_WRITE : PROT_READ,
+	     MAP_SHARED, *fd, 0);
+	if (m == MAP_FAILED)
+		goto out;
+	if (sb.st_size == 0) {
+		memcpy(m->magic, metrics_magic, sizeof(m->magic));
+		m->version = METRICS_VERSION;
+		m->nslots  = METRICS_SLOTS;
+	}
+	if (metrics_valid(m))
+		return m;
+	munmap(m, sizeof(*m));
+	errno = EINVAL;
+ out:
+	close(*fd);
+	return NULL;
+}
+
+static void metrics_unmap(struct pmt_metrics_shm *m, int fd)
+{
+	munmap(m, sizeof(*m));
+	close(fd);	/* releases the lock */
+}
+
+static struct pmt_metrics_slot *metrics_slot(struct pmt_metrics_shm *m,
+    enum command_type type, const char *server, bool umount)
+{
+	struct pmt_metrics_slot *s;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(m->slot); ++i) {
+		s = &m->slot[i];
+		if (!s->used)
+			break;
+		if (s->type == type && s->umount == umount &&
+		    strcmp(s->server, server) == 0)
+			return s;
+	}
+	if (i == ARRAY_SIZE(m->slot))
+		return NULL;
+	s->used   = true;
+	s->type   = type;
+	s->umount = umount;
+	HX_strlcpy(s->server, server, sizeof(s->server));
+	return s;
+}
+
+/**
+ * pmt_metrics_record - account one mount or unmount
+ * @type:	volume type
+ * @server:	file server, may be %NULL for local volumes
+ * @umount:	operation was an unmount
+ * @ok:		operation succeeded
+ * @usec:	time taken
+ *
+ * Errors are only logged in debug mode; metrics must never get in the way
+ * of a login.
+ */
+void pmt_metrics_record(enum command_type type, const char *server,
+    bool umount, bool ok, unsigned long long usec)
+{
+	struct pmt_metrics_slot *s;
+	struct pmt_metrics_shm *m;
+	unsigned int b;
+	int fd;
+
+	if ((m = metrics_map(&fd, true)) == NULL) {
+		w4rn("metrics: %s: %s\n", pmt_metrics_path(), strerror(errno));
+		return;
+	}
+	s = metrics_slot(m, type, (server != NULL) ? server : "", umount);
+	if (s == NULL) {
+		++m->dropped;
+	} else {
+		for (b = 0; b < METRICS_BUCKETS; ++b)
+			if (usec <= metrics_bucket_us[b])
+				break;
+		++s->count[!ok];
+		s->sum_us[!ok] += usec;
+		++s->bucket[!ok][b];
+	}
+	metrics_unmap(m, fd);
+}
+
+static void metrics_label(FILE *fp, const char *s)
+{
+	for (; *s != '\0'; ++s) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		if (*s == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*s, fp);
+	}
+}
+
+static void metrics_labels(FILE *fp, const struct pmt_metrics_slot *s,
+    unsigned int outcome)
+{
+	const char *type = NULL;
+
+	if (s->type < ARRAY_SIZE(metrics_type_name))
+		type = metrics_type_name[s->type];
+	fprintf(fp, "type=\"%s\",server=\"", (type != NULL) ? type : "other");
+	metrics_label(fp, s->server);
+	fprintf(fp, "\",op=\"%s\",outcome=\"%s\"",
+	        s->umount ? "umount" : "mount",
+	        outcome == 0 ? "success" : "failure");
+}
+
+/**
+ * pmt_metrics_dump - write the collected metrics in OpenMetrics text format
+ * @fp:	output stream
+ *
+ * Returns 1 on success, or negative errno.
+ */
+int pmt_metrics_dump(FILE *fp)
+{
+	static const char name[] = "pam_mount_operation_duration_seconds";
+	const struct pmt_metrics_slot *s;
+	struct pmt_metrics_shm *m;
+	unsigned int i, o, b;
+	uint64_t cumul;
+	int fd;
+
+	if ((m = metrics_map(&fd, false)) == NULL)
+		return -errno;
+
+	fprintf(fp, "# TYPE %s histogram\n", name);
+	fprintf(fp, "# UNIT %s seconds\n", name);
+	fprintf(fp, "# HELP %s Time taken by mount and unmount helpers.\n", name);
+	for (i = 0; i < ARRAY_SIZE(m->slot); ++i) {
+		s = &m->slot[i];
+		if (!s->used)
+			break;
+		for (o = 0; o < 2; ++o) {
+			if (s->count[o] == 0)
+				continue;
+			cumul = 0;
+			for (b = 0; b <= METRICS_BUCKETS; ++b) {
+				cumul += s->bucket[o][b];
+				fprintf(fp, "%s_bucket{", name);
+				metrics_labels(fp, s, o);
+				if (b < METRICS_BUCKETS)
+					fprintf(fp, ",le=\"%g\"} %llu\n",
+					        metrics_bucket_us[b] / 1e6,
+					        static_cast(unsigned long long, cumul));
+				else
+					fprintf(fp, ",le=\"+Inf\"} %llu\n",
+					        static_cast(unsigned long long, cumul));
+			}
+			fprintf(fp, "%s_count{", name);
+			metrics_labels(fp, s, o);
+			fprintf(fp, "} %llu\n",
+			        static_cast(unsigned long long, s->count[o]));
+			fprintf(fp, "%s_sum{", name);
+			metrics_labels(fp, s, o);
+			fprintf(fp, "} %.6f\n", s->sum_us[o] / 1e6);
+		}
+	}
+	fprintf(fp, "# TYPE pam_mount_metrics_dropped counter\n"
+	        "# HELP pam_mount_metrics_dropped Operations not recorded "
+	        "for lack of slots.\n"
+	        "pam_mount_metrics_dropped_total %llu\n# EOF\n",
+	        static_cast(unsigned long long, m->dropped));
+	metrics_unmap(m, fd);
+	return 1;
+}
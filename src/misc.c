@@ -20,6 +20,7 @@
 #include <libHX/defs.h>
 #include <libHX/deque.h>
 #include <libHX/list.h>
+#include <libHX/map.h>
 #include <libHX/string.h>
 #include <pwd.h>
 #include "libcryptmount.h"
@@ -27,6 +28,11 @@
 
 struct HXbtree;
 
+enum {
+	/* Option lists shorter than this are scanned instead of hashed. */
+	KVPLIST_INDEX_MIN = 8,
+};
+
 /**
  * pmt_fileop_exists -
  * @file:	file to check
@@ -234,69 +240,106 @@ void misc_add_ntdom(struct HXformat_map *v, const char *user)
 	free(tmp);
 }
 
-bool kvplist_contains(const struct HXclist_head *head, const char *key)
+void kvplist_init(struct kvplist *kl)
+{
+	HXclist_init(&kl->list);
+	kl->index = NULL;
+}
+
+void kvplist_free_index(struct kvplist *kl)
+{
+	HXmap_free(kl->index);
+	kl->index = NULL;
+}
+
+/**
+ * kvplist_reindex -
+ * @kl:	option list
+ *
+ * (Re)builds the hash index of @kl. Must be called again whenever keys
+ * change (expandconfig() does so). Short lists are left without an index,
+ * as scanning a handful of entries is cheaper than hashing. The map does
+ * not copy the keys; they are owned by the list.
+ */
+bool kvplist_reindex(struct kvplist *kl)
 {
 	const struct kvp *kvp;
+	int ret;
 
-	HXlist_for_each_entry(kvp, head, list)
-		if (strcmp(kvp->key, key) == 0)
-			return true;
-	return false;
+	kvplist_free_index(kl);
+	if (kl->list.items < KVPLIST_INDEX_MIN)
+		return true;
+	kl->index = HXmap_init(HXMAPT_HASH, HXMAP_SKEY);
+	if (kl->index == NULL)
+		return false;
+	HXlist_for_each_entry(kvp, &kl->list, list) {
+		/* Duplicates (-EEXIST): the first one wins, like in a scan. */
+		ret = HXmap_add(kl->index, kvp->key, kvp);
+		if (ret < 0 && ret != -EEXIST) {
+			kvplist_free_index(kl);
+			return false;
+		}
+	}
+	return true;
 }
 
-char *kvplist_get(const struct HXclist_head *head, const char *key)
+static const struct kvp *kvplist_find(const struct kvplist *kl,
+    const char *key)
 {
 	const struct kvp *kvp;
 
-	HXlist_for_each_entry(kvp, head, list)
+	if (kl->index != NULL)
+		return HXmap_get(kl->index, key);
+	HXlist_for_each_entry(kvp, &kl->list, list)
 		if (strcmp(kvp->key, key) == 0)
-			return kvp->value;
+			return kvp;
 	return NULL;
 }
 
-void kvplist_genocide(struct HXclist_head *head)
+bool kvplist_contains(const struct kvplist *kl, const char *key)
 {
-	struct kvp *kvp, *next;
+	return kvplist_find(kl, key) != NULL;
+}
 
-	HXlist_for_each_entry_safe(kvp, next, head, list) {
-		free(kvp->key);
-		free(kvp->value);
-		free(kvp);
-	}
+char *kvplist_get(const struct kvplist *kl, const char *key)
+{
+	const struct kvp *kvp = kvplist_find(kl, key);
+
+	return (kvp != NULL) ? kvp->value : NULL;
 }
 
 /**
  * kvplist_to_str -
- * @optlist:	option list
+ * @dest:	buffer to reuse (*@dest may be %NULL)
+ * @kl:		option list
  *
- * Transform the option list into a flat string. Allocates and returns the
- * string. Caller has to free it. Used for debugging.
+ * Transform the option list into a flat string, overwriting the previous
+ * contents of *@dest, which is grown as needed. Returns *@dest, which the
+ * caller frees with HXmc_free() eventually.
  */
-hxmc_t *kvplist_to_str(const struct HXclist_head *optlist)
+hxmc_t *kvplist_to_str(hxmc_t **dest, const struct kvplist *kl)
 {
 	const struct kvp *kvp;
-	hxmc_t *ret = HXmc_meminit(NULL, 0);
-
-	if (optlist == NULL)
-		return ret;
+	bool first = true;
 
-	HXlist_for_each_entry(kvp, optlist, list) {
-		HXmc_strcat(&ret, kvp->key);
+	if (*dest == NULL)
+		*dest = HXmc_meminit(NULL, 0);
+	else
+		HXmc_setlen(dest, 0);
+	if (*dest == NULL || kl == NULL)
+		return *dest;
+
+	HXlist_for_each_entry(kvp, &kl->list, list) {
+		if (!first)
+			HXmc_strcat(dest, ",");
+		first = false;
+		HXmc_strcat(dest, kvp->key);
 		if (kvp->value != NULL && *kvp->value != '\0') {
-			HXmc_strcat(&ret, "=");
-			HXmc_strcat(&ret, kvp->value);
+			HXmc_strcat(dest, "=");
+			HXmc_strcat(dest, kvp->value);
 		}
-		HXmc_strcat(&ret, ",");
 	}
-
-	if (*ret != '\0')
-		/*
-		 * When string is not empty, there is always at least one
-		 * comma -- nuke it.
-		 */
-		ret[HXmc_length(ret)-1] = '\0';
-
-	return ret;
+	return *dest;
 }
 
 /**
@@ -27,7 +27,6 @@
 #include <libHX/deque.h>
 #include <libHX/io.h>
 #include <libHX/proc.h>
-#include <libmount.h>
 #include <grp.h>
 #include <pwd.h>
 #include "libcryptmount.h"
@@ -114,25 +113,6 @@ static void run_ofl(const struct config *const config, const char *mntpt,
 		HXproc_wait(&proc);
 }
 
-/**
- * Compares a given utab entry to the volume. crypt-type volumes will always
- * be compared case-sensitive since they always use an existing file.
- */
-static bool pmt_utabent_matches(const struct vol *vpt, struct libmnt_fs *fs)
-{
-	int (*xcmp)(const char *, const char *);
-	const char *source = mnt_fs_get_source(fs);
-	const char *target = mnt_fs_get_target(fs);
-	bool result = false;
-
-	xcmp = fstype2_icase(vpt->type) ? strcasecmp : strcmp;
-	if (source != NULL)
-		result = xcmp(vpt->volume, source) == 0;
-	if (target != NULL)
-		result &= strcmp(vpt->mountpoint, target) == 0;
-	return result;
-}
-
 /**
  * already_mounted -
  * @config:	current config
@@ -145,29 +125,12 @@ static bool pmt_utabent_matches(const struct vol *vpt, struct libmnt_fs *fs)
 int pmt_already_mounted(const struct config *const config,
     const struct vol *vpt, struct HXformat_map *vinfo)
 {
-	struct libmnt_context *ctx;
-	struct libmnt_table *table;
-	struct libmnt_iter *iter;
-	struct libmnt_fs *fs;
-	int ret = 0;
-
-	ctx = mnt_new_context();
-	if (ctx == NULL)
-		return -1;
-	if (mnt_context_get_mtab(ctx, &table) != 0)
-		goto out;
-	iter = mnt_new_iter(MNT_ITER_BACKWARD);
-	if (iter == NULL)
-		goto out;
+	const struct pmt_libmount_ops *ops = ehd_backend_load("pmt-libmount");
 
-	while (mnt_table_next_fs(table, iter, &fs) == 0)
-		if (pmt_utabent_matches(vpt, fs)) {
-			ret = 1;
-			break;
-		}
- out:
-	mnt_free_context(ctx);
-	return ret;
+	if (ops == NULL)
+		return -1;
+	return ops->mounted(vpt->volume, vpt->mountpoint,
+	       fstype2_icase(vpt->type));
 }
 
 static bool fstype_networked(enum command_type fstype)
@@ -243,11 +206,8 @@ hxmc_t *pmt_vol_to_dev(const struct vol *vol)
 }
 
 static void log_pm_input(const struct config *const config,
-    const struct vol *vpt)
+    const struct vol *vpt, const char *options)
 {
-	hxmc_t *options;
-
-	options = kvplist_to_str(&vpt->options);
 	w4rn(
 		"Mount info: %s, user=%s <volume fstype=\"%s\" "
 		"server=\"%s\" path=\"%s\" "
@@ -261,7 +221,6 @@ static void log_pm_input(const struct config *const config,
 		znul(vpt->fs_key_cipher), znul(vpt->fs_key_hash), options,
 		vpt->use_fstab, vpt->uses_ssh
 	);
-	HXmc_free(options);
 }
 
 /**
@@ -389,6 +348,7 @@ int do_unmount(const struct config *config, struct vol *vpt,
 {
 	struct HXdeque *argv;
 	struct HXproc proc;
+	unsigned long long t;
 	int ret, type;
 
 	assert(vinfo != NULL);
@@ -426,6 +386,7 @@ int do_unmount(const struct config *config, struct vol *vpt,
 	memset(&proc, 0, sizeof(proc));
 	proc.p_flags = HXPROC_VERBOSE | HXPROC_NULL_STDOUT | HXPROC_STDERR;
 	proc.p_ops   = &pmt_dropprivs_ops;
+	t = ehd_trace_clock();
 	if ((ret = pmt_spawn_dq(argv, &proc)) <= 0) {
 		ret = 0;
 		goto out;
@@ -435,6 +396,7 @@ int do_unmount(const struct config *config, struct vol *vpt,
 	if ((ret = HXproc_wait(&proc)) >= 0)
 		/* pass on through the result from the umount process */
 		ret = proc.p_exited && proc.p_status == 0;
+	ehd_trace_add(EHD_TRACE_HELPER, vpt->mountpoint, t);
 
  out:
 	if (vpt->created_mntpt && config->rmdir_mntpt)
@@ -610,11 +572,14 @@ int do_mount(const struct config *config, struct vol *vpt,
 	struct HXproc proc;
 	const char *mount_user;
 	hxmc_t *ll_password = NULL;
+	unsigned long long t;
 	int ret;
 
 	assert(vinfo != NULL);
 
+	t = ehd_trace_clock();
 	ret = pmt_already_mounted(config, vpt, vinfo);
+	ehd_trace_add(EHD_TRACE_MOUNTCHECK, vpt->mountpoint, t);
 	if (ret < 0) {
 		l0g("could not determine if %s is already mounted, "
 		    "failing\n", vpt->volume);
@@ -679,9 +644,12 @@ int do_mount(const struct config *config, struct vol *vpt,
 	 * in expandconfig(), but see the comment in mount_op().
 	 */
 
-	if (vpt->type == CMD_LCLMOUNT &&
-	    !check_filesystem(config, vpt, vinfo))
-		l0g("error checking filesystem but will continue\n");
+	if (vpt->type == CMD_LCLMOUNT) {
+		t = ehd_trace_clock();
+		if (!check_filesystem(config, vpt, vinfo))
+			l0g("error checking filesystem but will continue\n");
+		ehd_trace_add(EHD_TRACE_FSCK, vpt->mountpoint, t);
+	}
 	/* send password down pipe to mount process */
 	if (vpt->type == CMD_SMBMOUNT || vpt->type == CMD_CIFSMOUNT)
 		setenv("PASSWD_FD", "0", 1);
@@ -694,6 +662,7 @@ int do_mount(const struct config *config, struct vol *vpt,
 	               HXPROC_NULL_STDOUT | HXPROC_STDERR;
 	proc.p_ops   = &pmt_dropprivs_ops;
 	proc.p_data  = const_cast1(char *, mount_user);
+	t = ehd_trace_clock();
 	if ((ret = pmt_spawn_dq(argv, &proc)) <= 0) {
 		HXmc_free(ll_password);
 		return 0;
@@ -707,7 +676,10 @@ int do_mount(const struct config *config, struct vol *vpt,
 	HXmc_free(ll_password);
 
 	log_output(proc.p_stderr, "Messages from underlying mount program:\n");
-	if ((ret = HXproc_wait(&proc)) < 0) {
+	ret = HXproc_wait(&proc);
+	ehd_trace_add(EHD_TRACE_HELPER, vpt->mountpoint, t);
+	if (ret < 0) {
+		ehd_log_field(EHD_LOGK_ERRNO, "%d", -ret);
 		l0g("error waiting for child: %s\n", strerror(-ret));
 		return 0;
 	}
@@ -738,6 +710,99 @@ int do_mount(const struct config *config, struct vol *vpt,
 	return proc.p_exited && proc.p_status == 0;
 }
 
+/*
+ * Command line for do_prepare(). This is deliberately not the <cryptmount>
+ * command: a speculative unlock must never turn into a mount, whatever that
+ * command does with %(OPTIONS), so mount.crypt is run directly with -p.
+ */
+static const char *const prepare_args[] = {
+	"mount.crypt", "-p", "%(PREPARE)",
+	"%(if %(CIPHER),-ocipher=%(CIPHER))",
+	"%(if %(FSKEYCIPHER),-ofsk_cipher=%(FSKEYCIPHER))",
+	"%(if %(FSKEYHASH),-ofsk_hash=%(FSKEYHASH))",
+	"%(if %(FSKEYPATH),-okeyfile=%(FSKEYPATH))",
+	"%(if %(OPTIONS),-o%(OPTIONS))",
+	"%(VOLUME)", "%(MNTPT)", NULL,
+};
+
+/**
+ * do_prepare - unlock a crypt volume for a mount that is yet to come
+ * @config:	current configuration
+ * @vpt:	volume descriptor
+ * @vinfo:	variable substitution map
+ * @password:	password string
+ *
+ * Used for <speculative-unlock>. mount.crypt takes the password and then
+ * does the key derivation in the background, so this returns quickly.
+ * Returns zero on error, positive non-zero for success.
+ */
+int do_prepare(const struct config *config, struct vol *vpt,
+    struct HXformat_map *vinfo, const char *password)
+{
+	const char *const *arg;
+	struct HXdeque *argv;
+	struct HXproc proc;
+	char timeout[16];
+	size_t len;
+	int ret;
+
+	if (vpt->type != CMD_CRYPTMOUNT)
+		return 0;
+	snprintf(timeout, sizeof(timeout), "%u", config->spec_unlock);
+	format_add(vinfo, "PREPARE", timeout);
+	if ((argv = HXdeque_init()) == NULL) {
+		l0g("malloc: %s\n", strerror(errno));
+		return 0;
+	}
+	for (arg = prepare_args; *arg != NULL; ++arg)
+		arglist_add(argv, *arg, vinfo);
+	arglist_log(argv);
+
+	memset(&proc, 0, sizeof(proc));
+	proc.p_flags = HXPROC_VERBOSE | HXPROC_STDIN |
+	               HXPROC_NULL_STDOUT | HXPROC_STDERR;
+	proc.p_ops   = &pmt_dropprivs_ops;
+	if ((ret = pmt_spawn_dq(argv, &proc)) <= 0)
+		return 0;
+	password = (password != NULL) ? password : "";
+	len = strlen(password);
+	if (write(proc.p_stdin, password, len) != static_cast(ssize_t, len))
+		l0g("error sending password to mount.crypt\n");
+	close(proc.p_stdin);
+	log_output(proc.p_stderr, "Messages from mount.crypt:\n");
+	ret = HXproc_wait(&proc);
+	if (ret < 0) {
+		l0g("error waiting for child: %s\n", strerror(-ret));
+		return 0;
+	}
+	return proc.p_exited && proc.p_status == 0;
+}
+
+/**
+ * fstype_probe - replace fstype="auto" by the actual type
+ * @config:	current configuration
+ * @vpt:	volume to mount
+ *
+ * Only done for local block devices; everything else, and any failure, is
+ * left to mount(8) as before.
+ */
+static void fstype_probe(struct config *config, struct vol *vpt)
+{
+	const struct pmt_blkid_ops *ops;
+	struct stat sb;
+	char type[32], *tmp;
+
+	if (vpt->type != CMD_LCLMOUNT || strcmp(vpt->fstype, "auto") != 0 ||
+	    stat(vpt->combopath, &sb) < 0 || !S_ISBLK(sb.st_mode))
+		return;
+	if ((ops = ehd_backend_load("pmt-blkid")) == NULL ||
+	    !ops->fstype(vpt->combopath, type, sizeof(type)))
+		return;
+	w4rn("%s holds a %s filesystem\n", vpt->combopath, type);
+	if ((tmp = pmt_arena_strdup(&config->arena, type)) != NULL)
+		vpt->fstype = tmp;
+}
+
 /**
  * mount_op -
  * @mnt:	function to execute mount operations (do_mount or do_unmount)
@@ -748,13 +813,13 @@ int do_mount(const struct config *config, struct vol *vpt,
  * Returns zero on error, positive non-zero for success.
  * Note: Checked by volume_record_sane() and read_volume()
  */
-int mount_op(mount_op_fn_t *mnt, const struct config *config,
+int mount_op(mount_op_fn_t *mnt, struct config *config,
     struct vol *vpt, const char *password)
 {
 	int fnval;
 	struct HXformat_map *vinfo;
-	struct passwd *pe;
-	hxmc_t *options, *resmnt = NULL;
+	hxmc_t *options = NULL, *resmnt = NULL;
+	unsigned long long t;
 
 	/*
 	 * This expansion (the other is in expandconfig()!) expands the mount
@@ -769,10 +834,14 @@ int mount_op(mount_op_fn_t *mnt, const struct config *config,
 	if ((vinfo = HXformat_init()) == NULL)
 		return 0;
 
+	ehd_log_field(EHD_LOGK_VOLUME, "%s", vpt->mountpoint);
 	HXmc_free(vpt->combopath);
 	vpt->combopath = pmt_vol_to_dev(vpt);
 	if (vpt->combopath == NULL) {
+		ehd_log_field(EHD_LOGK_ERRNO, "%d", errno);
 		l0g("vol_to_dev: %s\n", strerror(errno));
+		ehd_log_field(EHD_LOGK_VOLUME, NULL);
+		HXformat_free(vinfo);
 		return 0;
 	}
 
@@ -781,43 +850,42 @@ int mount_op(mount_op_fn_t *mnt, const struct config *config,
 		w4rn("Could not get realpath of %s: %s\n",
 		     vpt->mountpoint, strerror(-fnval));
 	} else {
-		vpt->mountpoint = HX_strdup(resmnt);
+		char *tmp = pmt_arena_strdup(&config->arena, resmnt);
+		if (tmp != NULL)
+			vpt->mountpoint = tmp;
 		HXmc_free(resmnt);
 	}
+	if (mnt == do_mount)
+		fstype_probe(config, vpt);
 
 	format_add(vinfo, "MNTPT",    vpt->mountpoint);
 	format_add(vinfo, "FSTYPE",   vpt->fstype);
 	format_add(vinfo, "VOLUME",   vpt->volume);
 	format_add(vinfo, "COMBOPATH", vpt->combopath);
 	format_add(vinfo, "SERVER",   vpt->server);
-	format_add(vinfo, "USER",     vpt->user);
 	format_add(vinfo, "CIPHER",   vpt->cipher);
 	format_add(vinfo, "FSKEYCIPHER", vpt->fs_key_cipher);
 	format_add(vinfo, "FSKEYHASH",   vpt->fs_key_hash);
 	format_add(vinfo, "FSKEYPATH",   vpt->fs_key_path);
-	misc_add_ntdom(vinfo, vpt->user);
+	/* vpt->user is always config->user; see rc_volume(). */
+	userinfo_add(vinfo, config_userinfo(config));
+	if (!config->uinfo.have_pw)
+		w4rn("getpwnam(\"%s\") failed\n", config->user);
 
-	if ((pe = getpwnam(vpt->user)) == NULL) {
-		w4rn("getpwnam(\"%s\") failed: %s\n",
-		     Config.user, strerror(errno));
-	} else {
-		HXformat_add(vinfo, "USERUID", reinterpret_cast(void *,
-			static_cast(long, pe->pw_uid)),
-			HXTYPE_UINT | HXFORMAT_IMMED);
-		HXformat_add(vinfo, "USERGID", reinterpret_cast(void *,
-			static_cast(long, pe->pw_gid)),
-			HXTYPE_UINT | HXFORMAT_IMMED);
-	}
-
-	options = kvplist_to_str(&vpt->options);
+	kvplist_to_str(&options, &vpt->options);
 	HXformat_add(vinfo, "OPTIONS", options, HXTYPE_STRING | HXFORMAT_IMMED);
 
 	if (config->debug)
-		log_pm_input(config, vpt);
+		log_pm_input(config, vpt, options);
 
+	t = ehd_trace_clock();
 	fnval = (*mnt)(config, vpt, vinfo, password);
+	if (config->metrics)
+		pmt_metrics_record(vpt->type, vpt->server, mnt == do_unmount,
+			fnval > 0, (ehd_trace_clock() - t) / 1000);
 	HXmc_free(options);
 	HXformat_free(vinfo);
+	ehd_log_field(EHD_LOGK_VOLUME, NULL);
 	return fnval;
 }
 
@@ -855,12 +923,35 @@ int fstype_nodev(const char *name)
 	return -1;
 }
 
+/**
+ * umount_needs_helper - whether a volume has state outside the mount table
+ * @vol:	volume
+ *
+ * dm-crypt mappings, FUSE daemons and the like do not go away by themselves
+ * when the last reference to the mount is dropped.
+ */
+static bool umount_needs_helper(const struct vol *vol)
+{
+	switch (vol->type) {
+	case CMD_CRYPTMOUNT:
+	case CMD_FUSEMOUNT:
+	case CMD_NCPMOUNT:
+	case CMD_SMBMOUNT:
+		return true;
+	default:
+		return false;
+	}
+}
+
 /**
  * umount_final - called when the last session has exited
+ * @config:	configuration
+ * @in_ns:	the volumes live in a per-user namespace that is about to be
+ * 		released; only unmount those that need their helper
  *
  * Send signals to processes and then unmount.
  */
-void umount_final(struct config *config)
+void umount_final(struct config *config, bool in_ns)
 {
 	struct vol *vol;
 
@@ -868,20 +959,36 @@ void umount_final(struct config *config)
 		/* Avoid needlessy waiting on usleep */
 		return;
 
+	/*
+	 * Volumes of other PAM services are only ours to clean up if such
+	 * a session did mount them; otherwise their mountpoints must not
+	 * even be looked at by ofl.
+	 */
+	HXlist_for_each_entry(vol, &config->volume_list, list)
+		if (vol->other_service &&
+		    pmt_already_mounted(config, vol, NULL) > 0)
+			vol->other_service = false;
+
 	if (config->sig_hup)
 		HXlist_for_each_entry_rev(vol, &config->volume_list, list)
-			run_ofl(config, vol->mountpoint, SIGHUP);
+			if (!vol->other_service)
+				run_ofl(config, vol->mountpoint, SIGHUP);
 	if (config->sig_term) {
 		usleep(config->sig_wait);
 		HXlist_for_each_entry_rev(vol, &config->volume_list, list)
-			run_ofl(config, vol->mountpoint, SIGTERM);
+			if (!vol->other_service)
+				run_ofl(config, vol->mountpoint, SIGTERM);
 	}
 	if (config->sig_kill) {
 		usleep(config->sig_wait);
 		HXlist_for_each_entry_rev(vol, &config->volume_list, list)
-			run_ofl(config, vol->mountpoint, SIGKILL);
+			if (!vol->other_service)
+				run_ofl(config, vol->mountpoint, SIGKILL);
 	}
 	HXlist_for_each_entry_rev(vol, &config->volume_list, list) {
+		if (vol->other_service ||
+		    (in_ns && !umount_needs_helper(vol)))
+			continue;
 		w4rn("going to unmount\n");
 		if (!mount_op(do_unmount, config, vol, NULL))
 			l0g("unmount of %s failed\n",
@@ -49,7 +49,11 @@ enum {
 /* crypto mtab */
 static const char pmt_cmtab_file[] = RUNDIR "/cmtab";
 
-#if defined(__linux__)
+/* bench-mtab compiles this file with its own RUNDIR and SMTAB */
+#if defined(SMTAB)
+static const char pmt_smtab_file[] = SMTAB;
+static const char pmt_kmtab_file[] = "";
+#elif defined(__linux__)
 static const char pmt_smtab_file[] = "/etc/mtab";
 static const char pmt_kmtab_file[] = "/proc/mounts";
 #elif defined(__sun__)
@@ -249,7 +253,7 @@ static void cmtab_parse_line(char *line, char **field)
 }
 
 /**
- * __pmt_cmtab_get - get one mtab entry
+ * pmt_cmtab_get1 - get one cmtab entry, without checking smtab
  * @spec:		specificator to match on (must be %CMTABF_*)
  * @type:		type of the specificator
  * @mountpoint:		mountpoint
@@ -260,7 +264,7 @@ static void cmtab_parse_line(char *line, char **field)
  * Returns true/1 if an entry has been found, false/0 if not,
  * negative indicates errno.
  */
-static int pmt_cmtab_get1(const char *spec, enum cmtab_field type,
+int pmt_cmtab_get1(const char *spec, enum cmtab_field type,
     char **mountpoint, char **container, char **loop_device,
     char **crypto_device)
 {
@@ -6,6 +6,9 @@
  *	as published by the Free Software Foundation; either version 2.1
  *	of the License, or (at your option) any later version.
  */
+#define _GNU_SOURCE 1
+#include "config.h"
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -42,6 +45,9 @@
  * @fsck:		true if fsck should be performed
  * @remount:		issue a remount
  * @allow_discards:	set block device to allow fs trim requests
+ * @keycache:		seconds to cache the LUKS volume key (0: off)
+ * @prepare:		only unlock, and drop the mapping again after this many
+ * 			seconds unless a real mount picked it up
  */
 struct mount_options {
 	hxmc_t *object, *container, *mountpoint;
@@ -50,7 +56,7 @@ struct mount_options {
 	const char *fsk_hash, *fsk_cipher, *fsk_file;
 	hxmc_t *fsk_password, *extra_opts, *crypto_device;
 	char *loop_device;
-	unsigned int no_update, readonly, trunc_keysize;
+	unsigned int no_update, readonly, trunc_keysize, keycache, prepare;
 	bool is_cont;
 	bool blkdev;
 	bool fsck;
@@ -150,6 +156,13 @@ static void mtcr_parse_suboptions(const struct HXoptcb *cbi)
 			mo->crypto_name = value;
 		} else if (strcmp(key, "allow_discard") == 0) {
 			mo->allow_discards = true;
+		} else if (strcmp(key, "keycache") == 0) {
+			mo->keycache = (value != NULL) ?
+			               strtoul(value, NULL, 0) : 300;
+		} else if (strcmp(key, "prepare") == 0) {
+			/* must not come in through a volume's options */
+			fprintf(stderr, "Option \"prepare\" ignored; "
+			        "use -p instead.\n");
 		} else {
 			/*
 			 * Above are the pam_mount-specific options that are
@@ -211,6 +224,9 @@ static bool mtcr_get_mount_options(int *argc, const char ***argv,
 		 .help = "Do not update /etc/mtab"},
 		{.sh = 'o', .type = HXTYPE_STRING, .cb = mtcr_parse_suboptions,
 		 .uptr = opt, .help = "Mount options"},
+		{.sh = 'p', .type = HXTYPE_UINT, .ptr = &opt->prepare,
+		 .help = "Only unlock; lock again if not mounted within "
+		 "SECONDS", .htyp = "SECONDS"},
 		{.sh = 'r', .type = HXTYPE_NONE, .ptr = &opt->readonly,
 		 .help = "Set up devices and mounts as read-only"},
 		{.sh = 'v', .type = HXTYPE_NONE, .ptr = &mtcr_debug,
@@ -432,23 +448,119 @@ static int mtcr_fsck(struct ehd_mount_request *rq,
 }
 
 /**
- * mtcr_mount
+ * mtcr_lock_container - serialize setup and teardown of one container
+ * @container:	image file or block device
  *
- * Returns positive non-zero for success.
+ * flock(2) on the container itself makes concurrent mount.crypt and
+ * umount.crypt runs for the same volume wait for each other, while
+ * unrelated volumes proceed in parallel. Returns a descriptor to close(2)
+ * when done, or -1 if locking failed, in which case we go on unlocked.
  */
-static int mtcr_mount(struct mount_options *opt)
+static int mtcr_lock_container(const char *container)
+{
+	int fd;
+
+	if ((fd = open(container, O_RDONLY | O_CLOEXEC)) < 0) {
+		w4rn("Could not open %s for locking: %s\n",
+		     container, strerror(errno));
+		return -1;
+	}
+	if (flock(fd, LOCK_EX) < 0) {
+		w4rn("Could not lock %s: %s\n", container, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * mtcr_mount_fs - run mount(8) for the crypto device
+ * @device:	the dm-crypt device to mount on @opt->mountpoint
+ *
+ * Returns the HXproc_run_sync status, i.e. 0 for success.
+ */
+static int mtcr_mount_fs(struct mount_options *opt, const char *device)
+{
+	const struct pmt_blkid_ops *blkid;
+	const char *mount_args[8], *fstype = opt->fstype;
+	char type[32];
+	int argk = 0;
+
+	/* Spare mount(8) trying every filesystem type on the device. */
+	if (fstype == NULL &&
+	    (blkid = ehd_backend_load("pmt-blkid")) != NULL &&
+	    blkid->fstype(device, type, sizeof(type)))
+		fstype = type;
+
+	/* candidate for replacement by some libmount calls, I guess. */
+	mount_args[argk++] = "mount";
+	if (fstype != NULL) {
+		mount_args[argk++] = "-t";
+		mount_args[argk++] = fstype;
+	}
+	if (opt->extra_opts == NULL) {
+		opt->extra_opts = "helper=crypt";
+	} else if (*opt->extra_opts != '\0') {
+		HXmc_strcat(&opt->extra_opts, ",");
+		HXmc_strcat(&opt->extra_opts, "helper=crypt");
+	}
+
+	if (opt->extra_opts != NULL) {
+		mount_args[argk++] = "-o";
+		mount_args[argk++] = opt->extra_opts;
+	}
+	mount_args[argk++] = device;
+	mount_args[argk++] = opt->mountpoint;
+	mount_args[argk] = NULL;
+
+	assert(argk < ARRAY_SIZE(mount_args));
+	arglist_llog(mount_args);
+	return HXproc_run_sync(mount_args, HXPROC_VERBOSE);
+}
+
+/**
+ * mtcr_record - add a successful mount to cmtab and smtab
+ * @mount_info:	devices of the volume; the mountpoint is filled in here
+ */
+static int mtcr_record(const struct mount_options *opt,
+    struct ehd_mount_info *mount_info)
+{
+	int ret;
+
+	ret = HX_realpath(&mount_info->mountpoint, opt->mountpoint,
+	      HX_REALPATH_DEFAULT | HX_REALPATH_ABSOLUTE);
+	if (ret <= 0)
+		return ret;
+	if ((ret = pmt_cmtab_add(mount_info)) <= 0) {
+		fprintf(stderr, "pmt_cmtab_add: %s\n", strerror(errno));
+		/* ignore error on cmtab - let user have his crypto */
+	} else if (opt->no_update) {
+		/* awesome logic */;
+	} else {
+		pmt_smtab_add(mount_info->container, mount_info->mountpoint,
+			"crypt", (opt->extra_opts != NULL) ?
+			opt->extra_opts : "defaults");
+	}
+	return ret;
+}
+
+/**
+ * mtcr_request - build the ehd_load() request for a mount
+ *
+ * This is also what ehd_verify() checks the key of an already unlocked
+ * container with. Returns %NULL on failure, which has been reported.
+ */
+static struct ehd_mount_request *mtcr_request(struct mount_options *opt)
 {
-	const char *mount_args[8];
 	hxmc_t *key = NULL;
-	int ret, argk;
-	struct ehd_mount_info *mount_info;
+	int ret;
 	struct ehd_mount_request *mount_request;
 	unsigned int key_size = 0, trunc_keysize;
 
 	mount_request = ehd_mtreq_new();
 	if (mount_request == NULL) {
 		fprintf(stderr, "%s\n", strerror(errno));
-		return 0;
+		return NULL;
 	}
 	ret = ehd_mtreq_set(mount_request, EHD_MTREQ_CONTAINER, opt->container);
 	if (ret < 0)
@@ -467,6 +579,9 @@ static int mtcr_mount(struct mount_options *opt)
 		goto out_r;
 	ret = ehd_mtreq_set(mount_request, EHD_MTREQ_ALLOW_DISCARDS,
 	      opt->allow_discards);
+	if (ret < 0)
+		goto out_r;
+	ret = ehd_mtreq_set(mount_request, EHD_MTREQ_KEYCACHE, opt->keycache);
 	if (ret < 0)
 		goto out_r;
 	/* Hack for CRYPT_PLAIN: default to 256 */
@@ -526,67 +641,421 @@ static int mtcr_mount(struct mount_options *opt)
 	}
 
 	w4rn("keysize=%u trunc_keysize=%u\n", key_size, trunc_keysize);
-	if ((ret = ehd_load(mount_request, &mount_info)) < 0) {
-		fprintf(stderr, "ehd_load: %s\n", strerror(errno));
-		goto out_z;
-	} else if (ret == 0) {
-		goto out_z;
-	}
+	return mount_request;
 
-	/* candidate for replacement by some libmount calls, I guess. */
-	argk = 0;
-	mount_args[argk++] = "mount";
-	if (opt->fstype != NULL) {
-		mount_args[argk++] = "-t";
-		mount_args[argk++] = opt->fstype;
+ out_r:
+	fprintf(stderr, "ehd_mtreq_set: %s\n", strerror(-ret));
+ out_z:
+	HXmc_free(key);
+	ehd_mtreq_free(mount_request);
+	return NULL;
+}
+
+/**
+ * mtcr_verify - check the key of @opt against an unlocked container
+ * @crypto_device:	active crypto device of @opt->container
+ */
+static bool mtcr_verify(struct mount_options *opt, const char *crypto_device)
+{
+	struct ehd_mount_request *rq;
+	int ret;
+
+	if ((rq = mtcr_request(opt)) == NULL)
+		return false;
+	ret = ehd_verify(rq, crypto_device);
+	ehd_mtreq_free(rq);
+	if (ret == 0)
+		fprintf(stderr, "The key does not open %s\n", opt->container);
+	else if (ret < 0)
+		fprintf(stderr, "Could not check the key against %s: %s\n",
+		        crypto_device, strerror(-ret));
+	return ret > 0;
+}
+
+/**
+ * mtcr_mount_shared - mount an already unlocked container once more
+ *
+ * If cmtab shows @opt->container mounted somewhere else and its crypto
+ * device is still there, mount that device on @opt->mountpoint as well
+ * instead of setting up loop and dm-crypt again. The key given for this
+ * mount is still checked against the volume, as whoever unlocked it first
+ * need not be the one asking now.
+ * Every mountpoint has its own cmtab line; the number of lines for a
+ * container is its reference count, see mtcr_container_busy().
+ *
+ * Returns 0 if the container is not unlocked yet, 1 on success and -1 on
+ * failure.
+ */
+static int mtcr_mount_shared(struct mount_options *opt)
+{
+	char *mountpoint = NULL, *loop_device = NULL, *crypto_device = NULL;
+	struct ehd_mount_info mount_info;
+	struct stat sb;
+	int ret;
+
+	memset(&mount_info, 0, sizeof(mount_info));
+	ret = pmt_cmtab_get(opt->container, CMTABF_CONTAINER, &mountpoint,
+	      &mount_info.container, &loop_device, &crypto_device);
+	if (ret <= 0 || crypto_device == NULL || stat(crypto_device, &sb) < 0 ||
+	    !S_ISBLK(sb.st_mode)) {
+		ret = 0;
+		goto out;
 	}
-	if (opt->extra_opts == NULL) {
-		opt->extra_opts = "helper=crypt";
-	} else if (*opt->extra_opts != '\0') {
-		HXmc_strcat(&opt->extra_opts, ",");
-		HXmc_strcat(&opt->extra_opts, "helper=crypt");
+	w4rn("%s is already unlocked as %s (mounted on %s), reusing it\n",
+	     opt->container, crypto_device, mountpoint);
+	if (!mtcr_verify(opt, crypto_device)) {
+		ret = -1;
+		goto out;
 	}
 
-	if (opt->extra_opts != NULL) {
-		mount_args[argk++] = "-o";
-		mount_args[argk++] = opt->extra_opts;
+	ret = mtcr_mount_fs(opt, crypto_device);
+	if (ret != 0) {
+		fprintf(stderr, "mount failed with run_sync status %d\n", ret);
+		ret = -1;
+		goto out;
 	}
-	mount_args[argk++] = mount_info->crypto_device;
-	mount_args[argk++] = opt->mountpoint;
-	mount_args[argk] = NULL;
+	mount_info.loop_device   = loop_device;
+	mount_info.crypto_device = crypto_device;
+	ret = (mtcr_record(opt, &mount_info) > 0) ? 1 : -1;
+	HXmc_free(mount_info.mountpoint);
+ out:
+	free(mountpoint);
+	free(mount_info.container);
+	free(loop_device);
+	free(crypto_device);
+	return ret;
+}
 
-	assert(argk < ARRAY_SIZE(mount_args));
-	arglist_llog(mount_args);
-	if ((ret = HXproc_run_sync(mount_args, HXPROC_VERBOSE)) != 0) {
+/**
+ * mtcr_prepared_key - cmtab key of a prepared mapping
+ *
+ * A prepared mapping is recorded in cmtab like a mount, except that the
+ * mountpoint field is this relative (and thus never really mounted) name.
+ * pmt_cmtab_get() does not report such lines, because they are not in
+ * smtab; they are only found with pmt_cmtab_get1().
+ */
+static hxmc_t *mtcr_prepared_key(const char *mountpoint)
+{
+	hxmc_t *key = HXmc_strinit("prepared:");
+
+	if (key != NULL)
+		HXmc_strcat(&key, mountpoint);
+	return key;
+}
+
+static void mtcr_prepared_free(struct ehd_mount_info *mi)
+{
+	free(mi->container);
+	free(mi->loop_device);
+	free(mi->crypto_device);
+}
+
+/**
+ * mtcr_prepared_take - look up and unregister a prepared mapping
+ * @key:	from mtcr_prepared_key()
+ * @container:	container the mapping has to belong to
+ * @mi:		filled with the devices of the mapping
+ *
+ * Must be called with the container locked. Returns 1 if a mapping of
+ * @container was found and removed from cmtab, 0 otherwise.
+ */
+static int mtcr_prepared_take(const char *key, const char *container,
+    struct ehd_mount_info *mi)
+{
+	char *mountpoint = NULL;
+	struct stat sb;
+	int ret;
+
+	memset(mi, 0, sizeof(*mi));
+	ret = pmt_cmtab_get1(key, CMTABF_MOUNTPOINT, &mountpoint,
+	      &mi->container, &mi->loop_device, &mi->crypto_device);
+	free(mountpoint);
+	if (ret <= 0)
+		return 0;
+	pmt_cmtab_remove(key);
+	if (strcmp(mi->container, container) != 0 ||
+	    mi->crypto_device == NULL || stat(mi->crypto_device, &sb) < 0 ||
+	    !S_ISBLK(sb.st_mode)) {
+		mtcr_prepared_free(mi);
+		memset(mi, 0, sizeof(*mi));
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * mtcr_mount_prepared - mount a mapping left by "-p"
+ *
+ * The key given for this mount is checked against the volume first; the
+ * mapping was made with whatever password was typed at authentication,
+ * which need not be the one of the session now being opened. If it is the
+ * same, the verifier that the backend stored with the mapping recognizes it
+ * without running the KDF a second time. A mapping that fails the check is
+ * left for its expiry timer.
+ *
+ * Returns 0 if there is none, 1 on success and -1 on failure.
+ */
+static int mtcr_mount_prepared(struct mount_options *opt)
+{
+	struct ehd_mount_info mi;
+	hxmc_t *key;
+	int ret;
+
+	if ((key = mtcr_prepared_key(opt->mountpoint)) == NULL)
+		return 0;
+	if (mtcr_prepared_take(key, opt->container, &mi) == 0) {
+		HXmc_free(key);
+		return 0;
+	}
+	w4rn("%s was unlocked ahead of time as %s, using it\n",
+	     opt->container, mi.crypto_device);
+	if (!mtcr_verify(opt, mi.crypto_device)) {
+		mi.mountpoint = key;
+		if (pmt_cmtab_add(&mi) <= 0)
+			ehd_unload(&mi);
+		mtcr_prepared_free(&mi);
+		HXmc_free(key);
+		return -1;
+	}
+	HXmc_free(key);
+	ret = mtcr_mount_fs(opt, mi.crypto_device);
+	if (ret != 0) {
 		fprintf(stderr, "mount failed with run_sync status %d\n", ret);
+		ehd_unload(&mi);
+		ret = -1;
+	} else {
+		ret = (mtcr_record(opt, &mi) > 0) ? 1 : -1;
+		HXmc_free(mi.mountpoint);
+	}
+	mtcr_prepared_free(&mi);
+	return ret;
+}
+
+/**
+ * mtcr_detach_stdio - continue in the background
+ *
+ * mount(8) and pam_mount wait for EOF on our stdio, so a process that is to
+ * outlive them lets go of it; messages then only go to syslog.
+ */
+static void mtcr_detach_stdio(void)
+{
+	int fd;
+
+	setsid();
+	if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	ehd_logctl(EHD_LOGFT_NOSYSLOG, EHD_LOG_UNSET);
+}
+
+/**
+ * mtcr_prepare_expire - drop a prepared mapping nobody asked for
+ * @key:	from mtcr_prepared_key()
+ *
+ * Runs in a detached child. If the session that the mapping was prepared
+ * for is never opened (failed account check, aborted login), the mapping
+ * is removed after @opt->prepare seconds.
+ */
+static void mtcr_prepare_expire(const struct mount_options *opt,
+    const char *key)
+{
+	unsigned int left = opt->prepare;
+	struct ehd_mount_info mi;
+	int fd;
+
+	for (fd = sysconf(_SC_OPEN_MAX) - 1; fd > STDERR_FILENO; --fd)
+		close(fd);
+	mtcr_detach_stdio();
+	while (left > 0)
+		left = sleep(left);
+	fd = mtcr_lock_container(opt->container);
+	if (mtcr_prepared_take(key, opt->container, &mi) > 0) {
+		l0g("%s was not mounted within %us, locking it again\n",
+		    opt->container, opt->prepare);
+		ehd_unload(&mi);
+		mtcr_prepared_free(&mi);
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+/**
+ * mtcr_container_busy - check for other mounts of a container
+ *
+ * To be called after the cmtab line of the mountpoint being unmounted has
+ * been removed. Only entries that are still mounted count.
+ */
+static bool mtcr_container_busy(const char *container)
+{
+	char *mountpoint = NULL, *cont = NULL;
+	int ret;
+
+	ret = pmt_cmtab_get(container, CMTABF_CONTAINER, &mountpoint, &cont,
+	      NULL, NULL);
+	if (ret > 0)
+		w4rn("%s is still mounted on %s, keeping it unlocked\n",
+		     container, mountpoint);
+	free(mountpoint);
+	free(cont);
+	return ret > 0;
+}
+
+/**
+ * mtcr_record_prepared - register a mapping made by "-p"
+ * @mount_info:	devices of the volume
+ *
+ * Records the mapping under mtcr_prepared_key() and leaves a child behind
+ * that removes it again if it is not used in time.
+ */
+static int mtcr_record_prepared(const struct mount_options *opt,
+    struct ehd_mount_info *mount_info)
+{
+	pid_t pid;
+	int ret;
+
+	HXmc_free(mount_info->mountpoint);
+	mount_info->mountpoint = mtcr_prepared_key(opt->mountpoint);
+	if (mount_info->mountpoint == NULL) {
 		ehd_unload(mount_info);
-		ret = 0;
-		goto out_i;
+		return 0;
 	}
-	ret = HX_realpath(&mount_info->mountpoint, opt->mountpoint,
-	      HX_REALPATH_DEFAULT | HX_REALPATH_ABSOLUTE);
-	if (ret <= 0)
-		goto out_i;
 	if ((ret = pmt_cmtab_add(mount_info)) <= 0) {
-		fprintf(stderr, "pmt_cmtab_add: %s\n", strerror(errno));
-		/* ignore error on cmtab - let user have his crypto */
-	} else if (opt->no_update) {
-		/* awesome logic */;
-	} else {
-		pmt_smtab_add(mount_info->container, mount_info->mountpoint,
-			"crypt", (opt->extra_opts != NULL) ?
-			opt->extra_opts : "defaults");
+		fprintf(stderr, "pmt_cmtab_add: %s\n", strerror(-ret));
+		ehd_unload(mount_info);
+		return 0;
+	}
+	if ((pid = fork()) < 0) {
+		/* Still usable; it just will not expire. */
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+	} else if (pid == 0) {
+		mtcr_prepare_expire(opt, mount_info->mountpoint);
+		_exit(EXIT_SUCCESS);
 	}
+	w4rn("%s unlocked as %s, waiting for the mount\n",
+	     opt->container, mount_info->crypto_device);
+	return 1;
+}
+
+/**
+ * mtcr_mount_new - unlock a container and mount it
+ *
+ * Returns positive non-zero for success.
+ */
+static int mtcr_mount_new(struct mount_options *opt)
+{
+	struct ehd_mount_info *mount_info;
+	struct ehd_mount_request *mount_request;
+	int ret;
 
- out_i:
+	if ((mount_request = mtcr_request(opt)) == NULL)
+		return 0;
+	if ((ret = ehd_load(mount_request, &mount_info)) < 0) {
+		fprintf(stderr, "ehd_load: %s\n", strerror(errno));
+		ret = 0;
+		goto out_r;
+	} else if (ret == 0) {
+		goto out_r;
+	}
+
+	if (opt->prepare != 0) {
+		ret = mtcr_record_prepared(opt, mount_info);
+		goto out;
+	}
+	if ((ret = mtcr_mount_fs(opt, mount_info->crypto_device)) != 0) {
+		fprintf(stderr, "mount failed with run_sync status %d\n", ret);
+		ehd_unload(mount_info);
+		ret = 0;
+		goto out;
+	}
+	ret = mtcr_record(opt, mount_info);
+ out:
 	ehd_mtinfo_free(mount_info);
+ out_r:
+	ehd_mtreq_free(mount_request);
 	return ret;
+}
 
- out_r:
-	fprintf(stderr, "ehd_mtreq_set: %s\n", strerror(-ret));
- out_z:
+/**
+ * mtcr_prepare - unlock a container for a mount that is yet to come
+ *
+ * Used by pam_mount during authentication, so that the KDF runs while the
+ * rest of the PAM stack does. Nothing is done if the container is already
+ * unlocked, be it for another mountpoint or by an earlier prepare. To be
+ * called with the container locked. Returns positive non-zero for success.
+ */
+static int mtcr_prepare(struct mount_options *opt)
+{
+	char *mountpoint = NULL, *container = NULL;
+	hxmc_t *key;
+	int ret;
+
+	ret = pmt_cmtab_get(opt->container, CMTABF_CONTAINER, &mountpoint,
+	      &container, NULL, NULL);
+	free(mountpoint);
+	free(container);
+	if (ret > 0)
+		return 1;
+	if ((key = mtcr_prepared_key(opt->mountpoint)) == NULL)
+		return 0;
+	ret = pmt_cmtab_get1(key, CMTABF_MOUNTPOINT, NULL, NULL, NULL, NULL);
 	HXmc_free(key);
-	return 0;
+	if (ret > 0)
+		return 1;
+	return mtcr_mount_new(opt);
+}
+
+/**
+ * mtcr_prepare_detached - "-p": run mtcr_prepare() in the background
+ *
+ * The password has been read by now, so the caller (pam_mount) can go on
+ * while we derive the key. The container lock is taken before forking and
+ * passed on to the child, so that a mount.crypt for the session that comes
+ * in right after us waits for the unlock instead of starting its own.
+ * Returns positive non-zero for success.
+ */
+static int mtcr_prepare_detached(struct mount_options *opt)
+{
+	int fd, ret;
+	pid_t pid;
+
+	fd = mtcr_lock_container(opt->container);
+	if ((pid = fork()) < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+	} else if (pid > 0) {
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	} else {
+		mtcr_detach_stdio();
+	}
+	ret = mtcr_prepare(opt);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/**
+ * mtcr_mount
+ *
+ * Returns positive non-zero for success.
+ */
+static int mtcr_mount(struct mount_options *opt)
+{
+	int fd, ret;
+
+	fd = mtcr_lock_container(opt->container);
+	if ((ret = mtcr_mount_shared(opt)) == 0 &&
+	    (ret = mtcr_mount_prepared(opt)) == 0)
+		ret = mtcr_mount_new(opt);
+	if (ret < 0)
+		ret = 0;
+	if (fd >= 0)
+		close(fd);
+	return ret;
 }
 
 static bool mtcr_get_umount_options(int *argc, const char ***argv,
@@ -711,6 +1180,33 @@ static void mtcr_log_contents(const char *file)
 	fclose(fp);
 }
 
+/**
+ * mtcr_umount_lock - lock the container before looking at cmtab
+ * @locked:	receives the container that was locked
+ *
+ * When given a mountpoint, the container is only known from cmtab, so
+ * cmtab is read once unlocked just to find out what to lock. The caller
+ * reads it again under the lock and checks that it is still the same
+ * container.
+ */
+static int mtcr_umount_lock(const struct umount_options *opt, char **locked)
+{
+	char *mountpoint = NULL;
+	int ret;
+
+	*locked = NULL;
+	if (opt->is_cont) {
+		*locked = HX_strdup(opt->object);
+	} else {
+		ret = pmt_cmtab_get1(opt->object, CMTABF_MOUNTPOINT,
+		      &mountpoint, locked, NULL, NULL);
+		free(mountpoint);
+		if (ret <= 0)
+			return -1;
+	}
+	return (*locked != NULL) ? mtcr_lock_container(*locked) : -1;
+}
+
 /**
  * mtcr_umount - unloads the EHD from mountpoint
  *
@@ -719,17 +1215,36 @@ static void mtcr_log_contents(const char *file)
 static int mtcr_umount(struct umount_options *opt)
 {
 	const char *umount_args[4];
-	int final_ret, ret, argk = 0;
+	int final_ret, ret, argk = 0, fd;
 	struct ehd_mount_info mount_info;
-	char *mountpoint = NULL;
+	char *mountpoint = NULL, *locked;
+	bool busy;
 
 	memset(&mount_info, 0, sizeof(mount_info));
+	fd = mtcr_umount_lock(opt, &locked);
 	ret = pmt_cmtab_get(opt->object, opt->is_cont ? CMTABF_CONTAINER :
 	      CMTABF_MOUNTPOINT, &mountpoint, &mount_info.container,
 	      &mount_info.loop_device, &mount_info.crypto_device);
+	if (ret > 0 && (locked == NULL ||
+	    strcmp(locked, mount_info.container) != 0)) {
+		/* cmtab changed in between; lock what it says now */
+		if (fd >= 0)
+			close(fd);
+		fd = mtcr_lock_container(mount_info.container);
+		free(mountpoint);
+		free(mount_info.container);
+		free(mount_info.loop_device);
+		free(mount_info.crypto_device);
+		ret = pmt_cmtab_get(opt->object, opt->is_cont ?
+		      CMTABF_CONTAINER : CMTABF_MOUNTPOINT, &mountpoint,
+		      &mount_info.container, &mount_info.loop_device,
+		      &mount_info.crypto_device);
+	}
+	free(locked);
 	if (ret < 0) {
 		fprintf(stderr, "pmt_cmtab_get: %s\n", strerror(-ret));
-		return 0;
+		final_ret = 0;
+		goto out;
 	} else if (ret == 0) {
 		fprintf(stderr, "No vfsmount found while searching for \"%s\" "
 		        "as a container file, or as a mountpoint. (According "
@@ -738,7 +1253,8 @@ static int mtcr_umount(struct umount_options *opt)
 		mtcr_log_contents(pmt_cmtab_path());
 		mtcr_log_contents(pmt_smtab_path());
 		mtcr_log_contents(pmt_kmtab_path());
-		return 1;
+		final_ret = 1;
+		goto out;
 	} else {
 		if (ret & PMT_BY_CONTAINER)
 			w4rn("Found container in smtab\n");
@@ -757,11 +1273,17 @@ static int mtcr_umount(struct umount_options *opt)
 
 	assert(argk < ARRAY_SIZE(umount_args));
 	arglist_llog(umount_args);
-	if ((final_ret = HXproc_run_sync(umount_args, HXPROC_VERBOSE)) != 0) {
+	final_ret = HXproc_run_sync(umount_args, HXPROC_VERBOSE);
+	/* Other mountpoints of a shared container keep the mapping alive. */
+	busy = mtcr_container_busy(mount_info.container);
+	if (final_ret != 0) {
 		fprintf(stderr, "umount %s failed with run_sync status %d\n",
 		        opt->object, ret);
 		final_ret = 0;
-		ehd_unload(&mount_info);
+		if (!busy)
+			ehd_unload(&mount_info);
+	} else if (busy) {
+		final_ret = 1;
 	} else if ((ret = ehd_unload(&mount_info)) <= 0) {
 		fprintf(stderr, "ehd_unload: %s\n", strerror(-ret));
 		final_ret = 0;
@@ -769,6 +1291,9 @@ static int mtcr_umount(struct umount_options *opt)
 		final_ret = 1;
 	}
 
+ out:
+	if (fd >= 0)
+		close(fd);
 	return final_ret;
 }
 
@@ -799,6 +1324,9 @@ static int main2(int argc, const char **argv)
 		if (opt.remount)
 			return (mtcr_remount(&opt) > 0) ?
 			       EXIT_SUCCESS : EXIT_FAILURE;
+		else if (opt.prepare != 0)
+			return (mtcr_prepare_detached(&opt) > 0) ?
+			       EXIT_SUCCESS : EXIT_FAILURE;
 		else
 			return (mtcr_mount(&opt) > 0) ?
 			       EXIT_SUCCESS : EXIT_FAILURE;
@@ -809,6 +1337,7 @@ static int main2(int argc, const char **argv)
 
 int main(int argc, const char **argv)
 {
+	char tag[64];
 	int ret;
 
 	ret = HX_init();
@@ -822,7 +1351,16 @@ int main(int argc, const char **argv)
 		abort();
 	}
 
+#ifdef HAVE_SECURE_GETENV
+	/* exported by pam_mount's trace_setup() */
+	ehd_trace_sink(secure_getenv("_PMT_TRACE"));
+#endif
+	/* ppid= ties this record to the pam_mount record of the login */
+	snprintf(tag, sizeof(tag), "%s ppid=%u", HX_basename(*argv),
+	         static_cast(unsigned int, getppid()));
+	ehd_trace_begin(tag);
 	ret = main2(argc, argv);
+	ehd_trace_end(ret);
 	cryptmount_exit();
 	HX_exit();
 	return ret;
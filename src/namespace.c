@@ -0,0 +1,233 @@
+/*
+ *	Per-user mount namespaces
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#define _GNU_SOURCE 1
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#	include <sched.h>
+#	include <sys/mount.h>
+#endif
+#include <libHX/defs.h>
+#include <libHX/io.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * A user's namespace is kept alive between sessions by bind-mounting its
+ * nsfs handle onto RUNDIR/pam_mount/ns/<user>, the same way unshare(1)
+ * --mount=<file> and "ip netns" do it. That directory has to be a private
+ * mount, or the bind would propagate into the very namespace it pins.
+ *
+ * The namespace the process was in before it first entered a user's one is
+ * kept open in @pmt_ns_home. That is where the pins are, and where
+ * pmt_ns_release() returns to; it need not be init's, e.g. when the PAM
+ * application itself runs in a sandbox.
+ */
+#ifdef __linux__
+static const char pmt_ns_dir[] = RUNDIR "/pam_mount/ns";
+static int pmt_ns_home = -1;
+
+static void pmt_ns_path(char *buf, size_t size, const char *user)
+{
+	snprintf(buf, size, "%s/%s", pmt_ns_dir, user);
+}
+
+static bool pmt_ns_prepare_dir(void)
+{
+	if (HX_mkdir(pmt_ns_dir, S_IRWXU) < 0)
+		return false;
+	if (mount(NULL, pmt_ns_dir, NULL, MS_PRIVATE, NULL) == 0)
+		return true;
+	/* EINVAL: not a mountpoint yet */
+	if (errno != EINVAL ||
+	    mount(pmt_ns_dir, pmt_ns_dir, NULL, MS_BIND, NULL) < 0 ||
+	    mount(NULL, pmt_ns_dir, NULL, MS_PRIVATE, NULL) < 0) {
+		l0g("could not make %s a private mount: %s\n",
+		    pmt_ns_dir, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * pmt_ns_join - switch to a pinned namespace
+ * @path:	RUNDIR/pam_mount/ns/<user>
+ *
+ * Returns false if there is no namespace pinned there (the file is missing or
+ * just the placeholder left behind by a failed pmt_ns_create). The pin is
+ * invisible from inside the namespace it pins, so a process that is already
+ * in there (login(1) calling close_session, for example) looks it up from
+ * @pmt_ns_home.
+ */
+static bool pmt_ns_join(const char *path)
+{
+	int fd, ret;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 ||
+	    (ret = setns(fd, CLONE_NEWNS)) < 0) {
+		if (fd >= 0)
+			close(fd);
+		if (setns(pmt_ns_home, CLONE_NEWNS) < 0)
+			return false;
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+			return false;
+		ret = setns(fd, CLONE_NEWNS);
+	}
+	close(fd);
+	if (ret == 0) {
+		w4rn("joined mount namespace %s\n", path);
+		return true;
+	}
+	if (errno != EINVAL)
+		l0g("could not join mount namespace %s: %s\n",
+		    path, strerror(errno));
+	return false;
+}
+
+/**
+ * pmt_ns_create - create and pin a namespace, and switch to it
+ * @path:	RUNDIR/pam_mount/ns/<user>
+ *
+ * The new namespace is a slave of the current one: mounts made in the
+ * parent (e.g. by the administrator) still show up in it, but the user's
+ * volumes stay out of the parent's table.
+ */
+static bool pmt_ns_create(const char *path)
+{
+	int lfd, ofd = pmt_ns_home, nfd = -1;
+	char src[40];
+	bool ret = false;
+
+	if (!pmt_ns_prepare_dir())
+		return false;
+	/* Serialize concurrent first logins of the same user. */
+	lfd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, S_IRUSR);
+	if (lfd < 0 || flock(lfd, LOCK_EX) < 0) {
+		l0g("could not lock %s: %s\n", path, strerror(errno));
+		goto out;
+	}
+	if (pmt_ns_join(path)) {
+		ret = true;
+		goto out;
+	}
+	/* The new namespace is a child of @pmt_ns_home. */
+	if (setns(ofd, CLONE_NEWNS) < 0) {
+		l0g("could not return to parent namespace: %s\n",
+		    strerror(errno));
+		goto out;
+	}
+	if (unshare(CLONE_NEWNS) < 0) {
+		l0g("unshare: %s\n", strerror(errno));
+		goto out;
+	}
+	if (mount(NULL, "/", NULL, MS_REC | MS_SLAVE, NULL) < 0 ||
+	    (nfd = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC)) < 0) {
+		l0g("could not set up mount namespace: %s\n", strerror(errno));
+		setns(ofd, CLONE_NEWNS);
+		goto out;
+	}
+	/* The pin has to live in the parent namespace. */
+	snprintf(src, sizeof(src), "/proc/self/fd/%d", nfd);
+	if (setns(ofd, CLONE_NEWNS) < 0) {
+		l0g("could not return to parent namespace: %s\n",
+		    strerror(errno));
+		goto out;
+	}
+	if (mount(src, path, NULL, MS_BIND, NULL) < 0) {
+		l0g("could not pin mount namespace on %s: %s\n",
+		    path, strerror(errno));
+		goto out;
+	}
+	if (setns(nfd, CLONE_NEWNS) < 0) {
+		l0g("could not enter mount namespace: %s\n", strerror(errno));
+		umount2(path, MNT_DETACH);
+		goto out;
+	}
+	w4rn("created mount namespace %s\n", path);
+	ret = true;
+ out:
+	if (nfd >= 0)
+		close(nfd);
+	if (lfd >= 0)
+		close(lfd);
+	return ret;
+}
+
+/**
+ * pmt_ns_enter - switch to the mount namespace of a user
+ * @user:	user name
+ * @create:	create the namespace if it does not exist yet
+ *
+ * Returns true if the calling process is now in the user's namespace, false
+ * if it stayed where it was (errors are logged).
+ */
+bool pmt_ns_enter(const char *user, bool create)
+{
+	char path[256];
+
+	if (pmt_ns_home < 0) {
+		pmt_ns_home = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+		if (pmt_ns_home < 0) {
+			l0g("could not open /proc/self/ns/mnt: %s\n",
+			    strerror(errno));
+			return false;
+		}
+	}
+	pmt_ns_path(path, sizeof(path), user);
+	if (pmt_ns_join(path))
+		return true;
+	return create && pmt_ns_create(path);
+}
+
+/**
+ * pmt_ns_release - drop the namespace of a user
+ * @user:	user name
+ *
+ * Returns to the namespace that pmt_ns_enter() was called from and unpins
+ * the user's namespace. The kernel tears it down, together with any mounts
+ * left in it, once the last process that still uses it has exited.
+ */
+void pmt_ns_release(const char *user)
+{
+	char path[256];
+
+	if (pmt_ns_home < 0 || setns(pmt_ns_home, CLONE_NEWNS) < 0) {
+		l0g("could not return to the parent mount namespace: %s\n",
+		    strerror(pmt_ns_home < 0 ? EBADF : errno));
+		return;
+	}
+	close(pmt_ns_home);
+	pmt_ns_home = -1;
+	pmt_ns_path(path, sizeof(path), user);
+	if (umount2(path, MNT_DETACH) < 0 && errno != EINVAL)
+		l0g("could not unpin %s: %s\n", path, strerror(errno));
+	if (unlink(path) < 0 && errno != ENOENT)
+		w4rn("could not remove %s: %s\n", path, strerror(errno));
+}
+
+#else /* !__linux__ */
+
+bool pmt_ns_enter(const char *user, bool create)
+{
+	if (create)
+		l0g("mount namespaces are not supported on this platform\n");
+	return false;
+}
+
+void pmt_ns_release(const char *user)
+{
+}
+
+#endif /* __linux__ */
@@ -16,17 +16,20 @@
 
 #include <security/pam_appl.h>
 #include <security/pam_modules.h>
-#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 #include <unistd.h>
 #include <libHX/defs.h>
 #include <libHX/proc.h>
@@ -38,12 +41,6 @@
 #	define PAM_EXTERN
 #endif
 
-#if defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
-#	define CONFIGFILE "/etc/pam_mount.conf.xml"
-#else
-#	define CONFIGFILE "/etc/security/pam_mount.conf.xml"
-#endif
-
 struct pam_args {
 	bool get_pw_from_pam, get_pw_interactive, propagate_pw;
 };
@@ -52,24 +49,23 @@ struct pam_args {
 static void clean_config(pam_handle_t *, void *, int);
 static int converse(pam_handle_t *, int, const struct pam_message **,
 	struct pam_response **);
-static int modify_pm_count(struct config *, char *, char *);
-static void parse_pam_args(int, const char **);
+static void parse_pam_args(struct config *, int, const char **);
 static int read_password(pam_handle_t *, const char *, char **);
 
 /* Variables */
-static const char *envpath_saved;
 struct config Config;
 struct pam_args Args;
 
 //-----------------------------------------------------------------------------
 /**
  * parse_pam_args -
+ * @config:	configuration to set the debug flag in
  * @argv:	NULL-terminated argument vector
  * @argc:	number of elements in @argc
  *
  * Global @Args is initialized, based on @argv.
  */
-static void parse_pam_args(int argc, const char **argv)
+static void parse_pam_args(struct config *config, int argc, const char **argv)
 {
 	int i;
 
@@ -96,7 +92,7 @@ static void parse_pam_args(int argc, const char **argv)
 		else if (strcasecmp("disable_propagate_password", argv[i]) == 0)
 			Args.propagate_pw = false;
 		else if (strcasecmp("debug", argv[i]) == 0)
-			Config.debug = 1;
+			config->debug = 1;
 		else
 			w4rn("unknown pam_mount option \"%s\"\n", argv[i]);
 	}
@@ -118,26 +114,64 @@ static void clean_config(pam_handle_t *pamh, void *data, int err)
 }
 
 /**
- * clean_system_authtok -
+ * clean_secrets -
  * @pamh:	PAM handle
- * @data:	custom data pointer
+ * @data:	secret arena
  * @err:
  *
- * Zero and free @data if it is not %NULL.
+ * Wipe and release the locked arena holding the saved authtoks.
  * Note: This is registered as a PAM callback function and is called directly.
+ */
+static void clean_secrets(pam_handle_t *pamh, void *data, int errcode)
+{
+	w4rn("clean secrets=%p (%d)\n", data, errcode);
+	pmt_arena_delete(data);
+}
+
+/**
+ * authtok_save -
+ * @pamh:	PAM handle
+ * @authtok:	password, as obtained from PAM or the conversation function
+ *
+ * Moves @authtok into the secret arena of @pamh (which is mlocked and wiped
+ * on release) and registers it as "pam_mount_system_authtok". The original
+ * is wiped and freed. Returns the saved copy. If saving fails, @authtok
+ * itself is returned (like before).
  *
  * FIXME: Not binary-password safe.
  */
-static void clean_system_authtok(pam_handle_t *pamh, void *data, int errcode)
+static char *authtok_save(pam_handle_t *pamh, char *authtok)
 {
-	w4rn("clean system authtok=%p (%d)\n", data, errcode);
+	struct pmt_arena *secrets = NULL;
+	char *copy;
+	int ret;
 
-	if (data != NULL) {
-		unsigned int len = strlen(data) + 1;
-		memset(data, 0, len);
-		munlock(data, len);
-		free(data);
+	ret = pam_get_data(pamh, "pam_mount_secrets",
+	      static_cast(const void **, static_cast(void *, &secrets)));
+	if (ret != PAM_SUCCESS || secrets == NULL) {
+		secrets = pmt_arena_new(PMT_ARENA_SECRET);
+		if (secrets == NULL)
+			goto err;
+		ret = pam_set_data(pamh, "pam_mount_secrets", secrets,
+		      clean_secrets);
+		if (ret != PAM_SUCCESS) {
+			pmt_arena_delete(secrets);
+			goto err;
+		}
 	}
+	copy = pmt_arena_strdup(secrets, authtok);
+	if (copy == NULL)
+		goto err;
+	ret = pam_set_data(pamh, "pam_mount_system_authtok", copy, NULL);
+	if (ret != PAM_SUCCESS)
+		goto err;
+	memset(authtok, 0, strlen(authtok));
+	free(authtok);
+	return copy;
+
+ err:
+	l0g("error trying to save authtok for session code\n");
+	return authtok;
 }
 
 /**
@@ -238,10 +272,36 @@ static void pmt_sigpipe_setup(bool block_it)
 	pthread_mutex_unlock(&sp_lock);
 }
 
-static int common_init(pam_handle_t *pamh, int argc, const char **argv)
+/**
+ * common_release - free a configuration that is not saved as PAM data
+ *
+ * freeconfig() drops a libHX reference of its own, being also the destructor
+ * of the configuration that open_session leaves to close_session.
+ */
+static void common_release(struct config *config)
+{
+	HX_init();
+	freeconfig(config);
+}
+
+/**
+ * common_init - set up libraries and configuration for a PAM entry point
+ * @pamh:	PAM handle
+ * @config:	configuration to initialize
+ * @what:	name of the stage, for logging and <trace>
+ * @sections:	%PMT_CONF_* bitmask of what the stage needs
+ *
+ * Returns -1 if the caller is to go ahead (and later call common_exit()),
+ * or else the PAM return code, with everything released again.
+ */
+static int common_init(pam_handle_t *pamh, struct config *config, int argc,
+    const char **argv, const char *what, unsigned int sections)
 {
+	enum pmt_volindex idx;
+	unsigned long long t;
 	const char *pam_user;
-	char buf[8];
+	const void *service;
+	char buf[8], tag[80];
 	int ret;
 
 	ret = HX_init();
@@ -251,8 +311,8 @@ static int common_init(pam_handle_t *pamh, int argc, const char **argv)
 	if (ret <= 0)
 		l0g("libcryptmount init failed: %s\n", strerror(errno));
 
-	initconfig(&Config);
-	parse_pam_args(argc, argv);
+	initconfig(config);
+	parse_pam_args(config, argc, argv);
 	/*
 	 * call pam_get_user again because ssh calls PAM fns from seperate
  	 * processes.
@@ -266,37 +326,77 @@ static int common_init(pam_handle_t *pamh, int argc, const char **argv)
 		 * Also, if we could not get the user's info, an earlier auth
 		 * module (like pam_unix2) likely blocked login already.
 		 */
-		return PAM_SUCCESS;
+		ret = PAM_SUCCESS;
+		goto out;
 	}
 	/*
 	 * FIXME: free me! the dup is requried because result of pam_get_user()
 	 * disappears (valgrind)
 	 */
-	Config.user = relookup_user(pam_user);
-	if (!readconfig(CONFIGFILE, true, &Config))
-		return PAM_SERVICE_ERR;
+	config->user = relookup_user(pam_user);
+	ehd_log_field(EHD_LOGK_USER, "%s", config->user);
+	ehd_log_field(EHD_LOGK_STAGE, "%s", what);
+	if (pam_get_item(pamh, PAM_SERVICE, &service) == PAM_SUCCESS &&
+	    service != NULL)
+		config->service = xstrdup(service);
 
-	/* reinitialize after @Debug may have changed */
-	if (ehd_logctl(EHD_LOGFT_DEBUG, EHD_LOG_GET))
-		ehd_logctl(EHD_LOGFT_DEBUG, EHD_LOG_UNSET);
-	if (Config.debug)
-		ehd_logctl(EHD_LOGFT_DEBUG, EHD_LOG_SET);
+	/*
+	 * Fast path for the bulk of PAM traffic (cron, sudo, su, ...): if no
+	 * volume can apply to the user, do not even parse the configuration.
+	 * No pmvarrun reference is taken then; close_session finds no saved
+	 * configuration and does not drop one either.
+	 *
+	 * Not so in the auth stage if it is to prompt for the password: the
+	 * modules after us (use_first_pass) rely on getting it from us.
+	 */
+	if (sections == PMT_CONF_AUTH &&
+	    (Args.get_pw_interactive || Args.propagate_pw))
+		idx = PMT_VOLINDEX_MATCH;
+	else
+		idx = pmt_volindex_lookup(CONFIGFILE, config->user,
+		      config->service, &config->debug);
+	if (idx == PMT_VOLINDEX_NONE) {
+		debug_setup(config);
+		w4rn("no volumes for %s, skipping %s\n", config->user, what);
+		ret = PAM_SUCCESS;
+		goto out;
+	}
+	config->volindex_update = idx == PMT_VOLINDEX_STALE;
+	snprintf(tag, sizeof(tag), "%s user=%s", what, config->user);
+	ehd_trace_begin(tag);
+	t = ehd_trace_clock();
+	if (!readconfig(CONFIGFILE, true, config, sections)) {
+		ehd_trace_end(PAM_SERVICE_ERR);
+		ret = PAM_SERVICE_ERR;
+		goto out;
+	}
+	trace_setup(config);
+	ehd_trace_add(EHD_TRACE_CONFIG, NULL, t);
 
-	snprintf(buf, sizeof(buf), "%u", Config.debug);
+	debug_setup(config);
+	snprintf(buf, sizeof(buf), "%u", config->debug);
 	setenv("_PMT_DEBUG_LEVEL", buf, true);
 
 	pmt_sigpipe_setup(true);
 	return -1;
+
+ out:
+	common_release(config);
+	cryptmount_exit();
+	HX_exit();
+	return ret;
 }
 
 static void common_exit(void)
 {
+	/* The session config outlives the call; its helpers do not. */
+	pmt_exec_release();
 	pmt_sigpipe_setup(false);
 	cryptmount_exit();
 	HX_exit();
 }
 
-static void auth_grab_authtok(pam_handle_t *pamh, struct config *config)
+static char *auth_grab_authtok(pam_handle_t *pamh, struct config *config)
 {
 	char *authtok = NULL;
 	int ret;
@@ -330,16 +430,49 @@ static void auth_grab_authtok(pam_handle_t *pamh, struct config *config)
 	 * Save auth token for pam_mount itself, since PAM_AUTHTOK
 	 * will be gone when the auth stage exits.
 	 */
-	if (authtok != NULL) {
-		ret = pam_set_data(pamh, "pam_mount_system_authtok", authtok,
-		                   clean_system_authtok);
-		if (ret == PAM_SUCCESS) {
-			if (mlock(authtok, strlen(authtok) + 1) < 0)
-				w4rn("mlock authtok: %s\n", strerror(errno));
-		} else {
-			l0g("error trying to save authtok for session code\n");
-		}
+	if (authtok != NULL)
+		authtok = authtok_save(pamh, authtok);
+	return authtok;
+}
+
+/**
+ * auth_prepare_volumes - unlock crypt volumes ahead of the session stage
+ * @config:	configuration
+ * @authtok:	password just obtained
+ *
+ * With <speculative-unlock>, the KDF and dm-crypt setup of the global crypt
+ * volumes is started in the background, while the rest of the PAM stack
+ * (account, pam_systemd, ...) runs. mount.crypt keeps the mapping for
+ * do_mount() in the session stage to pick up, or drops it again after the
+ * configured timeout if no session follows.
+ */
+static void auth_prepare_volumes(struct config *config, const char *authtok)
+{
+	struct vol *vol;
+	bool metrics;
+
+	if (authtok == NULL || geteuid() != 0)
+		/* e.g. a screen locker authenticating as the user */
+		return;
+	if (!expandconfig(config)) {
+		l0g("error expanding configuration\n");
+		return;
 	}
+
+	/* Not real mounts; keep them out of the statistics. */
+	metrics = config->metrics;
+	config->metrics = false;
+	pmt_spawn_setpath(config->path);
+	HXlist_for_each_entry(vol, &config->volume_list, list) {
+		if (vol->type != CMD_CRYPTMOUNT || vol->other_service ||
+		    !volume_record_sane(config, vol))
+			continue;
+		if (!mount_op(do_prepare, config, vol, authtok))
+			w4rn("could not unlock %s ahead of time\n",
+			     znul(vol->volume));
+	}
+	pmt_spawn_setpath(NULL);
+	config->metrics = metrics;
 }
 
 /**
@@ -356,14 +489,28 @@ static void auth_grab_authtok(pam_handle_t *pamh, struct config *config)
 PAM_EXTERN EXPORT_SYMBOL int pam_sm_authenticate(pam_handle_t *pamh, int flags,
     int argc, const char **argv)
 {
+	struct config config;
+	const char *authtok;
 	int ret = PAM_SUCCESS;
 
 	assert(pamh != NULL);
 
-	if ((ret = common_init(pamh, argc, argv)) != -1)
+	/*
+	 * Not the global @Config: that one belongs to a session that may be
+	 * open in this process, and nothing of this stage is needed later.
+	 * The volume list is only needed for speculative unlocking.
+	 */
+	ret = common_init(pamh, &config, argc, argv, "authenticate",
+	      PMT_CONF_AUTH);
+	if (ret != -1)
 		return ret;
 	w4rn(PACKAGE_STRING ": entering auth stage\n");
-	auth_grab_authtok(pamh, &Config);
+	authtok = auth_grab_authtok(pamh, &config);
+	if (config.spec_unlock != 0 && readconfig(CONFIGFILE, true, &config,
+	    PMT_CONF_ALL & ~PMT_CONF_AUTH))
+		auth_prepare_volumes(&config, authtok);
+	ehd_trace_end(PAM_SUCCESS);
+	common_release(&config);
 	common_exit();
 	/*
 	 * pam_mount is not really meant to be an auth module. So we should not
@@ -373,83 +520,62 @@ PAM_EXTERN EXPORT_SYMBOL int pam_sm_authenticate(pam_handle_t *pamh, int flags,
 }
 
 /**
- * On login, $PATH is correctly set to ENV_ROOTPATH (from /etc/login.defs),
- * while on logout, it happens to be ENV_PATH only. This is problematic,
- * since some programs are in /sbin and /usr/sbin which is
- * often not contained in ENV_PATH.
+ * linger_start - defer umount_session()
+ * @config:	configuration
  *
- * In short: Another workaround for coreutils.
+ * Starts pmt-linger(8), which puts itself into the background to wait out
+ * the linger time; nothing but exec runs in the PAM process's child.
+ * Returns false if that could not be done, in which case the caller should
+ * unmount right away.
  */
-static void envpath_init(const char *new_path)
+static bool linger_start(struct config *config)
 {
-	envpath_saved = getenv("PATH");
-	setenv("PATH", new_path, true);
-}
-
-static void envpath_restore(void)
-{
-	if (envpath_saved == NULL)
-		unsetenv("PATH");
-	else
-		setenv("PATH", envpath_saved, true);
-}
-
-/**
- * modify_pm_count -
- * @config:
- * @user:
- * @operation:	string specifying numerical increment
- *
- * Calls out to the `pmvarrun` helper utility to adjust the mount reference
- * count in /var/run/pam_mount/@user for the specified user.
- * Returns the new reference count value on success, or -1 on error.
- *
- * Note: Modified version of pam_console.c:use_count()
- */
-static int modify_pm_count(struct config *config, char *user,
-    char *operation)
-{
-	FILE *fp = NULL;
-	struct HXformat_map *vinfo;
-	struct HXdeque *argv;
+	char token[64], secs[16];
+	const char *argv[9];
 	struct HXproc proc;
-	int ret = -1, use_count;
-
-	assert(user != NULL);
-	assert(operation != NULL);
-
-	if ((vinfo = HXformat_init()) == NULL)
-		goto out;
-	format_add(vinfo, "USER", user);
-	format_add(vinfo, "OPERATION", operation);
-	misc_add_ntdom(vinfo, user);
+	int argk = 0, fd, ret;
+
+	snprintf(token, sizeof(token), "%u.%llu",
+	         static_cast(unsigned int, getpid()), ehd_trace_clock());
+	if ((fd = linger_lock(config->user, O_CREAT)) < 0)
+		return false;
+	if (ftruncate(fd, 0) < 0 || write(fd, token, strlen(token)) < 0) {
+		l0g("could not arm linger timer: %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	snprintf(secs, sizeof(secs), "%u", config->linger);
+	argv[argk++] = "pmt-linger";
+	argv[argk++] = "-t";
+	argv[argk++] = secs;
+	argv[argk++] = "-k";
+	argv[argk++] = token;
+	if (config->service != NULL) {
+		argv[argk++] = "-s";
+		argv[argk++] = config->service;
+	}
+	argv[argk++] = config->user;
+	argv[argk]   = NULL;
+	assert(argk < ARRAY_SIZE(argv));
 
-	argv = arglist_build(config->command[CMD_PMVARRUN], vinfo);
 	memset(&proc, 0, sizeof(proc));
-	proc.p_flags = HXPROC_VERBOSE | HXPROC_STDOUT;
-	proc.p_ops   = &pmt_dropprivs_ops;
-	if ((ret = pmt_spawn_dq(argv, &proc)) <= 0) {
-		l0g("error executing pmvarrun: %s\n", strerror(-ret));
-		goto out;
+	proc.p_flags = HXPROC_VERBOSE | HXPROC_NULL_STDIN;
+	proc.p_ops   = &pmt_spawn_ops;
+	if ((ret = pmt_spawn_vec(argv, &proc)) <= 0) {
+		l0g("could not start pmt-linger: %s\n", strerror(-ret));
+		linger_cancel(config->user);
+		return false;
 	}
-	ret = -1;
-	if ((fp = fdopen(proc.p_stdout, "r")) == NULL)
-		goto out2;
-	if (fscanf(fp, "%d", &use_count) != 1)
-		w4rn("error reading login count from pmvarrun\n");
-	else
-		w4rn("pmvarrun says login count is %d\n", use_count);
- out2:
-	if (fp != NULL)
-		fclose(fp);
-	else
-		close(proc.p_stdout);
-	if (HXproc_wait(&proc) >= 0 && proc.p_exited && proc.p_status == 0)
-		ret = use_count;
- out:
-	if (vinfo != NULL)
-		HXformat_free(vinfo);
-	return ret;
+	/* pmt-linger returns as soon as its timer is in the background */
+	if (HXproc_wait(&proc) < 0 || !proc.p_exited || proc.p_status != 0) {
+		l0g("pmt-linger failed\n");
+		linger_cancel(config->user);
+		return false;
+	}
+	w4rn("volumes of %s linger for %us\n", config->user, config->linger);
+	return true;
 }
 
 /**
@@ -476,16 +602,8 @@ static char *ses_grab_authtok(pam_handle_t *pamh)
 			l0g("warning: could not obtain password "
 			    "interactively either\n");
 	}
-	if (authtok != NULL) {
-		ret = pam_set_data(pamh, "pam_mount_system_authtok",
-		      authtok, clean_system_authtok);
-		if (ret == PAM_SUCCESS) {
-			if (mlock(authtok, strlen(authtok) + 1) < 0)
-				w4rn("mlock authtok: %s\n", strerror(errno));
-		} else {
-			l0g("error trying to save authtok for session code\n");
-		}
-	}
+	if (authtok != NULL)
+		authtok = authtok_save(pamh, authtok);
 	/*
 	 * Always proceed, even if there is no password. Some volumes may not
 	 * need one, e.g. bind mounts and networked/unencrypted volumes.
@@ -496,7 +614,9 @@ static char *ses_grab_authtok(pam_handle_t *pamh)
 static int process_volumes(struct config *config, const char *authtok)
 {
 	int ret = PAM_SUCCESS;
+	unsigned long long t;
 	struct vol *vol;
+	bool sane;
 
 	HXlist_for_each_entry(vol, &config->volume_list, list) {
 		/*
@@ -506,19 +626,28 @@ static int process_volumes(struct config *config, const char *authtok)
 		if (vol->mnt_processed)
 			continue;
 		vol->mnt_processed = true;
+		if (vol->other_service) {
+			w4rn("%s is not for service %s, skipping\n",
+			     znul(vol->volume), config->service);
+			continue;
+		}
 		/*
 		 * luserconf_volume_record_sane() is called here so that a user
 		 * can nest loopback images. otherwise ownership tests will
 		 * fail if parent loopback image not yet mounted.
 		 * volume_record_sane() is here to be consistent.
 		 */
-		if (!volume_record_sane(config, vol))
-			continue;
-		if (!vol->globalconf &&
-		    !luserconf_volume_record_sane(config, vol))
+		t = ehd_trace_clock();
+		sane = volume_record_sane(config, vol) && (vol->globalconf ||
+		       luserconf_volume_record_sane(config, vol));
+		ehd_trace_add(EHD_TRACE_SANITY, vol->mountpoint, t);
+		if (!sane)
 			continue;
 
+		t = ehd_trace_clock();
 		if (!mount_op(do_mount, config, vol, authtok)) {
+			ehd_log_field(EHD_LOGK_DURATION, "%llu",
+				(ehd_trace_clock() - t) / 1000);
 			l0g("mount of %s failed\n", znul(vol->volume));
 			ret = PAM_SERVICE_ERR;
 		}
@@ -558,11 +687,13 @@ PAM_EXTERN EXPORT_SYMBOL int pam_sm_open_session(pam_handle_t *pamh, int flags,
 	const char *krb5;
 	char *system_authtok = NULL;
 	const void *tmp;
+	unsigned long long t;
 	int getval;
 
 	assert(pamh != NULL);
 
-	if ((ret = common_init(pamh, argc, argv)) != -1)
+	if ((ret = common_init(pamh, &Config, argc, argv, "open_session",
+	    PMT_CONF_ALL)) != -1)
 		return ret;
 
 	w4rn(PACKAGE_STRING ": entering session stage\n");
@@ -594,36 +725,30 @@ PAM_EXTERN EXPORT_SYMBOL int pam_sm_open_session(pam_handle_t *pamh, int flags,
 		HX_init();
 	}
 
+	t = ehd_trace_clock();
 	if (!expandconfig(&Config)) {
 		l0g("error expanding configuration\n");
 		ret = PAM_SERVICE_ERR;
 		goto out;
 	}
+	ehd_trace_add(EHD_TRACE_EXPAND, NULL, t);
 	if (Config.volume_list.items > 0)
 		/* There are some volumes, so grab a password. */
 		system_authtok = ses_grab_authtok(pamh);
 
 	assert_root();
-	envpath_init(Config.path);
+	linger_cancel(Config.user);
+	if (Config.namespace && !pmt_ns_enter(Config.user, true))
+		l0g("mounting into the initial namespace instead\n");
+	pmt_spawn_setpath(Config.path);
 	ret = process_volumes(&Config, system_authtok);
 
 	/*
 	 * Read luserconf after mounting of initial volumes. This makes it
 	 * possible to store luserconfs on net volumes themselves.
 	 */
-	if (Config.luserconf != NULL && *Config.luserconf != '\0' &&
-	    pmt_fileop_exists(Config.luserconf)) {
-		w4rn("going to readconfig %s\n", Config.luserconf);
-		if (!pmt_fileop_owns(Config.user, Config.luserconf)) {
-			w4rn("%s does not exist or is not owned by user\n",
-			     Config.luserconf);
-		} else if (!readconfig(Config.luserconf, false, &Config)) {
-			ret = PAM_SERVICE_ERR;
-		} else if (!expandconfig(&Config)) {
-			ret = PAM_SERVICE_ERR;
-			l0g("error expanding configuration\n");
-		}
-	}
+	if (!read_luserconf(&Config))
+		ret = PAM_SERVICE_ERR;
 
 	if (Config.volume_list.items == 0) {
 		w4rn("no volumes to mount\n");
@@ -639,7 +764,7 @@ PAM_EXTERN EXPORT_SYMBOL int pam_sm_open_session(pam_handle_t *pamh, int flags,
 	}
 
 	modify_pm_count(&Config, Config.user, "1");
-	envpath_restore();
+	pmt_spawn_setpath(NULL);
 	if (getuid() == 0)
 		/* Make sure root can always log in. */
 		/* NB: I don't even wanna think of SELINUX's ambiguous UIDs... */
@@ -657,6 +782,7 @@ PAM_EXTERN EXPORT_SYMBOL int pam_sm_open_session(pam_handle_t *pamh, int flags,
  out:
 	if (krb5 != NULL)
 		unsetenv("KRB5CCNAME");
+	ehd_trace_end(ret);
 	w4rn("done opening session (ret=%d)\n", ret);
 	common_exit();
 	return ret;
@@ -695,15 +821,33 @@ PAM_EXTERN EXPORT_SYMBOL int pam_sm_close_session(pam_handle_t *pamh,
     int flags, int argc, const char **argv)
 {
 	const char *pam_user = NULL;
+	const void *tmp;
+	char tag[80];
 	int ret;
 
 	assert(pamh != NULL);
 
+	/*
+	 * Only the process that took a pmvarrun reference in open_session
+	 * drops one. Not so if open_session found no volumes for the user or
+	 * failed early, or ran in another process (sshd): there is no saved
+	 * configuration then.
+	 */
+	if (pam_get_data(pamh, "pam_mount_config", &tmp) != PAM_SUCCESS) {
+		w4rn("no session opened by pam_mount, nothing to close\n");
+		return PAM_SUCCESS;
+	}
 	ret = HX_init();
 	if (ret <= 0)
 		l0g("libHX init failed: %s\n", strerror(errno));
 	ret = PAM_SUCCESS;
+	ehd_log_field(EHD_LOGK_STAGE, "close_session");
+	ehd_log_field(EHD_LOGK_USER, "%s", znul(Config.user));
 	w4rn("received order to close things\n");
+	/* <trace> as read by open_session in this process, if it got there */
+	trace_setup(&Config);
+	snprintf(tag, sizeof(tag), "close_session user=%s", znul(Config.user));
+	ehd_trace_begin(tag);
 	assert_root();
 	if (Config.volume_list.items == 0) {
 		w4rn("No volumes to umount\n");
@@ -729,14 +873,16 @@ PAM_EXTERN EXPORT_SYMBOL int pam_sm_close_session(pam_handle_t *pamh,
 		l0g("could not chdir\n");
 
  out:
-	envpath_init(Config.path);
+	pmt_spawn_setpath(Config.path);
 	if (modify_pm_count(&Config, Config.user, "-1") > 0)
 		w4rn("%s seems to have other remaining open sessions\n",
 		     Config.user);
-	else
-		umount_final(&Config);
+	else if (Config.linger == 0 || Config.volume_list.items == 0 ||
+	    !linger_start(&Config))
+		umount_session(&Config);
 
-	envpath_restore();
+	pmt_spawn_setpath(NULL);
+	ehd_trace_end(ret);
 	/*
 	 * Note that PMConfig is automatically freed later in clean_config()
 	 */
@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <libHX/list.h>
 #include <libHX/option.h>
 #include <libHX/string.h>
@@ -27,18 +28,36 @@
 	"/usr/libexec/hxtools:/usr/lib/hxtools:" \
 	"/usr/sbin:/usr/bin:/sbin:/bin"
 
+/* bench-session builds pam_mount.c with its own CONFIGFILE */
+#ifndef CONFIGFILE
+#if defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
+#	define CONFIGFILE "/etc/pam_mount.conf.xml"
+#else
+#	define CONFIGFILE "/etc/security/pam_mount.conf.xml"
+#endif
+#endif
+
 /* Note that you will also need to change PMPREFIX in pmvarrun.c then! */
 #define l0g(fmt, ...) \
 	ehd_err(("(%s:%u): " fmt), HX_basename(__FILE__), \
 	__LINE__, ## __VA_ARGS__)
-#define w4rn(fmt, ...) \
-	ehd_dbg(("(%s:%u): " fmt), HX_basename(__FILE__), \
-	__LINE__, ## __VA_ARGS__)
+#define w4rn(fmt, ...) do { \
+	if (ehd_logctl(EHD_LOGFT_DEBUG, EHD_LOG_GET)) \
+		ehd_dbg(("(%s:%u): " fmt), HX_basename(__FILE__), \
+		__LINE__, ## __VA_ARGS__); \
+	} while (false)
 
 struct HXdeque;
 struct HXformatmap;
 struct HXproc;
+struct pmt_arena_chunk;
+struct pmt_cond;
+struct pmt_fstab;
+struct pmt_luserconf_writer;
+struct pmt_volindex_writer;
 struct loop_info64;
+struct stat;
+struct _xmlNode;
 
 enum command_type {
 	CMD_SMBMOUNT,
@@ -62,6 +81,61 @@ enum command_type {
 	CMD_NONE,
 };
 
+enum {
+	PMT_ARENA_SECRET = 1 << 0,
+};
+
+/**
+ * struct pmt_arena - bump allocator
+ * @head:	most recent chunk
+ * @flags:	%PMT_ARENA_SECRET for locked memory that is wiped on release
+ */
+struct pmt_arena {
+	struct pmt_arena_chunk *head;
+	unsigned int flags;
+};
+
+struct kvp {
+	char *key, *value;
+	struct HXlist_head list;
+};
+
+/**
+ * struct kvplist - mount option list
+ * @list:	options in the order given (struct kvp)
+ * @index:	key -> struct kvp map, built by kvplist_reindex() for lists
+ * 		long enough that a linear scan would be slower
+ */
+struct kvplist {
+	struct HXclist_head list;
+	struct HXmap *index;
+};
+
+/**
+ * struct pmt_userinfo - per-user substitution values
+ * @name:	login name, %(USER)
+ * @home:	home directory, for "~" expansion
+ * @group:	name of the primary group, %(GROUP)
+ * @domain_name: NT domain part of @name, %(DOMAIN_NAME)
+ * @domain_user: user part of @name, %(DOMAIN_USER)
+ * @sgroups:	names of the secondary groups, @nsgroups entries; only
+ * 		resolved (@have_sgroups) once a condition needs them
+ * @have_pw:	passwd lookup succeeded; @uid, @gid, @home are valid
+ * @valid:	structure has been filled for this PAM call
+ *
+ * Resolved once by config_userinfo() and then only read, so that volumes
+ * do not repeat the NSS lookups and string splitting.
+ */
+struct pmt_userinfo {
+	const char *name;
+	char *home, *group, *domain_name, *domain_user;
+	char **sgroups;
+	unsigned int nsgroups;
+	uid_t uid;
+	gid_t gid;
+	bool have_pw, have_sgroups, valid;
+};
+
 /**
  * @server:	server name, if any
  * @volume:	path relative to server, or full path in case @server is empty
@@ -78,11 +152,12 @@ struct vol {
 	bool is_expanded;
 	/* was handed off to mount_op() */
 	bool mnt_processed;
+	/* only selected for other PAM services; unmounted, never mounted */
+	bool other_service;
 	const char *user;
 	char *fstype, *server, *volume, *combopath, *mountpoint, *cipher;
 	char *fs_key_cipher, *fs_key_hash, *fs_key_path;
-	/* May be NULL if no options */
-	struct HXclist_head options;
+	struct kvplist options;
 	bool use_fstab;
 	bool uses_ssh;
 	bool noroot;
@@ -98,6 +173,8 @@ struct vol {
 struct config {
 	/* user logging in */
 	char *user;
+	/* PAM service, for <service> and service="" */
+	char *service;
 	unsigned int debug;
 	bool mkmntpoint, rmdir_mntpt;
 	bool seen_mntoptions_require, seen_mntoptions_allow;
@@ -107,14 +184,44 @@ struct config {
 	struct HXclist_head volume_list;
 	int level;
 	char *msg_authpw, *msg_sessionpw, *path;
+	/* latency trace sink ("syslog" or file), %NULL if disabled */
+	char *trace;
+	/* record mount/unmount statistics, see metrics.c */
+	bool metrics;
+	/* seconds to keep volumes mounted after the last session ended */
+	unsigned int linger;
+	/* mount into a per-user namespace, see namespace.c */
+	bool namespace;
+	/*
+	 * unlock crypt volumes during auth; seconds until an unused
+	 * mapping is dropped (0: off)
+	 */
+	unsigned int spec_unlock;
+	/* refresh the volume index while reading the global config */
+	bool volindex_update;
+	/* cache the luserconf while reading it, see luserconf.c */
+	bool luserconf_update;
 
 	bool sig_hup, sig_term, sig_kill;
 	unsigned int sig_wait;
+	struct pmt_arena arena;
+	struct pmt_userinfo uinfo;
+	/* /etc/fstab, loaded on first use, see fstab_lookup() */
+	struct pmt_fstab *fstab;
 };
 
-struct kvp {
-	char *key, *value;
-	struct HXlist_head list;
+/**
+ * struct pmt_cred - credentials resolved ahead of spawning a helper
+ * @groups:	supplementary groups, @ngroups entries (-1: leave untouched)
+ * @home:	home directory, exported as $HOME to the helper
+ * @name:	canonical user name, exported as $USER
+ */
+struct pmt_cred {
+	uid_t uid;
+	gid_t gid;
+	gid_t *groups;
+	int ngroups;
+	char *home, *name;
 };
 
 typedef int (mount_op_fn_t)(const struct config *, struct vol *,
@@ -137,11 +244,56 @@ static inline const char *znul(const char *s)
 	return (s == NULL) ? "(null)" : s;
 }
 
+/*
+ *	ARENA.C
+ */
+extern void pmt_arena_init(struct pmt_arena *, unsigned int);
+extern struct pmt_arena *pmt_arena_new(unsigned int);
+extern void *pmt_arena_alloc(struct pmt_arena *, size_t);
+extern void *pmt_arena_zalloc(struct pmt_arena *, size_t);
+extern char *pmt_arena_strdup(struct pmt_arena *, const char *);
+extern void pmt_arena_release(struct pmt_arena *);
+extern void pmt_arena_delete(struct pmt_arena *);
+
+/*
+ *	BACKENDS, loaded with ehd_backend_load()
+ */
+struct pmt_libmount_ops {
+	int (*mounted)(const char *, const char *, bool);
+};
+
+struct pmt_regex_ops {
+	int (*match)(const char *, const char *, bool);
+};
+
+struct pmt_blkid_ops {
+	bool (*fstype)(const char *, char *, size_t);
+};
+
 /*
  *	BDEV.C
  */
 extern size_t pmt_block_getsize64(const char *);
 
+/*
+ *	LUSERCONF.C
+ */
+extern bool pmt_luserconf_lookup(struct config *, char *, size_t);
+extern struct pmt_luserconf_writer *pmt_luserconf_new(void);
+extern void pmt_luserconf_add(struct pmt_luserconf_writer *,
+	struct _xmlNode *);
+extern void pmt_luserconf_write(struct pmt_luserconf_writer *,
+	const char *, const struct stat *);
+extern void pmt_luserconf_free(struct pmt_luserconf_writer *);
+
+/*
+ *	METRICS.C
+ */
+extern void pmt_metrics_record(enum command_type, const char *, bool, bool,
+	unsigned long long);
+extern int pmt_metrics_dump(FILE *);
+extern const char *pmt_metrics_path(void);
+
 /*
  *	MISC.C
  */
@@ -151,10 +303,12 @@ extern struct HXdeque *arglist_build(const struct HXdeque *,
 	const struct HXformat_map *);
 extern void arglist_log(const struct HXdeque *);
 extern void arglist_llog(const char *const *);
-extern bool kvplist_contains(const struct HXclist_head *, const char *);
-extern char *kvplist_get(const struct HXclist_head *, const char *);
-extern void kvplist_genocide(struct HXclist_head *);
-extern hxmc_t *kvplist_to_str(const struct HXclist_head *);
+extern void kvplist_init(struct kvplist *);
+extern bool kvplist_reindex(struct kvplist *);
+extern void kvplist_free_index(struct kvplist *);
+extern bool kvplist_contains(const struct kvplist *, const char *);
+extern char *kvplist_get(const struct kvplist *, const char *);
+extern hxmc_t *kvplist_to_str(hxmc_t **, const struct kvplist *);
 extern void misc_add_ntdom(struct HXformat_map *, const char *);
 extern bool pmt_fileop_exists(const char *);
 extern bool pmt_fileop_isreg(const char *);
@@ -194,6 +348,8 @@ extern int pmt_smtab_remove(const char *, enum smtab_field);
 extern int pmt_smtab_mounted(const char *, const char *,
 	int (*)(const char *, const char *));
 extern int pmt_cmtab_add(struct ehd_mount_info *);
+extern int pmt_cmtab_get1(const char *, enum cmtab_field, char **,
+	char **, char **, char **);
 extern int pmt_cmtab_get(const char *, enum cmtab_field,
 	char **, char **, char **, char **);
 extern int pmt_cmtab_remove(const char *);
@@ -205,17 +361,23 @@ extern const char *pmt_kmtab_path(void);
 /*
  *	MOUNT.C
  */
-extern mount_op_fn_t do_mount, do_unmount;
+extern mount_op_fn_t do_mount, do_prepare, do_unmount;
 extern int fstype_nodev(const char *);
-extern int mount_op(mount_op_fn_t *, const struct config *, struct vol *,
+extern int mount_op(mount_op_fn_t *, struct config *, struct vol *,
 	const char *);
-extern void umount_final(struct config *);
+extern void umount_final(struct config *, bool);
 extern int pmt_already_mounted(const struct config *,
 	const struct vol *, struct HXformat_map *);
 extern hxmc_t *pmt_vol_to_dev(const struct vol *);
 extern bool fstype_icase(const char *);
 extern bool fstype2_icase(enum command_type);
 
+/*
+ *	NAMESPACE.C
+ */
+extern bool pmt_ns_enter(const char *, bool);
+extern void pmt_ns_release(const char *);
+
 /*
  *	OFL-LIB.C
  */
@@ -230,9 +392,25 @@ extern struct config Config;
 /*
  *	RDCONF1.C
  */
+/* parts of the configuration, for readconfig() */
+enum {
+	/* <debug>, <msg-authpw>, <speculative-unlock>, <trace> */
+	PMT_CONF_AUTH     = 1 << 0,
+	/* all other settings, except for: */
+	PMT_CONF_SESSION  = 1 << 1,
+	/* helper command lines (<cifsmount>, <ofl>, ...) */
+	PMT_CONF_COMMANDS = 1 << 2,
+	PMT_CONF_VOLUMES  = 1 << 3,
+	PMT_CONF_ALL      = PMT_CONF_AUTH | PMT_CONF_SESSION |
+	                    PMT_CONF_COMMANDS | PMT_CONF_VOLUMES,
+};
+
 extern bool expandconfig(struct config *);
+extern const struct pmt_userinfo *config_userinfo(struct config *);
+extern void userinfo_add(struct HXformat_map *,
+	const struct pmt_userinfo *);
 extern void initconfig(struct config *);
-extern bool readconfig(const char *, bool, struct config *);
+extern bool readconfig(const char *, bool, struct config *, unsigned int);
 extern void freeconfig(struct config *);
 
 /*
@@ -241,11 +419,58 @@ extern void freeconfig(struct config *);
 extern bool luserconf_volume_record_sane(const struct config *, const struct vol *);
 extern bool volume_record_sane(const struct config *, const struct vol *);
 
+/*
+ *	SESSION.C
+ */
+extern void trace_setup(const struct config *);
+extern void debug_setup(const struct config *);
+extern bool read_luserconf(struct config *);
+extern int modify_pm_count(struct config *, char *, char *);
+extern void umount_session(struct config *);
+extern int linger_lock(const char *, int);
+extern void linger_cancel(const char *);
+
 /*
  *	SPAWN.C
  */
 extern const struct HXproc_ops pmt_spawn_ops, pmt_dropprivs_ops;
 
+extern bool pmt_cred_resolve(struct pmt_cred *, const char *);
+extern void pmt_cred_free(struct pmt_cred *);
 extern int pmt_spawn_dq(struct HXdeque *, struct HXproc *);
+extern int pmt_spawn_vec(const char *const *, struct HXproc *);
+extern void pmt_spawn_setpath(const char *);
+extern bool pmt_exec_register(const char *, const char *);
+extern void pmt_exec_release(void);
+
+/*
+ *	VOLCOND.C
+ */
+extern struct pmt_cond *pmt_cond_compile(struct pmt_arena *,
+	struct _xmlNode *);
+extern bool pmt_cond_has_service(const struct pmt_cond *);
+extern int pmt_cond_eval(const struct pmt_cond *, struct config *,
+	const char *);
+
+/*
+ *	VOLINDEX.C
+ */
+enum pmt_volindex {
+	/* the user may have volumes (or there is no usable index) */
+	PMT_VOLINDEX_MATCH,
+	/* no volume applies to the user */
+	PMT_VOLINDEX_NONE,
+	/* index missing or out of date */
+	PMT_VOLINDEX_STALE,
+};
+
+extern enum pmt_volindex pmt_volindex_lookup(const char *, const char *,
+	const char *, unsigned int *);
+extern struct pmt_volindex_writer *pmt_volindex_new(void);
+extern void pmt_volindex_add(struct pmt_volindex_writer *,
+	struct _xmlNode *);
+extern void pmt_volindex_write(struct pmt_volindex_writer *, const char *,
+	const struct stat *);
+extern void pmt_volindex_free(struct pmt_volindex_writer *);
 
 #endif /* PMT_PAM_MOUNT_H */
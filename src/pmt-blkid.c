@@ -0,0 +1,187 @@
+/*
+ *	Filesystem type detection with libblkid
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <blkid.h>
+#include <libHX/defs.h>
+#include <libHX/io.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * Built as the "pmt-blkid" module (see backend.c). Mounting with "-t auto"
+ * makes mount(8) try one filesystem after the other, reading a number of
+ * superblock locations each time; over dm-crypt and loop devices that is
+ * noticeable at every login. The type found by a full probe is therefore
+ * remembered in RUNDIR/pam_mount/fstype/<key>, together with the
+ * filesystem UUID. The next time, only that one type is probed for, and
+ * the result is believed if the UUID is still the same.
+ *
+ * The key is the device-mapper UUID where there is one, since dm minor
+ * numbers are handed out anew on every unlock; for other block devices it
+ * is the device number. The cache does not outlive a reboot (RUNDIR is a
+ * tmpfs), nor is it trusted without the UUID check, so either is fine.
+ */
+static const char pmt_fstype_dir[] = RUNDIR "/pam_mount/fstype";
+
+static bool bp_key(const char *device, char *key, size_t size)
+{
+	unsigned int maj, min;
+	char path[64], buf[160], *p;
+	struct stat sb;
+	FILE *fp;
+
+	if (stat(device, &sb) < 0 || !S_ISBLK(sb.st_mode))
+		return false;
+	maj = major(sb.st_rdev);
+	min = minor(sb.st_rdev);
+	snprintf(key, size, "b%u:%u", maj, min);
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/dm/uuid", maj, min);
+	if ((fp = fopen(path, "re")) == NULL)
+		return true;
+	if (fgets(buf, sizeof(buf), fp) != NULL && *HX_chomp(buf) != '\0') {
+		for (p = buf; *p != '\0'; ++p)
+			if (*p == '/')
+				*p = '_';
+		HX_strlcpy(key, buf, size);
+	}
+	fclose(fp);
+	return true;
+}
+
+/**
+ * bp_probe - run libblkid on a device
+ * @device:	block device
+ * @only:	filesystem type to restrict the probe to, or %NULL
+ * @type:	receives the filesystem type
+ * @tsize:	size of @type
+ * @uuid:	receives the filesystem UUID ("-" if it has none)
+ * @usize:	size of @uuid
+ */
+static bool bp_probe(const char *device, const char *only, char *type,
+    size_t tsize, char *uuid, size_t usize)
+{
+	char *names[] = {const_cast1(char *, only), NULL};
+	const char *value;
+	blkid_probe pr;
+	bool ret = false;
+
+	if ((pr = blkid_new_probe_from_filename(device)) == NULL) {
+		w4rn("blkid: could not open %s: %s\n", device, strerror(errno));
+		return false;
+	}
+	blkid_probe_enable_superblocks(pr, true);
+	blkid_probe_set_superblocks_flags(pr,
+		BLKID_SUBLKS_TYPE | BLKID_SUBLKS_UUID);
+	if (only != NULL)
+		blkid_probe_filter_superblocks_type(pr, BLKID_FLTR_ONLYIN,
+			names);
+	if (blkid_do_safeprobe(pr) == 0 &&
+	    blkid_probe_lookup_value(pr, "TYPE", &value, NULL) == 0) {
+		HX_strlcpy(type, value, tsize);
+		if (blkid_probe_lookup_value(pr, "UUID", &value, NULL) == 0)
+			HX_strlcpy(uuid, value, usize);
+		else
+			HX_strlcpy(uuid, "-", usize);
+		ret = true;
+	}
+	blkid_free_probe(pr);
+	return ret;
+}
+
+static bool bp_cache_get(const char *key, char *type, size_t tsize,
+    char *uuid, size_t usize)
+{
+	char path[256], *p;
+	hxmc_t *line = NULL;
+	bool ret = false;
+	struct stat sb;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", pmt_fstype_dir, key);
+	if ((fp = fopen(path, "re")) == NULL)
+		return false;
+	if (fstat(fileno(fp), &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    sb.st_uid == 0 && !(sb.st_mode & (S_IWGRP | S_IWOTH)) &&
+	    HX_getl(&line, fp) != NULL && (p = strchr(HX_chomp(line),
+	    ' ')) != NULL) {
+		*p++ = '\0';
+		HX_strlcpy(type, line, tsize);
+		HX_strlcpy(uuid, p, usize);
+		ret = true;
+	}
+	HXmc_free(line);
+	fclose(fp);
+	return ret;
+}
+
+static void bp_cache_put(const char *key, const char *type, const char *uuid)
+{
+	char path[256], tmp[sizeof(path) + 16];
+	FILE *fp;
+	int fd;
+
+	HX_mkdir(RUNDIR "/pam_mount", S_IRUGO | S_IXUGO | S_IWUSR);
+	HX_mkdir(pmt_fstype_dir, S_IRWXU);
+	snprintf(path, sizeof(path), "%s/%s", pmt_fstype_dir, key);
+	snprintf(tmp, sizeof(tmp), "%s.%u", path,
+	         static_cast(unsigned int, getpid()));
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		w4rn("could not write %s: %s\n", tmp, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	fprintf(fp, "%s %s\n", type, uuid);
+	if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+		w4rn("could not write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/**
+ * bp_fstype - determine the filesystem type of a block device
+ * @device:	block device
+ * @type:	receives the type
+ * @size:	size of @type
+ *
+ * Returns false if @device is not a block device or holds no filesystem
+ * libblkid knows about; the caller then leaves it to mount(8).
+ */
+static bool bp_fstype(const char *device, char *type, size_t size)
+{
+	char key[160], ctype[32], cuuid[64], uuid[64];
+	bool cache;
+
+	if (!bp_key(device, key, sizeof(key)))
+		return false;
+	cache = geteuid() == 0;
+	if (cache && bp_cache_get(key, ctype, sizeof(ctype), cuuid,
+	    sizeof(cuuid)) && bp_probe(device, ctype, type, size, uuid,
+	    sizeof(uuid)) && strcmp(uuid, cuuid) == 0)
+		return true;
+	if (!bp_probe(device, NULL, type, size, uuid, sizeof(uuid)))
+		return false;
+	if (cache)
+		bp_cache_put(key, type, uuid);
+	return true;
+}
+
+EXPORT_SYMBOL const struct pmt_blkid_ops pmt_blkid_ops = {
+	.fstype = bp_fstype,
+};
@@ -0,0 +1,79 @@
+/*
+ *	Mount table lookups with libmount
+ *	Copyright Jan Engelhardt, 2006 - 2009
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <libmount.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * Built as the "pmt-libmount" module (see backend.c), so that libmount is
+ * only loaded once there is a volume to mount.
+ */
+
+/**
+ * Compares a given utab entry to the volume. crypt-type volumes will always
+ * be compared case-sensitive since they always use an existing file.
+ */
+static bool lmt_utabent_matches(const char *volume, const char *mountpoint,
+    bool icase, struct libmnt_fs *fs)
+{
+	int (*xcmp)(const char *, const char *);
+	const char *source = mnt_fs_get_source(fs);
+	const char *target = mnt_fs_get_target(fs);
+	bool result = false;
+
+	xcmp = icase ? strcasecmp : strcmp;
+	if (source != NULL)
+		result = xcmp(volume, source) == 0;
+	if (target != NULL)
+		result &= strcmp(mountpoint, target) == 0;
+	return result;
+}
+
+/**
+ * lmt_mounted -
+ * @volume:	source of the volume
+ * @mountpoint:	destination
+ * @icase:	compare @volume case-insensitively
+ *
+ * Returns 1 if @volume is mounted on @mountpoint, 0 if not and -1 on error.
+ */
+static int lmt_mounted(const char *volume, const char *mountpoint, bool icase)
+{
+	struct libmnt_context *ctx;
+	struct libmnt_table *table;
+	struct libmnt_iter *iter;
+	struct libmnt_fs *fs;
+	int ret = 0;
+
+	ctx = mnt_new_context();
+	if (ctx == NULL)
+		return -1;
+	if (mnt_context_get_mtab(ctx, &table) != 0)
+		goto out;
+	iter = mnt_new_iter(MNT_ITER_BACKWARD);
+	if (iter == NULL)
+		goto out;
+
+	while (mnt_table_next_fs(table, iter, &fs) == 0)
+		if (lmt_utabent_matches(volume, mountpoint, icase, fs)) {
+			ret = 1;
+			break;
+		}
+ out:
+	mnt_free_context(ctx);
+	return ret;
+}
+
+EXPORT_SYMBOL const struct pmt_libmount_ops pmt_libmount_ops = {
+	.mounted = lmt_mounted,
+};
@@ -0,0 +1,169 @@
+/*
+ *	Deferred unmount for <linger>
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libHX/init.h>
+#include <libHX/option.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+static unsigned int pl_time;
+static char *pl_token, *pl_service;
+
+static bool pl_get_options(int *argc, const char ***argv)
+{
+	static const struct HXoption options_table[] = {
+		{.sh = 'k', .type = HXTYPE_STRING, .ptr = &pl_token,
+		 .help = "Token the timer was armed with", .htyp = "TOKEN"},
+		{.sh = 's', .type = HXTYPE_STRING, .ptr = &pl_service,
+		 .help = "PAM service of the session that ended",
+		 .htyp = "NAME"},
+		{.sh = 't', .type = HXTYPE_UINT, .ptr = &pl_time,
+		 .help = "Linger time", .htyp = "SECONDS"},
+		HXOPT_AUTOHELP,
+		HXOPT_TABLEEND,
+	};
+	if (HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) !=
+	    HXOPT_ERR_SUCCESS)
+		return false;
+	if (*argc != 2 || pl_token == NULL) {
+		fprintf(stderr, "Usage: %s -k token [-s service] [-t seconds] "
+		        "user\n", HX_basename(**argv));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * pl_detach - continue in the background
+ *
+ * pam_mount waits for us, so the parent returns right away and leaves the
+ * waiting to a child that is not tied to the session or its terminal.
+ * Returns 0 in the child, positive in the parent, negative errno on failure.
+ */
+static int pl_detach(void)
+{
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) < 0)
+		return -errno;
+	else if (pid > 0)
+		return 1;
+	setsid();
+	if (chdir("/") < 0)
+		;
+	if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	return 0;
+}
+
+/**
+ * pl_run - body of the linger timer
+ * @user:	user whose volumes linger
+ * @service:	PAM service of the session that ended, or %NULL
+ * @token:	token this timer was armed with
+ *
+ * Runs once the linger time is over. The configuration is read afresh, as the PAM process that armed the timer is long gone, and
+ * umount_session() is performed unless a new session has arrived in the
+ * meantime. Returns an exit status.
+ */
+static int pl_run(const char *user, const char *service, const char *token)
+{
+	struct config config;
+	char tag[80], buf[64];
+	int fd, ret = EXIT_FAILURE;
+	ssize_t len;
+
+	if ((fd = linger_lock(user, 0)) < 0)
+		return EXIT_FAILURE;
+	len = read(fd, buf, sizeof(buf) - 1);
+	if (len < 0 || strncmp(buf, token, len) != 0 ||
+	    static_cast(size_t, len) != strlen(token)) {
+		w4rn("linger timer superseded\n");
+		close(fd);
+		return EXIT_SUCCESS;
+	}
+	if (cryptmount_init() <= 0)
+		l0g("libcryptmount init failed: %s\n", strerror(errno));
+	initconfig(&config);
+	config.user = xstrdup(user);
+	if (service != NULL)
+		config.service = xstrdup(service);
+	ehd_log_field(EHD_LOGK_USER, "%s", user);
+	ehd_log_field(EHD_LOGK_STAGE, "linger");
+	if (!readconfig(CONFIGFILE, true, &config, PMT_CONF_ALL))
+		goto out;
+	trace_setup(&config);
+	debug_setup(&config);
+	snprintf(tag, sizeof(tag), "linger user=%s", user);
+	ehd_trace_begin(tag);
+	pmt_spawn_setpath(config.path);
+	if (modify_pm_count(&config, config.user, "0") > 0) {
+		w4rn("%s has logged in again\n", user);
+		ret = EXIT_SUCCESS;
+	} else if (!expandconfig(&config) || !read_luserconf(&config)) {
+		l0g("error expanding configuration\n");
+	} else {
+		w4rn("linger time of %us expired\n", config.linger);
+		umount_session(&config);
+		ret = EXIT_SUCCESS;
+	}
+	pmt_spawn_setpath(NULL);
+	ehd_trace_end(ret);
+ out:
+	if (ftruncate(fd, 0) < 0)
+		l0g("could not disarm linger timer: %s\n", strerror(errno));
+	close(fd);
+	/* freeconfig() drops a libHX reference of its own */
+	HX_init();
+	freeconfig(&config);
+	cryptmount_exit();
+	return ret;
+}
+
+
+int main(int argc, const char **argv)
+{
+	unsigned int left;
+	int ret;
+
+	ret = HX_init();
+	if (ret <= 0) {
+		fprintf(stderr, "HX_init: %s\n", strerror(errno));
+		abort();
+	}
+	if (!pl_get_options(&argc, &argv)) {
+		HX_exit();
+		return EXIT_FAILURE;
+	}
+	ret = pl_detach();
+	if (ret != 0) {
+		if (ret < 0)
+			fprintf(stderr, "fork: %s\n", strerror(-ret));
+		HX_exit();
+		return (ret > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	for (left = pl_time; left > 0; )
+		left = sleep(left);
+	ret = pl_run(argv[1], pl_service, pl_token);
+	HX_exit();
+	return ret;
+}
@@ -0,0 +1,60 @@
+/*
+ *	Dump pam_mount metrics in OpenMetrics text format
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libHX/init.h>
+#include <libHX/option.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+static bool pm_get_options(int *argc, const char ***argv)
+{
+	static const struct HXoption options_table[] = {
+		HXOPT_AUTOHELP,
+		HXOPT_TABLEEND,
+	};
+	if (HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) !=
+	    HXOPT_ERR_SUCCESS)
+		return false;
+	if (*argc != 1) {
+		fprintf(stderr, "Usage: %s\n", HX_basename(**argv));
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, const char **argv)
+{
+	int ret;
+
+	ret = HX_init();
+	if (ret <= 0) {
+		fprintf(stderr, "HX_init: %s\n", strerror(errno));
+		abort();
+	}
+	if (!pm_get_options(&argc, &argv))
+		return EXIT_FAILURE;
+
+	ret = pmt_metrics_dump(stdout);
+	if (ret == -ENOENT) {
+		/* Nothing recorded yet; that is still a valid exposition. */
+		printf("# EOF\n");
+	} else if (ret < 0) {
+		fprintf(stderr, "%s: %s: %s\n", HX_basename(*argv),
+		        pmt_metrics_path(), strerror(-ret));
+		HX_exit();
+		return EXIT_FAILURE;
+	}
+	HX_exit();
+	return EXIT_SUCCESS;
+}
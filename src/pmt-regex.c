@@ -0,0 +1,64 @@
+/*
+ *	Regular expressions for volume conditions
+ *	Copyright Jan Engelhardt, 2006 - 2011
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <stdbool.h>
+#include <string.h>
+#include <libHX/defs.h>
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * Built as the "pmt-regex" module (see backend.c); only configurations with
+ * regex="1" conditions need libpcre2.
+ */
+static int regex_match(const char *s, const char *pattern, bool icase)
+{
+	/* Mostly compile-time flags that are not valid for pcre_exec */
+	unsigned int flags = PCRE2_DOLLAR_ENDONLY | PCRE2_DOTALL |
+	                     PCRE2_NO_AUTO_CAPTURE;
+	int errcode = 0, ret;
+	PCRE2_SIZE erroffset;
+	pcre2_code_8 *rd;
+	PCRE2_UCHAR buffer[256];
+	pcre2_match_data *match_data;
+
+	if (icase)
+		flags |= PCRE2_CASELESS;
+	rd = pcre2_compile(reinterpret_cast(PCRE2_SPTR, pattern),
+	     PCRE2_ZERO_TERMINATED, flags, &errcode, &erroffset, NULL);
+	if (rd == NULL) {
+		pcre2_get_error_message(errcode, buffer, sizeof(buffer));
+		l0g("pcre2_compile failed: %s at offset %d\n",
+		    buffer, static_cast(int, erroffset));
+		return -1;
+	}
+
+	match_data = pcre2_match_data_create_from_pattern(rd, NULL);
+	ret = pcre2_match(rd, reinterpret_cast(PCRE2_SPTR, s), strlen(s),
+	      0, 0, match_data, 0);
+	if (ret == PCRE2_ERROR_NOMATCH) {
+		l0g("pcre_exec: no match\n");
+		ret = false;
+	} else if (ret < 0) {
+		ret = false;
+		l0g("pcre_exec: error code %d\n", ret);
+	} else {
+		ret = true;
+		l0g("pcre_exec: /%s/: %d matches\n", pattern, ret);
+	}
+	pcre2_match_data_free(match_data);
+	pcre2_code_free(rd);
+	return ret;
+}
+
+EXPORT_SYMBOL const struct pmt_regex_ops pmt_regex_ops = {
+	.match = regex_match,
+};
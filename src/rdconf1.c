@@ -6,6 +6,7 @@
  *	as published by the Free Software Foundation; either version 2.1
  *	of the License, or (at your option) any later version.
  */
+#include <sys/stat.h>
 #include <errno.h>
 #include <grp.h>
 #include <pwd.h>
@@ -14,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libxml/parser.h>
+#include <libxml/xmlreader.h>
 #if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
 #	include <fstab.h>
 #elif defined(__linux__)
@@ -21,8 +23,6 @@
 #endif
 #include <libHX.h>
 #include <libHX/libxml_helper.h>
-#define PCRE2_CODE_UNIT_WIDTH 8
-#include <pcre2.h>
 #include "libcryptmount.h"
 #include "pam_mount.h"
 
@@ -32,11 +32,25 @@ enum {
 	CONTEXT_LUSER,
 };
 
-enum fstab_field {
-	FSTAB_VOLUME,
-	FSTAB_MNTPT,
-	FSTAB_FSTYPE,
-	FSTAB_OPTS,
+/**
+ * struct pmt_fstab - /etc/fstab, indexed by device
+ * @map:	fs_spec -> struct fstab_entry
+ *
+ * Built when the first volume refers to fstab, and reused for the rest of
+ * the PAM call unless the file (as identified by the remaining members) is
+ * modified or replaced in the meantime. The entries live in the config
+ * arena.
+ */
+struct pmt_fstab {
+	struct HXmap *map;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+};
+
+struct fstab_entry {
+	const char *mntpt, *fstype, *options;
 };
 
 enum {
@@ -56,7 +70,7 @@ enum {
 struct callbackmap {
 	const char *name;
 	const char *(*func)(xmlNode *, struct config *, unsigned int);
-	unsigned int cmd;
+	unsigned int cmd, sections;
 };
 
 struct pmt_command {
@@ -68,58 +82,127 @@ struct pmt_command {
 	 */
 };
 
-/* Functions */
-static int rc_volume_cond_ext(const struct passwd *, xmlNode *);
-
 /* Variables */
-static const struct callbackmap cf_tags[26];
+static const struct callbackmap cf_tags[31];
 static const struct pmt_command default_command[20];
 
 //-----------------------------------------------------------------------------
+/**
+ * config_userinfo -
+ * @config:	configuration structure
+ *
+ * Resolves the per-user substitution values for @config->user, once per
+ * PAM call (the result lives in @config and its arena). A failed passwd
+ * lookup is remembered in @have_pw rather than retried.
+ */
+const struct pmt_userinfo *config_userinfo(struct config *config)
+{
+	struct pmt_userinfo *ui = &config->uinfo;
+	const struct passwd *pe;
+	const struct group *ge;
+	char *sep;
+
+	if (ui->valid && ui->name == config->user)
+		return ui;
+
+	memset(ui, 0, sizeof(*ui));
+	ui->name = config->user;
+	if ((pe = getpwnam(ui->name)) != NULL) {
+		ui->have_pw = true;
+		ui->uid  = pe->pw_uid;
+		ui->gid  = pe->pw_gid;
+		ui->home = pmt_arena_strdup(&config->arena, pe->pw_dir);
+		ge = getgrgid(pe->pw_gid);
+		if (ge != NULL)
+			ui->group = pmt_arena_strdup(&config->arena,
+			            ge->gr_name);
+	} else {
+		l0g("Could not lookup account info for %s: %s\n",
+		    ui->name, strerror(errno));
+	}
+
+	/* "domain\user" split, formerly done by misc_add_ntdom() */
+	sep = strchr(ui->name, '\\');
+	if (sep == NULL) {
+		ui->domain_user = const_cast1(char *, ui->name);
+	} else {
+		ui->domain_name = pmt_arena_strdup(&config->arena, ui->name);
+		if (ui->domain_name != NULL) {
+			sep = ui->domain_name + (sep - ui->name);
+			*sep = '\0';
+			ui->domain_user = sep + 1;
+		}
+	}
+	ui->valid = true;
+	return ui;
+}
+
+/**
+ * userinfo_add -
+ * @vinfo:	substitution map
+ * @ui:		resolved user values
+ *
+ * Adds the per-user variables USER, USERUID, USERGID, GROUP, DOMAIN_NAME and
+ * DOMAIN_USER to @vinfo. libHX format maps can be neither layered nor
+ * pruned, so each map gets its own copy of this (cheap) set.
+ */
+void userinfo_add(struct HXformat_map *vinfo, const struct pmt_userinfo *ui)
+{
+	format_add(vinfo, "USER", ui->name);
+	if (ui->have_pw) {
+		HXformat_add(vinfo, "USERUID", reinterpret_cast(void *,
+			static_cast(long, ui->uid)),
+			HXTYPE_UINT | HXFORMAT_IMMED);
+		HXformat_add(vinfo, "USERGID", reinterpret_cast(void *,
+			static_cast(long, ui->gid)),
+			HXTYPE_UINT | HXFORMAT_IMMED);
+	}
+	format_add(vinfo, "GROUP", (ui->group != NULL) ? ui->group : "");
+	format_add(vinfo, "DOMAIN_NAME", ui->domain_name);
+	format_add(vinfo, "DOMAIN_USER", ui->domain_user);
+}
+
 /**
  * expand_home -
- * @user:	username to use for home directory lookup
+ * @arena:	arena for the new string
+ * @ui:		user whose home directory to use
  * @path:	pathname to expand
- * @size:	size of @path
  *
  * Expands tildes in @path to the user home directory and updates @path.
  * Returns @dest.
  */
-static bool expand_home(const char *user, char **path_pptr)
+static bool expand_home(struct pmt_arena *arena,
+    const struct pmt_userinfo *ui, char **path_pptr)
 {
 	char *buf, *path = *path_pptr;
-	struct passwd *pe;
 	size_t size;
 
 	if (path == NULL)
 		return true;
 	if (*path != '~')
 		return true;
-	if ((pe = getpwnam(user)) == NULL) {
-		l0g("Could not lookup account info for %s\n", user);
+	if (!ui->have_pw || ui->home == NULL) {
+		l0g("Could not lookup account info for %s\n", ui->name);
 		return false;
 	}
-	size = strlen(pe->pw_dir) + strlen(path) + 1;
-	if ((buf = malloc(size)) == NULL) {
-		l0g("%s: malloc %zu: %s\n", __func__, size, strerror(errno));
-		return NULL;
-	}
-	snprintf(buf, size, "%s%s", pe->pw_dir, path + 1);
-	free(path);
+	size = strlen(ui->home) + strlen(path) + 1;
+	if ((buf = pmt_arena_alloc(arena, size)) == NULL)
+		return false;
+	snprintf(buf, size, "%s%s", ui->home, path + 1);
 	*path_pptr = buf;
 	return true;
 }
 
 /**
  * expand_user -
- * @user:	username to substitue for placeholder
+ * @arena:	arena for the new string
  * @dest:	buffer to operate on
- * @size:	size of @dest
+ * @vinfo:	substitution map
  *
- * Substitutes all occurrences of %(USER) by the username. Returns NULL on
- * failure, otherwise @dest.
+ * Substitutes all occurrences of %(USER) by the username. Returns false on
+ * failure.
  */
-static bool expand_user(const char *user, char **dest_pptr,
+static bool expand_user(struct pmt_arena *arena, char **dest_pptr,
     const struct HXformat_map *vinfo)
 {
 	hxmc_t *tmp = NULL;
@@ -127,9 +210,9 @@ static bool expand_user(const char *user, char **dest_pptr,
 	if (*dest_pptr == NULL)
 		return true;
 	HXformat_aprintf(vinfo, &tmp, *dest_pptr);
-	*dest_pptr = xstrdup(tmp);
+	*dest_pptr = pmt_arena_strdup(arena, tmp);
 	HXmc_free(tmp);
-	return true;
+	return *dest_pptr != NULL;
 }
 
 /**
@@ -142,19 +225,18 @@ static bool expand_user(const char *user, char **dest_pptr,
  */
 bool expandconfig(struct config *config)
 {
-	const char *u = config->user;
+	const struct pmt_userinfo *u = config_userinfo(config);
+	struct pmt_arena *a = &config->arena;
 	struct HXformat_map *vinfo;
-	struct passwd *pe;
-	struct group *ge;
 	struct kvp *kvp;
 	struct vol *vpt;
 
-	if ((vinfo = HXformat_init()) == NULL)
+	if (!u->have_pw) {
+		l0g("You do not exist? %s?\n", u->name);
 		return false;
-	if ((pe = getpwnam(u)) == NULL) {
-		l0g("You do not exist? %s? %s.\n", u, strerror(errno));
-		goto rfalse;
 	}
+	if ((vinfo = HXformat_init()) == NULL)
+		return false;
 
 	/*
 	 * Because user's volumes will also be mounted with UID 0,
@@ -163,39 +245,30 @@ bool expandconfig(struct config *config)
 	if (config->level == CONTEXT_GLOBAL)
 		HXformat_add(vinfo, "/libhx/exec", NULL, HXFORMAT_IMMED);
 
-	HXformat_add(vinfo, "USER", u, HXTYPE_STRING);
-	HXformat_add(vinfo, "USERUID", reinterpret_cast(void *,
-		static_cast(long, pe->pw_uid)), HXTYPE_UINT | HXFORMAT_IMMED);
-	HXformat_add(vinfo, "USERGID", reinterpret_cast(void *,
-		static_cast(long, pe->pw_gid)), HXTYPE_UINT | HXFORMAT_IMMED);
-	ge = getgrgid(pe->pw_gid);
-	format_add(vinfo, "GROUP", (ge != NULL) ? ge->gr_name : "");
-	misc_add_ntdom(vinfo, u);
+	userinfo_add(vinfo, u);
 
 	if (config->luserconf != NULL) {
-		char *tmp = NULL;
-		tmp = xstrdup(config->luserconf);
-		if (!expand_home(u, &tmp) || !expand_user(u, &tmp, vinfo)) {
-			free(tmp);
+		char *tmp = config->luserconf;
+
+		if (!expand_home(a, u, &tmp) || !expand_user(a, &tmp, vinfo))
 			goto rfalse;
-		}
+		tmp = HXmc_strinit(tmp);
 		HXmc_free(config->luserconf);
-		config->luserconf = HXmc_strinit(tmp);
-		free(tmp);
+		config->luserconf = tmp;
 	}
 
 	HXlist_for_each_entry(vpt, &config->volume_list, list) {
 		if (vpt->is_expanded)
 			continue;
 		vpt->is_expanded = true;
-		if (!expand_user(u, &vpt->server, vinfo) ||
-		    !expand_home(u, &vpt->volume) ||
-		    !expand_user(u, &vpt->volume, vinfo) ||
-		    !expand_home(u, &vpt->mountpoint) ||
-		    !expand_user(u, &vpt->mountpoint, vinfo) ||
-		    !expand_home(u, &vpt->fs_key_path) ||
-		    !expand_user(u, &vpt->fs_key_path, vinfo) ||
-		    !expand_user(u, &vpt->fs_key_cipher, vinfo))
+		if (!expand_user(a, &vpt->server, vinfo) ||
+		    !expand_home(a, u, &vpt->volume) ||
+		    !expand_user(a, &vpt->volume, vinfo) ||
+		    !expand_home(a, u, &vpt->mountpoint) ||
+		    !expand_user(a, &vpt->mountpoint, vinfo) ||
+		    !expand_home(a, u, &vpt->fs_key_path) ||
+		    !expand_user(a, &vpt->fs_key_path, vinfo) ||
+		    !expand_user(a, &vpt->fs_key_cipher, vinfo))
 			goto rfalse;
 
 		/*
@@ -205,10 +278,12 @@ bool expandconfig(struct config *config)
 		 * Least Surprise says: do the expansion on the key
 		 * nevertheless.
 		 */
-		HXlist_for_each_entry(kvp, &vpt->options, list)
-			if (!expand_user(u, &kvp->key, vinfo) ||
-			    !expand_user(u, &kvp->value, vinfo))
+		HXlist_for_each_entry(kvp, &vpt->options.list, list)
+			if (!expand_user(a, &kvp->key, vinfo) ||
+			    !expand_user(a, &kvp->value, vinfo))
 				goto rfalse;
+		/* Keys are final now. Without index, lookups just scan. */
+		kvplist_reindex(&vpt->options);
 	}
 
 	HXformat_free(vinfo);
@@ -218,18 +293,16 @@ bool expandconfig(struct config *config)
 	return false;
 }
 
+/*
+ * The volume and its strings live in the config arena; only the combopath,
+ * which mount.c (re)computes with HXmc, and the option index are owned
+ * separately.
+ */
 static void volume_free(struct vol *vol)
 {
-	kvplist_genocide(&vol->options);
-	free(vol->fstype);
-	free(vol->server);
-	free(vol->volume);
+	kvplist_free_index(&vol->options);
 	HXmc_free(vol->combopath);
-	free(vol->cipher);
-	free(vol->fs_key_cipher);
-	free(vol->fs_key_hash);
-	free(vol->fs_key_path);
-	free(vol);
+	vol->combopath = NULL;
 }
 
 /**
@@ -270,10 +343,12 @@ void freeconfig(struct config *config)
 	HXmap_free(config->options_allow);
 	HXmap_free(config->options_require);
 	HXmap_free(config->options_deny);
+	if (config->fstab != NULL)
+		HXmap_free(config->fstab->map);
 	free(config->user);
-	free(config->msg_authpw);
-	free(config->msg_sessionpw);
-	free(config->path);
+	free(config->service);
+	pmt_arena_release(&config->arena);
+	pmt_exec_release();
 	memset(config, 0, sizeof(*config));
 	HX_exit();
 }
@@ -287,7 +362,8 @@ void freeconfig(struct config *config)
  * This is ok, since it is already an allocated string (i.e. does belong to
  * pam_mount). Caller frees it anyway right away.
  */
-static bool str_to_optkv(struct HXclist_head *optlist, char *str)
+static bool str_to_optkv(struct pmt_arena *arena,
+    struct HXclist_head *optlist, char *str)
 {
 	char *value, *ptr;
 	struct kvp *kvp;
@@ -296,35 +372,26 @@ static bool str_to_optkv(struct HXclist_head *optlist, char *str)
 		return true;
 
 	while ((ptr = HX_strsep(&str, ",")) != NULL) {
-		kvp = malloc(sizeof(struct kvp));
-		if (kvp == NULL) {
-			l0g("%s: malloc: %s\n", __func__, strerror(errno));
+		kvp = pmt_arena_alloc(arena, sizeof(struct kvp));
+		if (kvp == NULL)
 			return false;
-		}
 		HXlist_init(&kvp->list);
 		value = strchr(ptr, '=');
 		if (value != NULL) {
 			*value++ = '\0';
-			kvp->key   = xstrdup(ptr);
-			kvp->value = xstrdup(value);
+			kvp->key   = pmt_arena_strdup(arena, ptr);
+			kvp->value = pmt_arena_strdup(arena, value);
 			if (kvp->key == NULL || kvp->value == NULL)
-				goto out;
-			HXclist_push(optlist, &kvp->list);
+				return false;
 		} else {
-			kvp->key = xstrdup(ptr);
+			kvp->key = pmt_arena_strdup(arena, ptr);
 			if (kvp->key == NULL)
-				goto out;
+				return false;
 			kvp->value = NULL;
-			HXclist_push(optlist, &kvp->list);
 		}
+		HXclist_push(optlist, &kvp->list);
 	}
-
 	return true;
- out:
-	free(kvp->key);
-	free(kvp->value);
-	free(kvp);
-	return false;
 }
 
 static bool str_to_optlist(struct HXmap *optlist, char *str)
@@ -358,10 +425,13 @@ void initconfig(struct config *config)
 	config->debug      = true;
 	config->mkmntpoint = true;
 
-	config->msg_authpw    = xstrdup("pam_mount password:");
-	config->msg_sessionpw = xstrdup("reenter password for pam_mount:");
+	pmt_arena_init(&config->arena, 0);
+	config->msg_authpw    = pmt_arena_strdup(&config->arena,
+	                        "pam_mount password:");
+	config->msg_sessionpw = pmt_arena_strdup(&config->arena,
+	                        "reenter password for pam_mount:");
 
-	config->path = xstrdup(PMT_DFL_PATH);
+	config->path = pmt_arena_strdup(&config->arena, PMT_DFL_PATH);
 
 	/* Initialize all. Makes it easier. */
 	for (i = 0; i < _CMD_MAX; ++i)
@@ -390,130 +460,253 @@ void initconfig(struct config *config)
 	HXclist_init(&config->volume_list);
 }
 
-bool readconfig(const char *file, bool global_conf, struct config *config)
+/**
+ * resolve_commands -
+ * @config:	configuration
+ *
+ * Resolve the helper programs of the command table against <path> once,
+ * so that spawning them later does not do a $PATH walk each time.
+ */
+static void resolve_commands(const struct config *config)
+{
+	const char *name;
+	unsigned int i;
+
+	for (i = 0; i < _CMD_MAX; ++i) {
+		if (config->command[i] == NULL ||
+		    config->command[i]->items == 0)
+			continue;
+		name = config->command[i]->first->ptr;
+		if (strchr(name, '%') != NULL)
+			/* Expanded at runtime; resolve on first use. */
+			continue;
+		if (!pmt_exec_register(name, config->path))
+			w4rn("helper \"%s\" not found in %s\n",
+			     name, config->path);
+	}
+}
+
+static const struct callbackmap *cf_lookup(const xmlChar *name)
+{
+	const struct callbackmap *cmp;
+
+	for (cmp = cf_tags; cmp->name != NULL; ++cmp)
+		if (xml_strcmp(name, cmp->name) == 0)
+			return cmp;
+	return NULL;
+}
+
+/**
+ * readconfig - load a configuration file
+ * @file:	path to pam_mount.conf.xml or a luserconf
+ * @global_conf:	whether @file is the global configuration
+ * @config:	configuration to add to
+ * @sections:	%PMT_CONF_* bitmask of what the caller needs
+ *
+ * The file is streamed rather than loaded into a DOM: only the top-level
+ * elements in @sections are expanded and handed to their rc_* handler, one
+ * at a time, while everything else (typically the volume list, for the auth
+ * stage) is just scanned over.
+ *
+ * With @config->luserconf_update set, the elements accepted from a
+ * luserconf are also stored with pmt_luserconf_write().
+ *
+ * If the file turns out to be broken halfway, the volumes that were added
+ * from it are taken out again, so that a failed readconfig leaves no more
+ * behind than one that did not get to open the file.
+ */
+bool readconfig(const char *file, bool global_conf, struct config *config,
+    unsigned int sections)
 {
+	struct pmt_luserconf_writer *cache = NULL;
+	struct pmt_volindex_writer *index = NULL;
 	const struct callbackmap *cmp;
+	xmlTextReader *rd;
 	const char *err;
-	xmlDoc *doc;
-	xmlNode *ptr;
+	struct stat sb;
+	unsigned int nvols;
+	xmlNode *node;
+	struct vol *vol;
+	int ret;
 
-	if ((doc = xmlParseFile(file)) == NULL) {
-		l0g("libxml detected a syntax error in %s\n", file);
-		return false;
-	}
-	ptr = xmlDocGetRootElement(doc);
-	if (ptr == NULL || xml_strcmp(ptr->name, "pam_mount") != 0) {
-		xmlFreeDoc(doc);
+	/*
+	 * The index and the luserconf cache are stamped with the file as it
+	 * was before parsing, so that a change while parsing makes them stale
+	 * rather than wrong. The index needs to see every volume.
+	 */
+	if (global_conf && config->volindex_update &&
+	    (sections & PMT_CONF_VOLUMES) && stat(file, &sb) == 0)
+		index = pmt_volindex_new();
+	else if (!global_conf && config->luserconf_update &&
+	    sections == PMT_CONF_ALL && stat(file, &sb) == 0)
+		cache = pmt_luserconf_new();
+	if ((rd = xmlReaderForFile(file, NULL, 0)) == NULL) {
+		l0g("could not open %s\n", file);
+		pmt_volindex_free(index);
+		pmt_luserconf_free(cache);
 		return false;
 	}
+	while ((ret = xmlTextReaderRead(rd)) == 1 &&
+	    xmlTextReaderNodeType(rd) != XML_READER_TYPE_ELEMENT)
+		/* prolog, comments */;
+	if (ret == 0)
+		/* no root element */
+		ret = -1;
+	else if (ret == 1 &&
+	    xml_strcmp(xmlTextReaderConstName(rd), "pam_mount") != 0)
+		ret = -2;
+	if (ret < 0)
+		goto out;
 
 	config->level = global_conf ? CONTEXT_GLOBAL : CONTEXT_LUSER;
-	for (ptr = ptr->children; ptr != NULL; ptr = ptr->next) {
-		if (ptr->type != XML_ELEMENT_NODE)
+	nvols = config->volume_list.items;
+	ret = xmlTextReaderRead(rd);
+	while (ret == 1 && xmlTextReaderDepth(rd) > 0) {
+		if (xmlTextReaderNodeType(rd) != XML_READER_TYPE_ELEMENT) {
+			ret = xmlTextReaderRead(rd);
 			continue;
-		for (cmp = cf_tags; cmp->name != NULL; ++cmp)
-			if (xml_strcmp(ptr->name, cmp->name) == 0) {
-				err = (*cmp->func)(ptr, config, cmp->cmd);
-				if (err != NULL)
-					l0g("%s\n", err);
+		}
+		cmp = cf_lookup(xmlTextReaderConstName(rd));
+		if (cmp != NULL && !(cmp->sections & sections))
+			cmp = NULL;
+		if (cmp != NULL || index != NULL) {
+			if ((node = xmlTextReaderExpand(rd)) == NULL) {
+				ret = -1;
 				break;
 			}
+			if (index != NULL)
+				pmt_volindex_add(index, node);
+			if (cmp != NULL &&
+			    (err = (*cmp->func)(node, config, cmp->cmd)) != NULL)
+				l0g("%s\n", err);
+			else if (cmp != NULL && cache != NULL)
+				pmt_luserconf_add(cache, node);
+		}
+		ret = xmlTextReaderNext(rd);
 	}
-
-	xmlFreeDoc(doc);
+	/* Whatever follows must still be well-formed. */
+	while (ret == 1)
+		ret = xmlTextReaderRead(rd);
+	if (ret < 0)
+		while (config->volume_list.items > nvols) {
+			/* rc_volume() appends */
+			vol = HXclist_pop(&config->volume_list,
+			      struct vol, list);
+			volume_free(vol);
+		}
+ out:
+	xmlFreeTextReader(rd);
+	if (ret == -1)
+		l0g("libxml detected a syntax error in %s\n", file);
+	else if (ret == -2)
+		l0g("%s: root element is not <pam_mount>\n", file);
+	if (ret < 0) {
+		pmt_volindex_free(index);
+		pmt_luserconf_free(cache);
+		return false;
+	}
+	if (index != NULL)
+		pmt_volindex_write(index, file, &sb);
+	if (cache != NULL)
+		pmt_luserconf_write(cache, config->user, &sb);
+	if (global_conf && (sections & PMT_CONF_COMMANDS))
+		resolve_commands(config);
 	return true;
 }
 
 //-----------------------------------------------------------------------------
-/**
- * fstab_value -
- * @volume:	path to volume
- * @field:	-
- *
- * Search for @volume in /etc/fstab and if it is found, copy the @field'th
- * field and return it. Returns %NULL on error.
- */
-static char *fstab_value(const char *volume, const enum fstab_field field)
+static void fstab_add(struct pmt_arena *a, struct HXmap *map,
+    const char *spec, const char *mntpt, const char *fstype,
+    const char *options)
+{
+	struct fstab_entry *e;
+
+	/* The first line wins, as with a linear search. */
+	if (HXmap_get(map, spec) != NULL)
+		return;
+	if ((e = pmt_arena_alloc(a, sizeof(*e))) == NULL)
+		return;
+	e->mntpt   = pmt_arena_strdup(a, mntpt);
+	e->fstype  = pmt_arena_strdup(a, fstype);
+	e->options = pmt_arena_strdup(a, options);
+	HXmap_add(map, spec, e);
+}
+
+static bool fstab_load(struct pmt_arena *a, struct HXmap *map)
 {
-	char *val;
 #if defined(__linux__)
-	struct mntent *fstab_record;
-	FILE *fstab;
+	struct mntent *m;
+	FILE *fp;
 
-	if ((fstab = setmntent("/etc/fstab", "r")) == NULL) {
+	if ((fp = setmntent("/etc/fstab", "r")) == NULL) {
 		l0g("could not open fstab\n");
-		return NULL;
-	}
-
-	for (fstab_record = getmntent(fstab);
-	    fstab_record != NULL &&
-	    strcmp(fstab_record->mnt_fsname, volume) != 0;
-	    fstab_record = getmntent(fstab))
-		/* skip fstab entries until a match is found */;
-
-	if (fstab_record == NULL) {
-		l0g("could not get %dth fstab field for %s\n", field, volume);
-		return NULL;
-	}
-
-	switch (field) {
-		case FSTAB_VOLUME:
-			val = fstab_record->mnt_fsname;
-			break;
-		case FSTAB_MNTPT:
-			val = fstab_record->mnt_dir;
-			break;
-		case FSTAB_FSTYPE:
-			val = fstab_record->mnt_type;
-			break;
-		case FSTAB_OPTS:
-			val = fstab_record->mnt_opts;
-			break;
-		default:
-			l0g("field of %d invalid\n", field);
-			return NULL;
+		return false;
 	}
+	while ((m = getmntent(fp)) != NULL)
+		fstab_add(a, map, m->mnt_fsname, m->mnt_dir, m->mnt_type,
+		          m->mnt_opts);
+	endmntent(fp);
+	return true;
 #elif defined (__FreeBSD__) || defined (__OpenBSD__) || defined(__APPLE__)
-	struct fstab *fstab_record;
+	struct fstab *f;
 
 	if (!setfsent()) {
 		l0g("could not open fstab\n");
-		return NULL;
-	}
-	if ((fstab_record = getfsspec(volume)) == NULL) {
-		l0g("could not get %dth fstab field for %s\n", field, volume);
-		return NULL;
-	}
-
-	switch (field) {
-		case FSTAB_VOLUME:
-			val = fstab_record->fs_spec;
-			break;
-		case FSTAB_MNTPT:
-			val = fstab_record->fs_file;
-			break;
-		case FSTAB_FSTYPE:
-			val = fstab_record->fs_vfstype;
-			break;
-		case FSTAB_OPTS:
-			val = fstab_record->fs_mntops;
-			break;
-		default:
-			l0g("field of %d invalid\n", field);
-			return NULL;
+		return false;
 	}
+	while ((f = getfsent()) != NULL)
+		fstab_add(a, map, f->fs_spec, f->fs_file, f->fs_vfstype,
+		          f->fs_mntops);
+	endfsent();
+	return true;
 #else
 	l0g("reading fstab not implemented on arch.\n");
-	return NULL;
+	return false;
 #endif
+}
 
-	val = xstrdup(val);
-#if defined(__linux__)
-	endmntent(fstab);
-#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
-	endfsent();
-#endif
-	return val;
+/**
+ * fstab_lookup -
+ * @config:	configuration, holds the index
+ * @volume:	path to volume
+ *
+ * Search for @volume in /etc/fstab and return all of its fields. Returns
+ * %NULL on error.
+ */
+static const struct fstab_entry *fstab_lookup(struct config *config,
+    const char *volume)
+{
+	struct pmt_fstab *ft = config->fstab;
+	const struct fstab_entry *e;
+	struct stat sb;
+
+	if (volume == NULL)
+		return NULL;
+	if (stat("/etc/fstab", &sb) < 0) {
+		l0g("could not open fstab\n");
+		return NULL;
+	}
+	if (ft == NULL || ft->dev != sb.st_dev || ft->ino != sb.st_ino ||
+	    ft->size != sb.st_size || ft->mtime != sb.st_mtime) {
+		if (ft == NULL) {
+			ft = pmt_arena_zalloc(&config->arena, sizeof(*ft));
+			if (ft == NULL)
+				return NULL;
+			config->fstab = ft;
+		}
+		HXmap_free(ft->map);
+		ft->map = HXmap_init(HXMAPT_HASH, HXMAP_SCKEY);
+		ft->mtime = 0;
+		if (ft->map == NULL || !fstab_load(&config->arena, ft->map))
+			return NULL;
+		ft->dev   = sb.st_dev;
+		ft->ino   = sb.st_ino;
+		ft->size  = sb.st_size;
+		ft->mtime = sb.st_mtime;
+	}
+	if ((e = HXmap_get(ft->map, volume)) == NULL)
+		l0g("could not find %s in fstab\n", volume);
+	return e;
 }
 
 /**
@@ -586,95 +779,6 @@ static inline bool parse_bool_f(char *s)
 	return ret;
 }
 
-static int pmt_strregmatch(const char *s, const char *pattern, bool icase)
-{
-	/* Mostly compile-time flags that are not valid for pcre_exec */
-	unsigned int flags = PCRE2_DOLLAR_ENDONLY | PCRE2_DOTALL |
-	                     PCRE2_NO_AUTO_CAPTURE;
-	int errcode = 0, ret;
-	PCRE2_SIZE erroffset;
-	pcre2_code_8 *rd;
-	PCRE2_UCHAR buffer[256];
-	pcre2_match_data *match_data;
-
-	if (icase)
-		flags |= PCRE2_CASELESS;
-	rd = pcre2_compile(reinterpret_cast(PCRE2_SPTR, pattern),
-	     PCRE2_ZERO_TERMINATED, flags, &errcode, &erroffset, NULL);
-	if (rd == NULL) {
-		l0g("pcre2_compile failed: %s at offset %d\n",
-		    buffer, static_cast(int, erroffset));
-		return -1;
-	}
-
-	match_data = pcre2_match_data_create_from_pattern(rd, NULL);
-	ret = pcre2_match(rd, reinterpret_cast(PCRE2_SPTR, s), strlen(s),
-	      0, 0, match_data, 0);
-	if (ret == PCRE2_ERROR_NOMATCH) {
-		l0g("pcre_exec: no match\n");
-		ret = false;
-	} else if (ret < 0) {
-		ret = false;
-		l0g("pcre_exec: error code %d\n", ret);
-	} else {
-		ret = true;
-		l0g("pcre_exec: /%s/: %d matches\n", pattern, ret);
-	}
-	pcre2_match_data_free(match_data);
-	pcre2_code_free(rd);
-	return ret;
-}
-
-/**
- * user_in_sgrp -
- * @user:	user to check
- * @grp:	group name
- *
- * Checks whether @user has @grp as one its _secondary_ groups. Returns 0 if
- * no match was found, positive non-zero on success or negative non-zero on
- * failure.
- */
-static bool user_in_sgrp(const char *user, const char *search_grp, bool icase,
-    bool regex)
-{
-	const struct group *gent;
-	int i, ret, ngroups = 1;
-	gid_t *grplist, grpbuf;
-
-	ret = getgrouplist(user, -1, &grpbuf, &ngroups);
-	if (ret == 0 || (ret == 1 && grpbuf == -1)) {
-		/* No secondary groups. Cannot be a member, then. */
-		return false;
-	}
-	grplist = malloc(sizeof(gid_t) * ngroups);
-	ret = getgrouplist(user, -1, grplist, &ngroups);
-	if (ret < 0) {
-		l0g("getgrouplist(%s) failed: %s\n", user, strerror(errno));
-		free(grplist);
-		return false;
-	}
-	for (i = 0; i < ngroups; ++i) {
-		if (grplist[i] == -1)
-			continue;
-		gent = getgrgid(grplist[i]);
-		if (gent == NULL)
-			continue;
-		if (regex) {
-			if (pmt_strregmatch(gent->gr_name, search_grp, icase) > 0)
-				goto found;
-		} else if (icase && strcasecmp(gent->gr_name, search_grp) == 0) {
-			goto found;
-		} else if (strcmp(gent->gr_name, search_grp) == 0) {
-			goto found;
-		}
-	}
-	free(grplist);
-	return false;
- found:
-	free(grplist);
-	return true;
-}
-
 //-----------------------------------------------------------------------------
 static const char *rc_command(xmlNode *node, struct config *config,
     unsigned int cmdnr)
@@ -738,6 +842,20 @@ static const char *rc_debug(xmlNode *node, struct config *config,
 	return NULL;
 }
 
+static const char *rc_linger(xmlNode *node, struct config *config,
+    unsigned int command)
+{
+	char *tmp;
+
+	if (config->level != CONTEXT_GLOBAL)
+		return "Tried to set <linger> from user config: not permitted";
+	if ((tmp = xml_getprop(node, "time")) != NULL) {
+		config->linger = strtoul(tmp, NULL, 0);
+		free(tmp);
+	}
+	return NULL;
+}
+
 static const char *rc_logout(xmlNode *node, struct config *config,
     unsigned int command)
 {
@@ -756,20 +874,20 @@ static const char *rc_logout(xmlNode *node, struct config *config,
 static const char *rc_luserconf(xmlNode *node, struct config *config,
     unsigned int command)
 {
-	struct passwd *pent;
+	const struct pmt_userinfo *ui = config_userinfo(config);
 	char *s;
 
 	if (config->level != CONTEXT_GLOBAL)
 		return "Tried to set <luserconf> from user config: "
 		       "meaningless";
-	if ((pent = getpwnam(config->user)) == NULL)
+	if (!ui->have_pw)
 		return "Could not get password entry";
 	if ((s = xml_getprop(node, "name")) == NULL)
 		return "<luserconf> is missing name= attribute";
 	HXmc_free(config->luserconf);
 	config->luserconf = HXmc_strinit("");
 	if (strlen(s) < 1 || s[0] != '/') {
-		HXmc_strcat(&config->luserconf, pent->pw_dir);
+		HXmc_strcat(&config->luserconf, ui->home);
 		HXmc_strcat(&config->luserconf, "/");
 	}
 	HXmc_strcat(&config->luserconf, s);
@@ -778,6 +896,15 @@ static const char *rc_luserconf(xmlNode *node, struct config *config,
 	return NULL;
 }
 
+static const char *rc_metrics(xmlNode *node, struct config *config,
+    unsigned int command)
+{
+	if (config->level != CONTEXT_GLOBAL)
+		return "Tried to set <metrics> from user config: not permitted";
+	config->metrics = parse_bool_f(xml_getprop(node, "enable"));
+	return NULL;
+}
+
 static const char *rc_mkmountpoint(xmlNode *node, struct config *config,
     unsigned int command)
 {
@@ -841,6 +968,38 @@ static const char *rc_mntoptions(xmlNode *node, struct config *config,
 	return NULL;
 }
 
+static const char *rc_namespace(xmlNode *node, struct config *config,
+    unsigned int command)
+{
+	if (config->level != CONTEXT_GLOBAL)
+		return "Tried to set <namespace> from user config: "
+		       "not permitted";
+	config->namespace = parse_bool_f(xml_getprop(node, "enable"));
+	return NULL;
+}
+
+static const char *rc_speculative_unlock(xmlNode *node,
+    struct config *config, unsigned int command)
+{
+	char *tmp;
+
+	if (config->level != CONTEXT_GLOBAL)
+		return "Tried to set <speculative-unlock> from user config: "
+		       "not permitted";
+	if (!parse_bool_f(xml_getprop(node, "enable"))) {
+		config->spec_unlock = 0;
+		return NULL;
+	}
+	config->spec_unlock = 60;
+	if ((tmp = xml_getprop(node, "timeout")) != NULL) {
+		config->spec_unlock = strtoul(tmp, NULL, 0);
+		free(tmp);
+		if (config->spec_unlock == 0)
+			config->spec_unlock = 1;
+	}
+	return NULL;
+}
+
 static const char *rc_string(xmlNode *node, struct config *config,
     unsigned int command)
 {
@@ -849,16 +1008,13 @@ static const char *rc_string(xmlNode *node, struct config *config,
 			continue;
 		switch (command) {
 			case CMDA_AUTHPW:
-				free(config->msg_authpw);
-				config->msg_authpw = xstrdup(signed_cast(const char *, node->content));
+				config->msg_authpw = pmt_arena_strdup(&config->arena, signed_cast(const char *, node->content));
 				break;
 			case CMDA_SESSIONPW:
-				free(config->msg_sessionpw);
-				config->msg_sessionpw = xstrdup(signed_cast(const char *, node->content));
+				config->msg_sessionpw = pmt_arena_strdup(&config->arena, signed_cast(const char *, node->content));
 				break;
 			case CMDA_PATH:
-				free(config->path);
-				config->path = xstrdup(signed_cast(const char *, node->content));
+				config->path = pmt_arena_strdup(&config->arena, signed_cast(const char *, node->content));
 				break;
 		}
 		break;
@@ -866,459 +1022,74 @@ static const char *rc_string(xmlNode *node, struct config *config,
 	return NULL;
 }
 
-/**
- * rc_volume_cond_and - handle <and> element
- * @pwd:	user logging in
- * @node: 	XML <and> node
- *
- * Handle an <and> XML node, by processing all elements within it and ANDing
- * them together. Returns negative on error.
- */
-static int rc_volume_cond_and(const struct passwd *pwd, xmlNode *node)
-{
-	unsigned int count = 0;
-	int ret;
-
-	for (node = node->children; node != NULL; node = node->next) {
-		if (node->type != XML_ELEMENT_NODE)
-			continue;
-		ret = rc_volume_cond_ext(pwd, node);
-		if (ret < 0)
-			return ret;
-		else if (ret == 0)
-			return false;
-		++count;
-	}
-
-	if (count > 0)
-		/*
-		 * If there was any non-matching element, we would have
-		 * already returned above.
-		 */
-		return true;
-
-	l0g("config: <and> does not have any child elements\n");
-	return -1;
-}
-
-/**
- * rc_volume_cond_or - handle <or> element
- * @pwd:	user logging in
- * @node:	XML <or> node
- *
- * Handle an <or> XML node, by processing all elements within it and ORing
- * them together. On error, returns -1.
- */
-static int rc_volume_cond_or(const struct passwd *pwd, xmlNode *node)
+static const char *rc_trace(xmlNode *node, struct config *config,
+    unsigned int command)
 {
-	unsigned int count = 0;
-	int ret;
+	char *s;
 
-	for (node = node->children; node != NULL; node = node->next) {
-		if (node->type != XML_ELEMENT_NODE)
-			continue;
-		ret = rc_volume_cond_ext(pwd, node);
-		if (ret < 0)
-			return ret;
-		else if (ret > 0)
-			return true;
-		++count;
+	if (config->level != CONTEXT_GLOBAL)
+		return "Tried to set <trace> from user config: not permitted";
+	if (!parse_bool_f(xml_getprop(node, "enable"))) {
+		config->trace = NULL;
+		return NULL;
 	}
-
-	if (count > 0)
-		return false;
-
-	l0g("config: <and> does not have any child elements\n");
-	return -1;
-}
-
-/**
- * rc_volume_cond_xor - handle <xor> element
- * @pwd:	user logging in
- * @node:	XML <xor> node
- *
- * Handle an <xor> XML node, by processing the two elements within it and
- * XORin them together. Exactly two elements must be provided, otherwise
- * the function fails with -1.
- */
-static int rc_volume_cond_xor(const struct passwd *pwd, xmlNode *node)
-{
-	unsigned int count = 0;
-	int ret[2];
-
-	for (node = node->children; node != NULL; node = node->next) {
-		if (node->type != XML_ELEMENT_NODE)
-			continue;
-		if (count >= 2)
-			goto out;
-		ret[count] = rc_volume_cond_ext(pwd, node);
-		if (ret[count] < 0)
-			return ret[count];
-		++count;
+	s = xml_getprop(node, "file");
+	if (s != NULL && *s != '\0' && *s != '/') {
+		free(s);
+		return "<trace file=...> must be an absolute path";
 	}
-
-	if (count == 2)
-		return ret[0] ^ ret[1];
- out:
-	l0g("config: <xor> must have exactly two child elements\n");
-	return -1;
+	config->trace = pmt_arena_strdup(&config->arena,
+	                (s != NULL && *s != '\0') ? s : "syslog");
+	free(s);
+	return NULL;
 }
 
 /**
- * rc_volume_cond_not - handle <not> element
- * @pwd:	user logging in
- * @node:	XML <not> node
+ * arena_getprop -
+ * @arena:	destination arena
+ * @node:	XML node
+ * @attr:	attribute name
  *
- * Handle an <not> XML node, by processing the single elements within it and
- * negating it. Exactly one elements must be provided, otherwise the
- * function fails with -1.
- */
-static int rc_volume_cond_not(const struct passwd *pwd, xmlNode *node)
-{
-	unsigned int count = 0;
-	int ret = true;
-
-	for (node = node->children; node != NULL; node = node->next) {
-		if (node->type != XML_ELEMENT_NODE)
-			continue;
-		if (count++ > 0)
-			goto out;
-		ret = rc_volume_cond_ext(pwd, node);
-		if (ret < 0)
-			return ret;
-		ret = !ret;
-	}
-
-	if (count == 1)
-		return ret;
- out:
-	l0g("config: <not> may only have one child element\n");
-	return -1;
-}
-
-/**
- * rc_volume_cond_user - handle <user> element
- * @pwd:	user logging in
- * @node:	XML <user> node
+ * Like xml_getprop(), but returns a copy placed in @arena.
  */
-static int rc_volume_cond_user(const struct passwd *pwd, xmlNode *node)
+static char *arena_getprop(struct pmt_arena *arena, xmlNode *node,
+    const char *attr)
 {
-	xmlNode *parent = node;
-	bool icase = parse_bool_f(xml_getprop(parent, "icase"));
-	bool regex = parse_bool_f(xml_getprop(parent, "regex"));
-	const char *pattern;
+	char *tmp, *ret;
 
-	for (node = node->children; node != NULL; node = node->next) {
-		if (node->type != XML_TEXT_NODE)
-			continue;
-		pattern = signed_cast(const char *, node->content);
-		if (regex)
-			return pmt_strregmatch(pwd->pw_name, pattern,
-			       icase) > 0;
-		else if (icase)
-			return strcasecmp(pwd->pw_name, pattern) == 0;
-		else
-			return strcmp(pwd->pw_name, pattern) == 0;
-	}
-
-	return false;
-}
-
-static int __rc_volume_cond_id(const char *s, unsigned int id)
-{
-	unsigned int id_start, id_end;
-	char *delim;
-
-	id_start = id_end = strtoul(s, &delim, 0);
-	if (*delim == '\0')
-		return id_start == id;
-	if (*delim != '-' || *++delim == '\0')
-		return -1;
-	id_end = strtoul(delim, &delim, 0);
-	if (*delim != '\0')
-		return -1;
-	return id_start <= id && id <= id_end;
-}
-
-/**
- * rc_volume_cond_uid - handle <uid> element
- * @pwd:	user logging in
- * @node:	XML <uid> node
- */
-static int rc_volume_cond_uid(const struct passwd *pwd, xmlNode *node)
-{
-	int ret;
-
-	for (node = node->children; node != NULL; node = node->next) {
-		if (node->type != XML_TEXT_NODE)
-			continue;
-		ret = __rc_volume_cond_id(signed_cast(const char *,
-		      node->content), pwd->pw_uid);
-		return ret;
-	}
-
-	l0g("config: empty or invalid content for <%s>\n", "uid");
-	return -1;
-}
-
-/**
- * rc_volume_cond_gid - handle <gid> element
- * @pwd:	user logging in
- * @node:	XML <uid> node
- */
-static int rc_volume_cond_gid(const struct passwd *pwd, xmlNode *node)
-{
-	int ret;
-
-	for (node = node->children; node != NULL; node = node->next) {
-		if (node->type != XML_TEXT_NODE)
-			continue;
-		ret = __rc_volume_cond_id(signed_cast(const char *,
-		      node->content), pwd->pw_gid);
-		return ret;
-	}
-
-	l0g("config: empty or invalid content for <%s>\n", "gid");
-	return -1;
-}
-
-static int __rc_volume_cond_pgrp(const char *group, unsigned int gid,
-    bool icase, bool regex)
-{
-	const struct group *grp;
-
-	errno = 0;
-	grp   = getgrgid(gid);
-	if (grp == NULL) {
-		if (errno == 0)
-			return 0; /* just not found */
-
-		w4rn("getgrgid(%u) failed: %s\n", gid, strerror(errno));
-		return -1;
-	}
-
-	if (regex)
-		return pmt_strregmatch(grp->gr_name, group, icase) > 0;
-	else if (icase)
-		return strcasecmp(group, grp->gr_name) == 0;
-	else
-		return strcmp(group, grp->gr_name) == 0;
-}
-
-/**
- * rc_volume_cond_pgrp - handle <pgrp> element
- * @pwd:	user logging in
- * @node:	XML <pgrp> node (actually also <sgrp>)
- */
-static int rc_volume_cond_pgrp(const struct passwd *pwd, xmlNode *node)
-{
-	xmlNode *parent = node;
-	bool icase = parse_bool_f(xml_getprop(parent, "icase"));
-	bool regex = parse_bool_f(xml_getprop(parent, "regex"));
-
-	for (node = node->children; node != NULL; node = node->next) {
-		if (node->type != XML_TEXT_NODE)
-			continue;
-
-		return __rc_volume_cond_pgrp(
-		       signed_cast(const char *, node->content), pwd->pw_gid,
-		       icase, regex);
-	}
-
-	l0g("config: empty or invalid content for <%s>\n", "pgrp");
-	return -1;
-}
-
-/**
- * rc_volume_cond_sgrp - handle <sgrp> element
- * @pwd:	user logging in
- * @node:	XML <sgrp> node
- */
-static int rc_volume_cond_sgrp(const struct passwd *pwd, xmlNode *node)
-{
-	const struct group *grp;
-	xmlNode *parent = node;
-	bool icase = parse_bool_f(xml_getprop(parent, "icase"));
-	bool regex = parse_bool_f(xml_getprop(parent, "regex"));
-	int ret;
-
-	for (node = node->children; node != NULL; node = node->next) {
-		if (node->type != XML_TEXT_NODE)
-			continue;
-
-		if ((grp = getgrgid(pwd->pw_gid)) == NULL) {
-			if (errno == 0)
-				return 0;
-			w4rn("getgrgid(%ld) failed: %s\n",
-			     static_cast(long, pwd->pw_gid), strerror(errno));
-			return -1;
-		}
-
-		ret = rc_volume_cond_pgrp(pwd, parent);
-		if (ret < 0 || ret > 0)
-			return ret;
-		return user_in_sgrp(pwd->pw_name,
-		       signed_cast(const char *, node->content), icase, regex);
-	}
-
-	l0g("config: empty or invalid content for <%s>\n", "sgrp");
-	return -1;
-}
-
-/**
- * rc_volume_cond_ext - interpret extended user control elements
- * @pwd:	user logging in
- * @node:	XML node to operate on
- */
-static int rc_volume_cond_ext(const struct passwd *pwd, xmlNode *node)
-{
-	if (xml_strcmp(node->name, "and") == 0)
-		return rc_volume_cond_and(pwd, node);
-	else if (xml_strcmp(node->name, "or") == 0)
-		return rc_volume_cond_or(pwd, node);
-	else if (xml_strcmp(node->name, "xor") == 0)
-		return rc_volume_cond_xor(pwd, node);
-	else if (xml_strcmp(node->name, "not") == 0)
-		return rc_volume_cond_not(pwd, node);
-	else if (xml_strcmp(node->name, "user") == 0)
-		return rc_volume_cond_user(pwd, node);
-	else if (xml_strcmp(node->name, "uid") == 0)
-		return rc_volume_cond_uid(pwd, node);
-	else if (xml_strcmp(node->name, "gid") == 0)
-		return rc_volume_cond_gid(pwd, node);
-	else if (xml_strcmp(node->name, "pgrp") == 0)
-		return rc_volume_cond_pgrp(pwd, node);
-	else if (xml_strcmp(node->name, "sgrp") == 0)
-		return rc_volume_cond_sgrp(pwd, node);
-
-	l0g("config: unknown element <%s>\n", node->name);
-	return -1;
-}
-
-/**
- * rc_volume_cond_simple - interpret simple user control elements
- * @pwd:	user logging in
- * @node:	XML <volume> node
- */
-static int rc_volume_cond_simple(const struct passwd *pwd, xmlNode *node)
-{
-	char *user   = xml_getprop(node, "user");
-	char *invert = xml_getprop(node, "invert");
-	char *uid    = xml_getprop(node, "uid");
-	char *gid    = xml_getprop(node, "gid");
-	char *pgrp   = xml_getprop(node, "pgrp");
-	char *sgrp   = xml_getprop(node, "sgrp");
-	bool for_me  = true;
-	int ret      = true;
-
-	if (user == NULL && invert == NULL && uid == NULL && gid == NULL &&
-	    pgrp == NULL && sgrp == NULL)
-		return -1;
-
-	if (user != NULL) {
-		if (strcmp(user, "*") != 0)
-			for_me &= strcmp(pwd->pw_name, user) == 0;
-		else if (pwd->pw_uid == 0 || strcmp(pwd->pw_name, "root") == 0)
-			/* The wildcard never matches root */
-			for_me &= false;
-	} else if (pwd->pw_uid == 0 || strcmp(pwd->pw_name, "root") == 0) {
-		/* No user field at all generally implies the wildcard */
-		for_me &= false;
-	}
-	if (uid != NULL) {
-		ret = __rc_volume_cond_id(uid, pwd->pw_uid);
-		if (ret < 0)
-			goto out;
-		for_me &= ret;
-	}
-	if (gid != NULL) {
-		ret = __rc_volume_cond_id(gid, pwd->pw_gid);
-		if (ret < 0)
-			goto out;
-		for_me &= ret;
-	}
-	if (pgrp != NULL) {
-		ret = __rc_volume_cond_pgrp(pgrp, pwd->pw_gid, false, false);
-		if (ret < 0)
-			goto out;
-		for_me &= ret;
-	}
-	if (sgrp != NULL) {
-		bool ret2 = __rc_volume_cond_pgrp(sgrp, pwd->pw_gid, false, false);
-		if (ret < 0)
-			goto out;
-		ret = user_in_sgrp(pwd->pw_name, sgrp, false, false);
-		if (ret < 0)
-			goto out;
-		for_me &= ret || ret2;
-	}
-	if (invert != NULL) {
-		l0g("The \"invert\" attribute is deprecated, support will "
-		    "be removed in next version.\n");
-		if (strtoul(invert, NULL, 0))
-			for_me = !for_me;
-	}
-
- out:
-	free(user);
-	free(invert);
-	free(uid);
-	free(gid);
-	free(pgrp);
-	free(sgrp);
-	if (ret < 0)
-		return ret;
-	return for_me;
-}
-
-/**
- * rc_volume_cond - check if volume applies to user
- * @node:	XML <volume> node
- */
-static int rc_volume_cond(const char *user, xmlNode *node)
-{
-	struct passwd *pwd_ent;
-	int ret;
-
-	if ((pwd_ent = getpwnam(user)) == NULL) {
-		if (errno == 0)
-			return 0;
-		l0g("getpwnam: %s\n", strerror(errno));
-		return -1;
-	}
-
-	ret = rc_volume_cond_simple(pwd_ent, node);
-	if (ret < 0 && node->children != NULL) {
-		/* When no attributes, but elements... */
-		ret = rc_volume_cond_and(pwd_ent, node);
-		if (ret < 0)
-			return -1;
-		else if (ret == 0)
-			return false;
-	} else if (ret == 0) {
-		/* Attributes but (hopefully) no elements. */
-		if (node->children != NULL) {
-			l0g("You cannot have both simple and extended user control\n");
-			return -1;
-		}
-		return false;
-	}
-
-	return true;
+	if ((tmp = xml_getprop(node, attr)) == NULL)
+		return NULL;
+	ret = pmt_arena_strdup(arena, tmp);
+	free(tmp);
+	return ret;
 }
 
 static const char *rc_volume(xmlNode *node, struct config *config,
     unsigned int command)
 {
+	struct pmt_arena *a = &config->arena;
+	const struct fstab_entry *fse = NULL;
+	bool other_service = false;
+	struct pmt_cond *cond;
 	const char *err;
 	struct vol *vpt;
 	unsigned int i;
 	char *tmp;
+	int ret;
 
-	if (rc_volume_cond(config->user, node) <= 0)
+	if ((cond = pmt_cond_compile(a, node)) == NULL)
+		return strerror(errno);
+	ret = pmt_cond_eval(cond, config, config->service);
+	if (ret == 0 && config->service != NULL && pmt_cond_has_service(cond))
+		/*
+		 * Mounted by another service, perhaps; keep it around so that
+		 * this session can unmount it if it turns out to be the last.
+		 */
+		other_service = pmt_cond_eval(cond, config, NULL) > 0;
+	if (ret <= 0 && !other_service)
 		return NULL;
 
-	vpt = calloc(1, sizeof(struct vol));
+	vpt = pmt_arena_zalloc(a, sizeof(struct vol));
 	if (vpt == NULL)
 		return strerror(errno);
 
@@ -1326,17 +1097,17 @@ static const char *rc_volume(xmlNode *node, struct config *config,
 	HXclist_push(&config->volume_list, &vpt->list);
 
 	vpt->globalconf = config->level == CONTEXT_GLOBAL;
+	vpt->other_service = other_service;
 	vpt->user = config->user;
 	vpt->type = CMD_LCLMOUNT;
-	HXclist_init(&vpt->options);
+	kvplist_init(&vpt->options);
 
 	/* Eyeball ssh setting */
 	if ((tmp = xml_getprop(node, "ssh")) != NULL)
 		vpt->uses_ssh = parse_bool_f(tmp);
 
 	/* Filesystem type */
-	if ((tmp = xml_getprop(node, "fstype")) != NULL) {
-		free(vpt->fstype);
+	if ((tmp = arena_getprop(a, node, "fstype")) != NULL) {
 		vpt->fstype = tmp;
 
 		for (i = 0; default_command[i].type != -1; ++i) {
@@ -1347,7 +1118,7 @@ static const char *rc_volume(xmlNode *node, struct config *config,
 			}
 		}
 	} else {
-		vpt->fstype = xstrdup("auto");
+		vpt->fstype = pmt_arena_strdup(a, "auto");
 	}
 
 	if ((tmp = xml_getprop(node, "noroot")) != NULL)
@@ -1357,23 +1128,18 @@ static const char *rc_volume(xmlNode *node, struct config *config,
 		vpt->noroot = strcmp(vpt->fstype, "fuse") == 0;
 
 	/* Source location */
-	if ((tmp = xml_getprop(node, "server")) != NULL) {
-		free(vpt->server);
+	if ((tmp = arena_getprop(a, node, "server")) != NULL)
 		vpt->server = tmp;
-	}
-	if ((tmp = xml_getprop(node, "path")) != NULL) {
-		free(vpt->volume);
+	if ((tmp = arena_getprop(a, node, "path")) != NULL)
 		vpt->volume = tmp;
-	}
 
 	/* Destination */
-	if ((tmp = xml_getprop(node, "mountpoint")) != NULL) {
-		free(vpt->mountpoint);
+	if ((tmp = arena_getprop(a, node, "mountpoint")) != NULL) {
 		vpt->mountpoint = tmp;
 	} else {
-		free(vpt->mountpoint);
-		vpt->mountpoint = fstab_value(vpt->volume, FSTAB_MNTPT);
-		if (vpt->mountpoint == NULL) {
+		fse = fstab_lookup(config, vpt->volume);
+		if (fse == NULL || (vpt->mountpoint =
+		    pmt_arena_strdup(a, fse->mntpt)) == NULL) {
 			err = "could not determine mountpoint";
 			goto out;
 		}
@@ -1388,18 +1154,18 @@ static const char *rc_volume(xmlNode *node, struct config *config,
 		 * is '-' and this means no options.
 		 */
 		if (vpt->use_fstab) {
-			char *options = fstab_value(vpt->volume, FSTAB_OPTS);
+			/* str_to_optkv() modifies the string */
+			char *options = pmt_arena_strdup(a, fse->options);
 			if (options == NULL) {
 				err = "could not determine options";
 				goto out;
 			}
-			if (!str_to_optkv(&vpt->options, options)) {
+			if (!str_to_optkv(a, &vpt->options.list, options)) {
 				err = "error parsing mount options";
 				goto out;
 			}
-			free(options);
 		}
-	} else if (!str_to_optkv(&vpt->options, tmp)) {
+	} else if (!str_to_optkv(a, &vpt->options.list, tmp)) {
 		free(tmp);
 		err = "error parsing mount options";
 		goto out;
@@ -1408,29 +1174,22 @@ static const char *rc_volume(xmlNode *node, struct config *config,
 	}
 
 	/* Filesystem key */
-	if ((tmp = xml_getprop(node, "cipher")) != NULL) {
-		free(vpt->cipher);
+	if ((tmp = arena_getprop(a, node, "cipher")) != NULL)
 		vpt->cipher = tmp;
-	}
-	if ((tmp = xml_getprop(node, "fskeypath")) != NULL) {
-		free(vpt->fs_key_path);
+	if ((tmp = arena_getprop(a, node, "fskeypath")) != NULL)
 		vpt->fs_key_path = tmp;
-	}
-	if ((tmp = xml_getprop(node, "fskeycipher")) != NULL) {
-		free(vpt->fs_key_cipher);
+	if ((tmp = arena_getprop(a, node, "fskeycipher")) != NULL)
 		vpt->fs_key_cipher = tmp;
-	}
-	if ((tmp = xml_getprop(node, "fskeyhash")) != NULL) {
-		free(vpt->fs_key_hash);
+	if ((tmp = arena_getprop(a, node, "fskeyhash")) != NULL) {
 		vpt->fs_key_hash = tmp;
 	} else if (vpt->fs_key_path != NULL) {
 		l0g("Volume %s: consider specifying the fskeyhash\n",
 		    (vpt->volume != NULL) ? vpt->volume : "(null)");
-		vpt->fs_key_hash = HX_strdup("md5");
+		vpt->fs_key_hash = pmt_arena_strdup(a, "md5");
 	}
 
 	if (fstype_nodev(vpt->fstype) == 1 && vpt->volume == NULL)
-		vpt->volume = xstrdup("none");
+		vpt->volume = pmt_arena_strdup(a, "none");
 
 	return NULL;
 
@@ -1474,30 +1233,36 @@ static const struct pmt_command default_command[] = {
 };
 
 static const struct callbackmap cf_tags[] = {
-	{"cifsmount",       rc_command,             CMD_CIFSMOUNT},
-	{"cryptmount",      rc_command,             CMD_CRYPTMOUNT},
-	{"cryptumount",     rc_command,             CMD_CRYPTUMOUNT},
-	{"debug",           rc_debug,               CMD_NONE},
-	{"fd0ssh",          rc_command,             CMD_FD0SSH},
-	{"fsck",            rc_command,             CMD_FSCK},
-	{"fusemount",       rc_command,             CMD_FUSEMOUNT},
-	{"fuseumount",      rc_command,             CMD_FUSEUMOUNT},
-	{"lclmount",        rc_command,             CMD_LCLMOUNT},
-	{"logout",          rc_logout,              CMD_NONE},
-	{"luserconf",       rc_luserconf,           CMD_NONE},
-	{"mkmountpoint",    rc_mkmountpoint,        CMD_NONE},
-	{"mntoptions",      rc_mntoptions,          CMD_NONE},
-	{"msg-authpw",      rc_string,              CMDA_AUTHPW},
-	{"msg-sessionpw",   rc_string,              CMDA_SESSIONPW},
-	{"nfsmount",        rc_command,             CMD_NFSMOUNT},
-	{"ncpmount",        rc_command,             CMD_NCPMOUNT},
-	{"ncpumount",       rc_command,             CMD_NCPUMOUNT},
-	{"ofl",             rc_command,             CMD_OFL},
-	{"path",            rc_string,              CMDA_PATH},
-	{"pmvarrun",        rc_command,             CMD_PMVARRUN},
-	{"smbmount",        rc_command,             CMD_SMBMOUNT},
-	{"smbumount",       rc_command,             CMD_SMBUMOUNT},
-	{"umount",          rc_command,             CMD_UMOUNT},
-	{"volume",          rc_volume,              CMD_NONE},
+	{"cifsmount",     rc_command,      CMD_CIFSMOUNT,   PMT_CONF_COMMANDS},
+	{"cryptmount",    rc_command,      CMD_CRYPTMOUNT,  PMT_CONF_COMMANDS},
+	{"cryptumount",   rc_command,      CMD_CRYPTUMOUNT, PMT_CONF_COMMANDS},
+	{"debug",         rc_debug,        CMD_NONE,        PMT_CONF_AUTH},
+	{"fd0ssh",        rc_command,      CMD_FD0SSH,      PMT_CONF_COMMANDS},
+	{"fsck",          rc_command,      CMD_FSCK,        PMT_CONF_COMMANDS},
+	{"fusemount",     rc_command,      CMD_FUSEMOUNT,   PMT_CONF_COMMANDS},
+	{"fuseumount",    rc_command,      CMD_FUSEUMOUNT,  PMT_CONF_COMMANDS},
+	{"lclmount",      rc_command,      CMD_LCLMOUNT,    PMT_CONF_COMMANDS},
+	{"linger",        rc_linger,       CMD_NONE,        PMT_CONF_SESSION},
+	{"logout",        rc_logout,       CMD_NONE,        PMT_CONF_SESSION},
+	{"luserconf",     rc_luserconf,    CMD_NONE,        PMT_CONF_SESSION},
+	{"metrics",       rc_metrics,      CMD_NONE,        PMT_CONF_SESSION},
+	{"mkmountpoint",  rc_mkmountpoint, CMD_NONE,        PMT_CONF_SESSION},
+	{"mntoptions",    rc_mntoptions,   CMD_NONE,        PMT_CONF_SESSION},
+	{"msg-authpw",    rc_string,       CMDA_AUTHPW,     PMT_CONF_AUTH},
+	{"msg-sessionpw", rc_string,       CMDA_SESSIONPW,  PMT_CONF_SESSION},
+	{"namespace",     rc_namespace,    CMD_NONE,        PMT_CONF_SESSION},
+	{"nfsmount",      rc_command,      CMD_NFSMOUNT,    PMT_CONF_COMMANDS},
+	{"ncpmount",      rc_command,      CMD_NCPMOUNT,    PMT_CONF_COMMANDS},
+	{"ncpumount",     rc_command,      CMD_NCPUMOUNT,   PMT_CONF_COMMANDS},
+	{"ofl",           rc_command,      CMD_OFL,         PMT_CONF_COMMANDS},
+	{"path",          rc_string,       CMDA_PATH,       PMT_CONF_SESSION},
+	{"pmvarrun",      rc_command,      CMD_PMVARRUN,    PMT_CONF_COMMANDS},
+	{"smbmount",      rc_command,      CMD_SMBMOUNT,    PMT_CONF_COMMANDS},
+	{"smbumount",     rc_command,      CMD_SMBUMOUNT,   PMT_CONF_COMMANDS},
+	{"speculative-unlock", rc_speculative_unlock, CMD_NONE,
+	 PMT_CONF_AUTH},
+	{"trace",         rc_trace,        CMD_NONE,        PMT_CONF_AUTH},
+	{"umount",        rc_command,      CMD_UMOUNT,      PMT_CONF_COMMANDS},
+	{"volume",        rc_volume,       CMD_NONE,        PMT_CONF_VOLUMES},
 	{NULL},
 };
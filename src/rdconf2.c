@@ -31,14 +31,14 @@
  * If so, return false.
  */
 static bool allow_ok(const struct HXmap *allowed,
-    const struct HXclist_head *options)
+    const struct kvplist *options)
 {
 	const struct kvp *kvp;
 
-	if (HXmap_find(allowed, "*") != NULL || options->items == 0)
+	if (HXmap_find(allowed, "*") != NULL || options->list.items == 0)
 		return true;
 
-	HXlist_for_each_entry(kvp, options, list)
+	HXlist_for_each_entry(kvp, &options->list, list)
 		if (HXmap_find(allowed, kvp->key) == NULL) {
 			l0g("option \"%s\" not allowed\n", kvp->key);
 			return false;
@@ -56,7 +56,7 @@ static bool allow_ok(const struct HXmap *allowed,
  * If so, returns true.
  */
 static bool required_ok(const struct HXmap *required,
-    const struct HXclist_head *options)
+    const struct kvplist *options)
 {
 	const struct HXmap_node *e;
 	struct HXmap_trav *t;
@@ -82,21 +82,33 @@ static bool required_ok(const struct HXmap *required,
  * @options:	options to check
  *
  * Checks @options whether any of them appear in @deny. If so, returns false.
+ * Both sides support constant-time lookup, so only the shorter one is
+ * walked.
  */
 static bool deny_ok(const struct HXmap *denied,
-    const struct HXclist_head *options)
+    const struct kvplist *options)
 {
 	const struct HXmap_node *e;
+	const struct kvp *kvp;
 	struct HXmap_trav *t;
 
 	if (denied->items == 0) {
 		w4rn("no denied options\n");
 		return true;
-	} else if (HXmap_find(denied, "*") != NULL && options->items != 0) {
+	} else if (HXmap_find(denied, "*") != NULL && options->list.items != 0) {
 		l0g("all mount options denied, user tried to specify one\n");
 		return false;
 	}
 
+	if (options->list.items < denied->items) {
+		HXlist_for_each_entry(kvp, &options->list, list)
+			if (HXmap_find(denied, kvp->key) != NULL) {
+				l0g("option \"%s\" denied\n", kvp->key);
+				return false;
+			}
+		return true;
+	}
+
 	if ((t = HXmap_travinit(denied, 0)) == NULL)
 		return false;
 
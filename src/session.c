@@ -0,0 +1,235 @@
+/*
+ *	Session bookkeeping shared by pam_mount and pmt-linger
+ *	Copyright Elvis Pfützenreuter <epx@conectiva.com>, 2000
+ *	Copyright Jan Engelhardt, 2005 - 2010
+ *	Copyright Bastian Kleineidam, 2005
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libHX/defs.h>
+#include <libHX/io.h>
+#include <libHX/proc.h>
+#include <libHX.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/**
+ * trace_setup - apply the <trace> setting
+ *
+ * The sink is also exported to helpers, so that mount.crypt can emit its
+ * own record (loop setup, device wait, dm-crypt) for the same login.
+ */
+void trace_setup(const struct config *config)
+{
+	ehd_trace_sink(config->trace);
+	if (config->trace != NULL)
+		setenv("_PMT_TRACE", config->trace, true);
+	else
+		unsetenv("_PMT_TRACE");
+}
+
+/**
+ * debug_setup - apply the <debug> setting
+ */
+void debug_setup(const struct config *config)
+{
+	/* reinitialize after @Debug may have changed */
+	if (ehd_logctl(EHD_LOGFT_DEBUG, EHD_LOG_GET))
+		ehd_logctl(EHD_LOGFT_DEBUG, EHD_LOG_UNSET);
+	if (config->debug)
+		ehd_logctl(EHD_LOGFT_DEBUG, EHD_LOG_SET);
+}
+
+/**
+ * read_luserconf - add the volumes of the user's own configuration file
+ * @config:	configuration, with the global file already expanded
+ *
+ * Returns false if the file was there but could not be used.
+ */
+bool read_luserconf(struct config *config)
+{
+	const char *file = config->luserconf;
+	unsigned long long t;
+	char cache[256];
+
+	if (file == NULL || *file == '\0' || !pmt_fileop_exists(file))
+		return true;
+	/* A cached copy saves the round trips to the home server. */
+	if (pmt_luserconf_lookup(config, cache, sizeof(cache)))
+		file = cache;
+	else
+		config->luserconf_update = true;
+	w4rn("going to readconfig %s\n", file);
+	if (file != cache && !pmt_fileop_owns(config->user, file)) {
+		w4rn("%s does not exist or is not owned by user\n", file);
+		return true;
+	}
+	t = ehd_trace_clock();
+	if (!readconfig(file, false, config, PMT_CONF_ALL))
+		return false;
+	ehd_trace_add(EHD_TRACE_CONFIG, "luserconf", t);
+	t = ehd_trace_clock();
+	if (!expandconfig(config)) {
+		l0g("error expanding configuration\n");
+		return false;
+	}
+	ehd_trace_add(EHD_TRACE_EXPAND, "luserconf", t);
+	return true;
+}
+
+/**
+ * modify_pm_count -
+ * @config:
+ * @user:
+ * @operation:	string specifying numerical increment
+ *
+ * Calls out to the `pmvarrun` helper utility to adjust the mount reference
+ * count in /var/run/pam_mount/@user for the specified user.
+ * Returns the new reference count value on success, or -1 on error.
+ *
+ * Note: Modified version of pam_console.c:use_count()
+ */
+int modify_pm_count(struct config *config, char *user,
+    char *operation)
+{
+	FILE *fp = NULL;
+	struct HXformat_map *vinfo;
+	struct HXdeque *argv;
+	struct HXproc proc;
+	unsigned long long t = ehd_trace_clock();
+	int ret = -1, use_count;
+
+	assert(user != NULL);
+	assert(operation != NULL);
+
+	if ((vinfo = HXformat_init()) == NULL)
+		goto out;
+	format_add(vinfo, "USER", user);
+	format_add(vinfo, "OPERATION", operation);
+	misc_add_ntdom(vinfo, user);
+
+	argv = arglist_build(config->command[CMD_PMVARRUN], vinfo);
+	memset(&proc, 0, sizeof(proc));
+	proc.p_flags = HXPROC_VERBOSE | HXPROC_STDOUT;
+	proc.p_ops   = &pmt_dropprivs_ops;
+	if ((ret = pmt_spawn_dq(argv, &proc)) <= 0) {
+		l0g("error executing pmvarrun: %s\n", strerror(-ret));
+		goto out;
+	}
+	ret = -1;
+	if ((fp = fdopen(proc.p_stdout, "r")) == NULL)
+		goto out2;
+	if (fscanf(fp, "%d", &use_count) != 1)
+		w4rn("error reading login count from pmvarrun\n");
+	else
+		w4rn("pmvarrun says login count is %d\n", use_count);
+ out2:
+	if (fp != NULL)
+		fclose(fp);
+	else
+		close(proc.p_stdout);
+	if (HXproc_wait(&proc) >= 0 && proc.p_exited && proc.p_status == 0)
+		ret = use_count;
+ out:
+	if (vinfo != NULL)
+		HXformat_free(vinfo);
+	ehd_trace_add(EHD_TRACE_REFCOUNT, operation, t);
+	return ret;
+}
+
+/**
+ * umount_session - unmount after the last session has ended
+ * @config:	configuration
+ *
+ * With <namespace>, the unmounting happens inside the user's namespace, and
+ * then the namespace itself is released, which takes care of any plain
+ * mounts without having to walk them one by one.
+ */
+void umount_session(struct config *config)
+{
+	bool in_ns = config->namespace && pmt_ns_enter(config->user, false);
+
+	umount_final(config, in_ns);
+	if (in_ns)
+		pmt_ns_release(config->user);
+}
+
+/**
+ * linger_name_ok - check that a user name can be part of a file name
+ *
+ * Same rule as for the luserconf cache: nothing that could leave
+ * RUNDIR/pam_mount or collide with a dotfile there.
+ */
+static bool linger_name_ok(const char *user)
+{
+	return *user != '\0' && *user != '.' && strchr(user, '/') == NULL;
+}
+
+/**
+ * linger_lock - open and lock the linger file of a user
+ * @user:	user whose volumes linger
+ * @flags:	extra open(2) flags (%O_CREAT)
+ *
+ * The file RUNDIR/pam_mount/@user.linger holds the token of the one
+ * lingering unmount that is still entitled to run; any other waiter that
+ * finds a different token (or none) has been superseded and gives up.
+ * Returns the locked fd, or -1.
+ */
+int linger_lock(const char *user, int flags)
+{
+	char path[256];
+	int fd;
+
+	if (!linger_name_ok(user)) {
+		w4rn("no linger timer for user name \"%s\"\n", user);
+		return -1;
+	}
+	snprintf(path, sizeof(path), RUNDIR "/pam_mount/%s.linger", user);
+	if (flags & O_CREAT)
+		HX_mkdir(RUNDIR "/pam_mount", S_IRUGO | S_IXUGO | S_IWUSR);
+	fd = open(path, O_RDWR | O_CLOEXEC | flags, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			l0g("could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (flock(fd, LOCK_EX) < 0) {
+		l0g("could not lock %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * linger_cancel - keep a lingering unmount from happening
+ * @user:	user who is logging in again
+ *
+ * Invalidates the token of a pending linger timer. Should its unmount already
+ * be underway, this waits for it to complete, so that the new session does
+ * not have its volumes pulled away right after process_volumes().
+ */
+void linger_cancel(const char *user)
+{
+	int fd;
+
+	if ((fd = linger_lock(user, 0)) < 0)
+		return;
+	if (ftruncate(fd, 0) < 0)
+		l0g("could not cancel linger timer: %s\n", strerror(errno));
+	close(fd);
+}
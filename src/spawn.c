@@ -6,8 +6,15 @@
  *	as published by the Free Software Foundation; either version 2.1
  *	of the License, or (at your option) any later version.
  */
+#define _GNU_SOURCE 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,12 +26,80 @@
 #include <libHX/string.h>
 #include <grp.h>
 #include <pwd.h>
+#ifdef __linux__
+#	include <sys/syscall.h>
+#endif
 #include "libcryptmount.h"
 #include "pam_mount.h"
 
+/*
+ * Raw syscalls for the credential switch in the child. With CLONE_VM, the
+ * glibc wrappers would try to broadcast the change to all threads of the
+ * parent's address space (which we share at that point).
+ */
+#ifdef __linux__
+#	ifdef SYS_setresuid32
+#		define PMT_SYS_SETGROUPS SYS_setgroups32
+#		define PMT_SYS_SETRESGID SYS_setresgid32
+#		define PMT_SYS_SETRESUID SYS_setresuid32
+#	else
+#		define PMT_SYS_SETGROUPS SYS_setgroups
+#		define PMT_SYS_SETRESGID SYS_setresgid
+#		define PMT_SYS_SETRESUID SYS_setresuid
+#	endif
+#endif
+
+/**
+ * struct pmt_spawn_ctx - state handed from the parent to the child
+ * @argv:	argument vector (argv[0] is resolved against <path>)
+ * @envp:	complete environment for the new program
+ * @exec_fd:	helper opened by pmt_exec_lookup(), or -1
+ * @exec_path:	absolute path of the helper (fallback if fexecve fails),
+ * 		or %NULL if it was not found
+ * @cred:	credentials to switch to, or %NULL to keep the current ones
+ * @dropprivs:	run the setsid/chdir/setuid preexec steps
+ * @fd:		file descriptors that become stdin/stdout/stderr, or -1
+ * @err:	errno of the failed step in the child, written through the
+ * 		shared address space (clone) and read by the parent
+ *
+ * Everything the child needs is prepared in the parent, so that the child
+ * does not have to allocate memory, take locks or ask NSS before exec.
+ */
+struct pmt_spawn_ctx {
+	const char *const *argv;
+	char *const *envp;
+	int exec_fd;
+	const char *exec_path;
+	const struct pmt_cred *cred;
+	bool dropprivs;
+	int fd[3];
+	volatile int err;
+};
+
+/**
+ * struct pmt_exec_entry - resolved helper program
+ * @name:	name as given in the command table (e.g. "mount")
+ * @path:	absolute path @name resolved to
+ * @dev, @ino:	identity of the file @fd refers to
+ * @fd:		descriptor of @path, kept open for fexecve
+ *
+ * Entries live only for the duration of one PAM call: they are opened when
+ * the configuration is loaded and closed again by pmt_exec_release().
+ */
+struct pmt_exec_entry {
+	char *name, *path;
+	dev_t dev;
+	ino_t ino;
+	int fd;
+};
+
 static pthread_mutex_t pmt_sigchld_lock = PTHREAD_MUTEX_INITIALIZER;
 static int pmt_sigchld_cleared = 0;
 static struct sigaction pmt_sigchld_old;
+static const char *pmt_spawn_path;
+static pthread_mutex_t pmt_exec_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pmt_exec_entry pmt_exec_cache[24];
+static unsigned int pmt_exec_count;
 
 /**
  * spawn_set_sigchld -
@@ -59,104 +134,670 @@ static void spawn_restore_sigchld(void *data)
 	pthread_mutex_unlock(&pmt_sigchld_lock);
 }
 
-int pmt_spawn_dq(struct HXdeque *argq, struct HXproc *proc)
+/**
+ * pmt_spawn_setpath -
+ * @path:	search path for helpers, or %NULL to use $PATH
+ *
+ * Sets the PATH that bare helper names are resolved against and that is
+ * passed in the environment of spawned helpers. On login, $PATH is usually
+ * ENV_ROOTPATH (from /etc/login.defs), while on logout, it happens to be
+ * ENV_PATH only, lacking /sbin. Unlike the former setenv() dance, the
+ * process environment itself is left alone. @path must stay valid until it
+ * is unset.
+ */
+void pmt_spawn_setpath(const char *path)
+{
+	pmt_spawn_path = path;
+}
+
+/**
+ * spawn_which -
+ * @name:	program name
+ * @search:	colon-separated list of directories
+ *
+ * Looks for an executable @name in @search and returns the full path
+ * (to be freed by the caller), or %NULL.
+ */
+static char *spawn_which(const char *name, const char *search)
+{
+	hxmc_t *buf = NULL;
+	const char *dir, *end;
+
+	if (search == NULL)
+		search = PMT_DFL_PATH;
+	for (dir = search; ; dir = end + 1) {
+		end = strchr(dir, ':');
+		if (end == NULL)
+			end = dir + strlen(dir);
+		if (end != dir) {
+			if (HXmc_memcpy(&buf, dir, end - dir) == NULL ||
+			    HXmc_strcat(&buf, "/") == NULL ||
+			    HXmc_strcat(&buf, name) == NULL)
+				break;
+			if (access(buf, X_OK) == 0) {
+				char *ret = HX_strdup(buf);
+				HXmc_free(buf);
+				return ret;
+			}
+		}
+		if (*end == '\0')
+			break;
+	}
+	HXmc_free(buf);
+	return NULL;
+}
+
+/**
+ * exec_entry_open -
+ * @e:	cache entry with @e->path set
+ *
+ * (Re)opens @e->path and records its identity. Returns false if it is not
+ * a regular executable file.
+ */
+static bool exec_entry_open(struct pmt_exec_entry *e)
+{
+	struct stat sb;
+#ifdef O_PATH
+	int fd = open(e->path, O_PATH | O_CLOEXEC);
+#else
+	int fd = open(e->path, O_RDONLY | O_CLOEXEC);
+#endif
+
+	if (e->fd >= 0) {
+		close(e->fd);
+		e->fd = -1;
+	}
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+	    !(sb.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+		close(fd);
+		return false;
+	}
+	e->dev = sb.st_dev;
+	e->ino = sb.st_ino;
+	e->fd  = fd;
+	return true;
+}
+
+static struct pmt_exec_entry *exec_cache_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < pmt_exec_count; ++i)
+		if (strcmp(pmt_exec_cache[i].name, name) == 0)
+			return &pmt_exec_cache[i];
+	return NULL;
+}
+
+/**
+ * exec_cache_set -
+ * @name:	program name
+ * @search:	search path for bare names
+ *
+ * Resolves @name and stores the result in the cache. The caller must hold
+ * @pmt_exec_lock. Returns the entry, or %NULL if @name could not be found
+ * or the cache is full.
+ */
+static struct pmt_exec_entry *
+exec_cache_set(const char *name, const char *search)
+{
+	struct pmt_exec_entry *e;
+	char *path;
+
+	path = (strchr(name, '/') != NULL) ? HX_strdup(name) :
+	       spawn_which(name, search);
+	if (path == NULL)
+		return NULL;
+	e = exec_cache_find(name);
+	if (e != NULL && strcmp(e->path, path) == 0) {
+		free(path);
+		return exec_entry_open(e) ? e : NULL;
+	}
+	if (e == NULL) {
+		if (pmt_exec_count == ARRAY_SIZE(pmt_exec_cache) ||
+		    (name = HX_strdup(name)) == NULL) {
+			free(path);
+			return NULL;
+		}
+		e = &pmt_exec_cache[pmt_exec_count++];
+		e->name = const_cast1(char *, name);
+		e->fd   = -1;
+	} else {
+		free(e->path);
+	}
+	e->path = path;
+	return exec_entry_open(e) ? e : NULL;
+}
+
+/**
+ * pmt_exec_register -
+ * @name:	program name, either bare or an absolute path
+ * @search:	search path for bare names
+ *
+ * Resolves @name once and keeps an open descriptor to it, so that later
+ * spawns need neither a $PATH walk nor the path lookup in the kernel. This
+ * is called at config load time for the command table; the descriptors are
+ * closed again by pmt_exec_release() at the end of the PAM call. Returns
+ * false if @name could not be resolved.
+ */
+bool pmt_exec_register(const char *name, const char *search)
 {
-	char **argv = reinterpret_cast(char **, HXdeque_to_vec(argq, NULL));
-	const struct HXdeque_node *n;
 	bool ret;
 
-	ret = HXproc_run_async(const_cast2(const char * const *, argv), proc);
-	free(argv);
-	for (n = argq->first; n != NULL; n = n->next)
-		HXmc_free(n->ptr);
-	HXdeque_free(argq);
+	pthread_mutex_lock(&pmt_exec_lock);
+	ret = exec_cache_set(name, search) != NULL;
+	pthread_mutex_unlock(&pmt_exec_lock);
 	return ret;
 }
 
-static void initgroups2(const char *user, const struct passwd *real_user)
+/**
+ * pmt_exec_release -
+ *
+ * Closes the descriptors of the exec cache and forgets the entries. This is
+ * called whenever a PAM call is done with its configuration, so that no
+ * descriptor is left behind in the host process between calls.
+ */
+void pmt_exec_release(void)
 {
+	unsigned int i;
+
+	pthread_mutex_lock(&pmt_exec_lock);
+	for (i = 0; i < pmt_exec_count; ++i) {
+		struct pmt_exec_entry *e = &pmt_exec_cache[i];
+
+		if (e->fd >= 0)
+			close(e->fd);
+		free(e->name);
+		free(e->path);
+	}
+	memset(pmt_exec_cache, 0, sizeof(pmt_exec_cache));
+	pmt_exec_count = 0;
+	pthread_mutex_unlock(&pmt_exec_lock);
+}
+
+/**
+ * exec_entry_valid -
+ * @e:	cache entry
+ *
+ * Checks that the file at @e->path is still the one we have open.
+ */
+static bool exec_entry_valid(const struct pmt_exec_entry *e)
+{
+	struct stat sb;
+
+	return e->fd >= 0 && stat(e->path, &sb) == 0 &&
+	       sb.st_dev == e->dev && sb.st_ino == e->ino;
+}
+
+/**
+ * pmt_exec_lookup -
+ * @name:	program name
+ * @path:	result pointer for the absolute path
+ *
+ * Finds @name in the exec cache (adding it if needed) and checks that the
+ * file at the recorded path is still the one we have open, reopening it
+ * otherwise (e.g. after a package update). On success, returns a duplicate
+ * of the cached descriptor and a copy of the path in *@path, both owned by
+ * the caller. If the cache is full, only *@path is set. Returns -1 and sets
+ * *@path to %NULL if @name is not found in the search path.
+ */
+static int pmt_exec_lookup(const char *name, char **path)
+{
+	const char *search = (pmt_spawn_path != NULL) ?
+	                     pmt_spawn_path : getenv("PATH");
+	struct pmt_exec_entry *e;
+	int fd = -1;
+
+	*path = NULL;
+	pthread_mutex_lock(&pmt_exec_lock);
+	e = exec_cache_find(name);
+	if (e == NULL)
+		e = exec_cache_set(name, search);
+	else if (!exec_entry_valid(e) && !exec_entry_open(e))
+		e = NULL;
+	if (e != NULL) {
+		fd = fcntl(e->fd, F_DUPFD_CLOEXEC, 3);
+		*path = HX_strdup(e->path);
+	}
+	pthread_mutex_unlock(&pmt_exec_lock);
+	if (e == NULL)
+		*path = (strchr(name, '/') != NULL) ? HX_strdup(name) :
+		        spawn_which(name, search);
+	return fd;
+}
+
+/**
+ * pmt_cred_resolve -
+ * @cred:	credential block to fill
+ * @user:	user to look up
+ *
+ * Resolves UID, GID, the supplementary group list, home directory and the
+ * canonical name of @user. This is done in the parent, once, so that the
+ * forked child never needs to do NSS lookups (which can be slow, and may
+ * deadlock when the host process was multi-threaded at the time of fork).
+ *
+ * The group list is composed like initgroups(3) would do it, plus the
+ * groups the current process already has.
+ */
+bool pmt_cred_resolve(struct pmt_cred *cred, const char *user)
+{
+	const struct passwd *pe;
 #if defined(HAVE_GETGROUPLIST) && defined(HAVE_GETGROUPS) && \
     defined(HAVE_SETGROUPS)
-	int ngrps, maxgrps, tmp_ngrps;
-	gid_t *groups;
+	int maxgrps, ngrps, tmp_ngrps;
+#endif
 
+	memset(cred, 0, sizeof(*cred));
+	if ((pe = getpwnam(user)) == NULL) {
+		l0g("could not get passwd entry for user %s\n", user);
+		return false;
+	}
+	cred->uid  = pe->pw_uid;
+	cred->gid  = pe->pw_gid;
+	cred->home = HX_strdup(pe->pw_dir);
+	cred->name = HX_strdup(pe->pw_name);
+	if (cred->home == NULL || cred->name == NULL)
+		goto out;
+
+#if defined(HAVE_GETGROUPLIST) && defined(HAVE_GETGROUPS) && \
+    defined(HAVE_SETGROUPS)
 	maxgrps = sysconf(_SC_NGROUPS_MAX);
 	if (maxgrps < 0)
 		maxgrps = 64;
-	groups = malloc(maxgrps * sizeof(gid_t));
-	if (groups == NULL)
-		return;
+	cred->groups = malloc(maxgrps * sizeof(gid_t));
+	if (cred->groups == NULL)
+		goto out;
 	ngrps = maxgrps;
-	if (getgrouplist(user, real_user->pw_gid, groups, &ngrps) < 0)
+	if (getgrouplist(user, cred->gid, cred->groups, &ngrps) < 0)
 		ngrps = 0;
 	else
 		maxgrps -= ngrps;
-	tmp_ngrps = getgroups(maxgrps, &groups[ngrps]);
+	tmp_ngrps = getgroups(maxgrps, &cred->groups[ngrps]);
 	if (tmp_ngrps > 0)
 		ngrps += tmp_ngrps;
-	if (setgroups(ngrps, groups) < 0)
-		l0g("could not load groups for user %s\n", user);
-	free(groups);
+	cred->ngroups = ngrps;
+#else
+	cred->ngroups = -1;
 #endif
+	return true;
+
+ out:
+	l0g("%s: %s\n", __func__, strerror(errno));
+	pmt_cred_free(cred);
+	return false;
+}
+
+void pmt_cred_free(struct pmt_cred *cred)
+{
+	free(cred->groups);
+	free(cred->home);
+	free(cred->name);
+	memset(cred, 0, sizeof(*cred));
+}
+
+static hxmc_t *spawn_env_var(const char *key, const char *value)
+{
+	hxmc_t *s = HXmc_strinit(key);
+
+	if (s == NULL)
+		return NULL;
+	if (HXmc_strcat(&s, "=") == NULL || HXmc_strcat(&s, value) == NULL) {
+		HXmc_free(s);
+		return NULL;
+	}
+	return s;
 }
+
 /**
- * set_myuid -
- * @user:	switch to specified user
- *
- * set_myuid() is called in the child process as a result of the 
- * spawn_start() fork, before exec() will take place.
+ * spawn_build_env -
+ * @cred:	user credentials, may be %NULL
+ * @extra:	array of at least 4 slots for the overriding variables
  *
- * If @users is %NULL, the UID is changed to root. (In most cases, we are
- * already root, though.)
+ * Returns a copy of the current environment vector, with HOME and USER
+ * replaced by those of @cred (a bonus for FUSE daemons), and PATH replaced by
+ * the one set with pmt_spawn_setpath(). The strings themselves are shared
+ * with @environ, except for the overrides, which are recorded in @extra and
+ * released by spawn_free_env().
+ */
+static char **spawn_build_env(const struct pmt_cred *cred, hxmc_t **extra)
+{
+	unsigned int n = 0, k = 0, i, nextra = 0;
+	char **env, *const *p;
+
+	if (pmt_spawn_path != NULL &&
+	    (extra[nextra++] = spawn_env_var("PATH", pmt_spawn_path)) == NULL)
+		goto out;
+	if (cred != NULL) {
+		if ((extra[nextra++] = spawn_env_var("HOME", cred->home)) == NULL ||
+		    (extra[nextra++] = spawn_env_var("USER", cred->name)) == NULL)
+			goto out;
+	}
+	extra[nextra] = NULL;
+
+	for (p = environ; *p != NULL; ++p)
+		++n;
+	if ((env = calloc(n + nextra + 1, sizeof(char *))) == NULL)
+		goto out;
+	for (p = environ; *p != NULL; ++p) {
+		for (i = 0; i < nextra; ++i)
+			if (strncmp(*p, extra[i], strchr(extra[i], '=') -
+			    extra[i] + 1) == 0)
+				break;
+		if (i == nextra)
+			env[k++] = *p;
+	}
+	for (i = 0; i < nextra; ++i)
+		env[k++] = extra[i];
+	return env;
+
+ out:
+	while (nextra > 0)
+		HXmc_free(extra[--nextra]);
+	extra[0] = NULL;
+	return NULL;
+}
+
+static void spawn_free_env(char **env, hxmc_t **extra)
+{
+	unsigned int i;
+
+	for (i = 0; extra[i] != NULL; ++i)
+		HXmc_free(extra[i]);
+	free(env);
+}
+
+/**
+ * spawn_child_creds -
  *
- * If @user is not %NULL, the UID of the current process is changed to that of
- * @user. Also, as a bonus for FUSE daemons, we set the HOME and USER
- * environment variables. setsid() is called so that FUSE daemons (e.g. sshfs)
- * get a new session identifier and do not get killed by the login program
- * after PAM authentication is successful.
+ * Part of the child's preexec. setsid() is called so that FUSE daemons
+ * (e.g. sshfs) get a new session identifier and do not get killed by the
+ * login program after PAM authentication is successful. chdir("/") is called
+ * so that fusermount does not get stuck in a non-readable directory (by means
+ * of doing `su - unprivilegeduser`).
  *
- * chdir("/") is called so that fusermount does not get stuck in a
- * non-readable directory (by means of doing `su - unprivilegeduser`)
+ * Without @ctx->cred, the UID is (re)set to root, otherwise the process
+ * assumes the user's identity. Only async-signal-safe calls are made.
  */
-static void set_myuid(void *data)
+static int spawn_child_creds(const struct pmt_spawn_ctx *ctx)
 {
-	const char *user = data;
+	const struct pmt_cred *cred = ctx->cred;
 
 	setsid();
 	if (chdir("/") < 0)
 		;
-	if (user == NULL) {
-		if (setuid(0) < 0) {
-			l0g("error setting uid to 0: %s\n", strerror(errno));
-			return;
-		}
-	} else {
-		/* Set UID and GID to the user's one */
-		const struct passwd *real_user;
-		w4rn("setting uid to user %s\n", user);
-		if ((real_user = getpwnam(user)) == NULL) {
-			l0g("could not get passwd entry for user %s\n", user);
-			return;
+#ifdef __linux__
+	if (cred == NULL)
+		return syscall(PMT_SYS_SETRESUID, 0, 0, -1) < 0 ? -errno : 0;
+	/* A failing setgroups was never fatal. */
+	if (cred->ngroups >= 0)
+		syscall(PMT_SYS_SETGROUPS, cred->ngroups, cred->groups);
+	if (syscall(PMT_SYS_SETRESGID, cred->gid, cred->gid, cred->gid) < 0 ||
+	    syscall(PMT_SYS_SETRESUID, cred->uid, cred->uid, cred->uid) < 0)
+		return -errno;
+#else
+	if (cred == NULL)
+		return setuid(0) < 0 ? -errno : 0;
+#if defined(HAVE_SETGROUPS)
+	if (cred->ngroups >= 0)
+		setgroups(cred->ngroups, cred->groups);
+#endif
+	if (setgid(cred->gid) < 0 || setuid(cred->uid) < 0)
+		return -errno;
+#endif
+	return 0;
+}
+
+/**
+ * spawn_child -
+ * @arg:	struct pmt_spawn_ctx
+ *
+ * Runs in the child, which may share the address space with the parent.
+ * Reports the errno of the failing step through @ctx->err.
+ */
+static int spawn_child(void *arg)
+{
+	struct pmt_spawn_ctx *ctx = arg;
+	struct sigaction sa;
+	sigset_t set;
+	int i, ret;
+
+	/* Parent's handlers must not run in our (shared) address space. */
+	memset(&sa, 0, sizeof(sa));
+	for (i = 1; i < NSIG; ++i) {
+		if (sigaction(i, NULL, &sa) < 0 ||
+		    sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL)
+			continue;
+		sa.sa_handler = SIG_DFL;
+		sa.sa_flags   = 0;
+		sigaction(i, &sa, NULL);
+	}
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	if (ctx->dropprivs) {
+		ret = spawn_child_creds(ctx);
+		if (ret < 0) {
+			ctx->err = -ret;
+			_exit(127);
 		}
-		initgroups2(user, real_user);
-		if (setgid(real_user->pw_gid) == -1) {
-			l0g("could not set gid to %ld\n",
-			    static_cast(long, real_user->pw_gid));
-			return;
+	}
+	for (i = 0; i < 3; ++i) {
+		if (ctx->fd[i] < 0)
+			continue;
+		if (ctx->fd[i] == i)
+			ret = fcntl(i, F_SETFD, 0);
+		else
+			ret = dup2(ctx->fd[i], i);
+		if (ret < 0) {
+			ctx->err = errno;
+			_exit(127);
 		}
-		if (setuid(real_user->pw_uid) == -1) {
-			l0g("could not set uid to %ld\n",
-			    static_cast(long, real_user->pw_uid));
-			return;
+	}
+	if (ctx->exec_fd >= 0)
+		fexecve(ctx->exec_fd, const_cast2(char * const *, ctx->argv),
+		        ctx->envp);
+	/* fexecve fails for scripts opened with O_CLOEXEC; retry by name. */
+	if (ctx->exec_path == NULL) {
+		/* not in the configured <path> */
+		ctx->err = ENOENT;
+		_exit(127);
+	}
+	execve(ctx->exec_path, const_cast2(char * const *, ctx->argv),
+	       ctx->envp);
+	ctx->err = errno;
+	_exit(127);
+}
+
+/**
+ * spawn_launch -
+ * @ctx:	prepared child state
+ *
+ * Starts the child. On Linux, this is done with clone(CLONE_VM|CLONE_VFORK)
+ * on a small private stack, so that the (possibly huge) address space of the
+ * PAM-hosting process does not need to be copied, and the parent learns
+ * about exec failures synchronously. Returns the PID or negative errno.
+ */
+static pid_t spawn_launch(struct pmt_spawn_ctx *ctx)
+{
+	sigset_t all, old;
+	pid_t pid;
+#ifdef __linux__
+	static const size_t stack_size = 128 * 1024;
+	void *stack;
+
+	stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE,
+	        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED)
+		return -errno;
+#endif
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ctx->err = 0;
+#ifdef __linux__
+	/* Stack grows down on all Linux platforms we care about. */
+	pid = clone(spawn_child, static_cast(char *, stack) + stack_size,
+	      CLONE_VM | CLONE_VFORK | SIGCHLD, ctx);
+	if (pid < 0)
+		pid = -errno;
+	munmap(stack, stack_size);
+#else
+	pid = fork();
+	if (pid == 0)
+		spawn_child(ctx);
+	else if (pid < 0)
+		pid = -errno;
+#endif
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (pid > 0 && ctx->err != 0) {
+		/* Child failed before (or in) exec - collect it. */
+		waitpid(pid, NULL, 0);
+		pid = -ctx->err;
+	}
+	return pid;
+}
+
+static void spawn_close_pipes(int (*pfd)[2])
+{
+	unsigned int i;
+
+	for (i = 0; i < 3; ++i) {
+		if (pfd[i][0] >= 0)
+			close(pfd[i][0]);
+		if (pfd[i][1] >= 0)
+			close(pfd[i][1]);
+	}
+}
+
+/**
+ * pmt_spawn_vec -
+ * @argv:	argument vector
+ * @proc:	process control block
+ *
+ * Replacement for HXproc_run_async(), understanding the HXPROC_VERBOSE,
+ * HXPROC_STD{IN,OUT,ERR} and HXPROC_NULL_STD{IN,OUT,ERR} flags. On return,
+ * @proc is filled such that HXproc_wait() can be used as usual.
+ *
+ * If @proc->p_ops is &pmt_dropprivs_ops, @proc->p_data names the user to
+ * run as (or %NULL for root); the credentials are resolved here, in the
+ * parent. Returns positive non-zero on success, or negative errno.
+ */
+int pmt_spawn_vec(const char *const *argv, struct HXproc *proc)
+{
+	struct pmt_spawn_ctx ctx = {.argv = argv};
+	struct pmt_cred cred, *credp = NULL;
+	unsigned long long t = ehd_trace_clock();
+	char *exec_path;
+	int pfd[3][2] = {{-1, -1}, {-1, -1}, {-1, -1}};
+	unsigned int i;
+	hxmc_t *env_extra[4] = {NULL};
+	char **envp;
+	pid_t pid;
+	int ret;
+
+	proc->p_stdin = proc->p_stdout = proc->p_stderr = -1;
+	ctx.dropprivs = proc->p_ops == &pmt_dropprivs_ops;
+	if (ctx.dropprivs && proc->p_data != NULL) {
+		w4rn("setting uid to user %s\n",
+		     static_cast(const char *, proc->p_data));
+		if (!pmt_cred_resolve(&cred, proc->p_data))
+			return -ESRCH;
+		credp = &cred;
+	}
+	ctx.cred = credp;
+	if ((envp = spawn_build_env(credp, env_extra)) == NULL) {
+		ret = -errno;
+		goto out_cred;
+	}
+	ctx.envp = envp;
+	ctx.exec_fd = pmt_exec_lookup(*argv, &exec_path);
+	ctx.exec_path = exec_path;
+
+	for (i = 0; i < 3; ++i) {
+		ctx.fd[i] = -1;
+		if (proc->p_flags & (HXPROC_STDIN << i)) {
+			if (pipe2(pfd[i], O_CLOEXEC) < 0)
+				goto out_errno;
+			/* stdin: child reads [0]; stdout/err: child writes [1] */
+			ctx.fd[i] = pfd[i][i == 0 ? 0 : 1];
+		} else if (proc->p_flags & (HXPROC_NULL_STDIN << i)) {
+			pfd[i][0] = open("/dev/null", (i == 0 ? O_RDONLY :
+			            O_WRONLY) | O_CLOEXEC);
+			if (pfd[i][0] < 0)
+				goto out_errno;
+			ctx.fd[i] = pfd[i][0];
 		}
-		setenv("HOME", real_user->pw_dir, 1);
-		setenv("USER", real_user->pw_name, 1);
 	}
+
+	if (proc->p_ops != NULL && proc->p_ops->p_prefork != NULL)
+		proc->p_ops->p_prefork(proc->p_data);
+	pid = spawn_launch(&ctx);
+	/* Setup cost up to the exec; the run time is the caller's to record. */
+	ehd_trace_add(EHD_TRACE_SPAWN, HX_basename(*argv), t);
+	if (pid < 0) {
+		ret = pid;
+		if (proc->p_flags & HXPROC_VERBOSE)
+			fprintf(stderr, "%s: %s: %s\n", __func__,
+			        *argv, strerror(-ret));
+		if (proc->p_ops != NULL && proc->p_ops->p_complete != NULL)
+			proc->p_ops->p_complete(proc->p_data);
+		goto out;
+	}
+
+	proc->p_pid = pid;
+	for (i = 0; i < 3; ++i) {
+		int *parent_end = (i == 0) ? &proc->p_stdin :
+		                  (i == 1) ? &proc->p_stdout : &proc->p_stderr;
+
+		if (!(proc->p_flags & (HXPROC_STDIN << i)))
+			continue;
+		*parent_end = pfd[i][i == 0 ? 1 : 0];
+		/* Keep our end open; do not close it below. */
+		pfd[i][i == 0 ? 1 : 0] = -1;
+	}
+	ret = 1;
+	goto out;
+
+ out_errno:
+	ret = -errno;
+ out:
+	spawn_close_pipes(pfd);
+	if (ctx.exec_fd >= 0)
+		close(ctx.exec_fd);
+	free(exec_path);
+	spawn_free_env(envp, env_extra);
+ out_cred:
+	if (credp != NULL)
+		pmt_cred_free(credp);
+	return ret;
 }
 
+int pmt_spawn_dq(struct HXdeque *argq, struct HXproc *proc)
+{
+	char **argv = reinterpret_cast(char **, HXdeque_to_vec(argq, NULL));
+	const struct HXdeque_node *n;
+	int ret;
+
+	if (argv == NULL)
+		ret = -errno;
+	else
+		ret = pmt_spawn_vec(const_cast2(const char * const *, argv),
+		      proc);
+	free(argv);
+	for (n = argq->first; n != NULL; n = n->next)
+		HXmc_free(n->ptr);
+	HXdeque_free(argq);
+	return ret;
+}
+
+/*
+ * The credential switch formerly done in a p_postfork hook is now part of
+ * pmt_spawn_vec(), which recognizes this ops block by address.
+ */
 const struct HXproc_ops pmt_dropprivs_ops = {
 	.p_prefork  = spawn_set_sigchld,
-	.p_postfork = set_myuid,
 	.p_complete = spawn_restore_sigchld,
 };
 
@@ -0,0 +1,209 @@
+/*
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <libHX/defs.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/**
+ * struct ehd_trace_ent - one timed stage
+ * @start:	offset from the begin of the record, in ns
+ * @dur:	duration, in ns
+ * @label:	volume, program, etc. (truncated)
+ */
+struct ehd_trace_ent {
+	unsigned long long start, dur;
+	enum ehd_trace_stage stage;
+	char label[40];
+};
+
+/**
+ * @active:	a record is being collected
+ * @sink:	"syslog", or a file to append to; empty if disabled
+ * @tag:	what the record is about, e.g. "open_session user=joe"
+ * @dropped:	number of entries that did not fit
+ */
+static struct {
+	bool active;
+	char sink[256], tag[96];
+	unsigned long long t0;
+	unsigned int count, dropped;
+	struct ehd_trace_ent ent[64];
+} ehd_trace;
+
+static const char *const ehd_trace_names[] = {
+	[EHD_TRACE_CONFIG]     = "config",
+	[EHD_TRACE_EXPAND]     = "expand",
+	[EHD_TRACE_SANITY]     = "sanity",
+	[EHD_TRACE_MOUNTCHECK] = "mounted",
+	[EHD_TRACE_SPAWN]      = "spawn",
+	[EHD_TRACE_HELPER]     = "helper",
+	[EHD_TRACE_FSCK]       = "fsck",
+	[EHD_TRACE_LOOP]       = "loop",
+	[EHD_TRACE_CRYPT]      = "crypt",
+	[EHD_TRACE_DEVWAIT]    = "devwait",
+	[EHD_TRACE_REFCOUNT]   = "refcount",
+	[EHD_TRACE_CRYPTLOAD]  = "cryptload",
+	[EHD_TRACE_KDF]        = "kdf",
+	[EHD_TRACE_ACTIVATE]   = "activate",
+	[EHD_TRACE_UNLOCK]     = "kdf+activate",
+};
+
+/**
+ * ehd_trace_clock - monotonic timestamp in nanoseconds
+ */
+EXPORT_SYMBOL unsigned long long ehd_trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast(unsigned long long, ts.tv_sec) * 1000000000ULL +
+	       ts.tv_nsec;
+}
+
+/**
+ * ehd_trace_sink - set destination for trace records
+ * @sink:	"syslog" (which ends up in the journal on systemd hosts),
+ * 		an absolute file name, or %NULL/"" to disable tracing
+ */
+EXPORT_SYMBOL void ehd_trace_sink(const char *sink)
+{
+	if (sink == NULL)
+		sink = "";
+	HX_strlcpy(ehd_trace.sink, sink, sizeof(ehd_trace.sink));
+}
+
+/**
+ * ehd_trace_begin - start a new record
+ * @tag:	description of the operation
+ *
+ * Stages are collected even before the sink is known (it usually comes from
+ * the configuration file, whose parsing is itself a stage), and only
+ * formatted in ehd_trace_end(). The sink is always set explicitly by the
+ * program; the library does not look at the environment, since it also runs
+ * inside PAM clients whose environment the user controls.
+ */
+EXPORT_SYMBOL void ehd_trace_begin(const char *tag)
+{
+	HX_strlcpy(ehd_trace.tag, tag, sizeof(ehd_trace.tag));
+	ehd_trace.count   = 0;
+	ehd_trace.dropped = 0;
+	ehd_trace.t0      = ehd_trace_clock();
+	ehd_trace.active  = true;
+}
+
+/**
+ * ehd_trace_add - record a completed stage
+ * @stage:	stage identifier
+ * @label:	volume, program, etc.; may be %NULL
+ * @start:	timestamp from ehd_trace_clock() when the stage began
+ */
+EXPORT_SYMBOL void ehd_trace_add(enum ehd_trace_stage stage,
+    const char *label, unsigned long long start)
+{
+	unsigned long long now = ehd_trace_clock();
+	struct ehd_trace_ent *e;
+	char *p;
+
+	if (!ehd_trace.active)
+		return;
+	if (ehd_trace.count >= ARRAY_SIZE(ehd_trace.ent)) {
+		++ehd_trace.dropped;
+		return;
+	}
+	e = &ehd_trace.ent[ehd_trace.count++];
+	e->stage = stage;
+	e->start = (start > ehd_trace.t0) ? start - ehd_trace.t0 : 0;
+	e->dur   = now - start;
+	if (label == NULL)
+		*e->label = '\0';
+	else
+		HX_strlcpy(e->label, label, sizeof(e->label));
+	/* Keep the record splittable on whitespace and '='. */
+	for (p = e->label; *p != '\0'; ++p)
+		if (*p == ' ' || *p == '=' || *p == '\n')
+			*p = '_';
+}
+
+static void ehd_trace_write(const char *line, size_t len)
+{
+	int fd;
+
+	if (strcmp(ehd_trace.sink, "syslog") == 0) {
+		syslog(LOG_AUTH | LOG_INFO, "%.*s",
+		       static_cast(int, len - 1), line);
+		return;
+	}
+	fd = open(ehd_trace.sink, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	     S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		l0g("trace: could not open %s: %s\n", ehd_trace.sink,
+		    strerror(errno));
+		return;
+	}
+	/* One write(2) with O_APPEND keeps concurrent records intact. */
+	if (write(fd, line, len) < 0)
+		l0g("trace: write %s: %s\n", ehd_trace.sink, strerror(errno));
+	close(fd);
+}
+
+/**
+ * ehd_trace_end - finish and emit the record
+ * @result:	outcome of the operation (PAM code, exit status, ...)
+ *
+ * The record is one line of the form
+ * 	trace <tag> rc=<result> total=<us> <stage>[:<label>]@<start>=<dur> ...
+ * with all times in microseconds relative to ehd_trace_begin().
+ */
+EXPORT_SYMBOL void ehd_trace_end(int result)
+{
+	char line[4096];
+	const struct ehd_trace_ent *e;
+	unsigned int i;
+	size_t pos;
+	int ret;
+
+	if (!ehd_trace.active)
+		return;
+	ehd_trace.active = false;
+	if (*ehd_trace.sink == '\0')
+		return;
+
+	ret = snprintf(line, sizeof(line), "trace %s pid=%u rc=%d total=%llu",
+	      ehd_trace.tag, static_cast(unsigned int, getpid()), result,
+	      (ehd_trace_clock() - ehd_trace.t0) / 1000);
+	pos = (ret < 0) ? 0 : ret;
+	for (i = 0; i < ehd_trace.count && pos < sizeof(line); ++i) {
+		e = &ehd_trace.ent[i];
+		ret = snprintf(&line[pos], sizeof(line) - pos, " %s%s%s@%llu=%llu",
+		      ehd_trace_names[e->stage], (*e->label != '\0') ? ":" : "",
+		      e->label, e->start / 1000, e->dur / 1000);
+		if (ret > 0)
+			pos += ret;
+	}
+	if (ehd_trace.dropped > 0 && pos < sizeof(line)) {
+		ret = snprintf(&line[pos], sizeof(line) - pos, " dropped=%u",
+		      ehd_trace.dropped);
+		if (ret > 0)
+			pos += ret;
+	}
+	if (pos > sizeof(line) - 2)
+		pos = sizeof(line) - 2;
+	line[pos++] = '\n';
+	line[pos] = '\0';
+	ehd_trace_write(line, pos);
+}
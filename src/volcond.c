@@ -0,0 +1,594 @@
+/*
+ *	Volume conditions, compiled
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <errno.h>
+#include <grp.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/parser.h>
+#include <libHX/defs.h>
+#include <libHX/libxml_helper.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+/*
+ * The user control attributes and elements of a <volume> are turned into a
+ * flat array of instructions in prefix order, each knowing the size of its
+ * subtree, so that evaluation needs neither the DOM nor any allocation and
+ * can still short-circuit exactly like the element semantics demand. What
+ * the conditions look at about the user comes from struct pmt_userinfo;
+ * the secondary groups are resolved there on first use, once, instead of
+ * by every <sgrp>.
+ *
+ * Configuration errors become %COND_ERROR instructions, which evaluate to
+ * -1 and log only when they are reached, as before.
+ *
+ * When asked about any service (@service is %NULL), a <service> element is
+ * neither true nor false but %COND_MAYBE, and the operators combine that in
+ * three-valued logic; <not><service> is then "maybe" as well, rather than
+ * the "never" that treating the element as a plain match would give. A
+ * volume is taken to apply if its condition comes out as "maybe".
+ */
+#define COND_MAYBE 2
+
+enum cond_op {
+	COND_ERROR,
+	COND_FALSE,
+	/* root: service filter, then @nargs (simple, and) */
+	COND_VOLUME,
+	/* simple attributes: all children, no short-circuit */
+	COND_SIMPLE,
+	COND_AND,
+	COND_OR,
+	COND_XOR,
+	COND_NOT,
+	COND_USER,
+	COND_NONROOT,
+	COND_UID,
+	COND_GID,
+	COND_PGRP,
+	COND_SGRP,
+	COND_SERVICE,
+};
+
+/**
+ * struct cond_insn - one node of a condition
+ * @len:	number of instructions in this subtree, including itself
+ * @nargs:	number of direct children (which follow right after)
+ * @flag:	%COND_SIMPLE: invert; %COND_VOLUME: has child nodes
+ * @icase, @regex: matching mode for names
+ * @lo, @hi:	ID range for %COND_UID, %COND_GID
+ * @str:	name or pattern; error message (may be %NULL)
+ */
+struct cond_insn {
+	unsigned char op;
+	bool icase, regex, flag;
+	unsigned int len, nargs;
+	unsigned long lo, hi;
+	const char *str;
+};
+
+struct pmt_cond {
+	unsigned int count;
+	bool has_service;
+	struct cond_insn insn[];
+};
+
+struct cond_builder {
+	struct pmt_arena *arena;
+	struct cond_insn *insn;
+	unsigned int count, alloc;
+	bool has_service, oom;
+};
+
+struct cond_ctx {
+	struct config *config;
+	struct pmt_userinfo *ui;
+	const char *service;
+};
+
+static void cond_compile_elem(struct cond_builder *, xmlNode *);
+
+static unsigned int cond_emit(struct cond_builder *b, enum cond_op op,
+    const char *str)
+{
+	struct cond_insn *ni;
+
+	if (b->count == b->alloc) {
+		b->alloc = (b->alloc == 0) ? 16 : b->alloc * 2;
+		ni = realloc(b->insn, sizeof(*ni) * b->alloc);
+		if (ni == NULL) {
+			b->oom = true;
+			b->alloc = b->count;
+			return 0;
+		}
+		b->insn = ni;
+	}
+	ni = &b->insn[b->count];
+	memset(ni, 0, sizeof(*ni));
+	ni->op  = op;
+	ni->len = 1;
+	if (str != NULL) {
+		ni->str = pmt_arena_strdup(b->arena, str);
+		if (ni->str == NULL)
+			b->oom = true;
+	}
+	return b->count++;
+}
+
+/* Closes the subtree started by cond_emit() at @idx. */
+static void cond_close(struct cond_builder *b, unsigned int idx)
+{
+	if (!b->oom)
+		b->insn[idx].len = b->count - idx;
+}
+
+static void cond_error(struct cond_builder *b, const char *fmt,
+    const char *name)
+{
+	char buf[128];
+
+	snprintf(buf, sizeof(buf), fmt, name);
+	cond_emit(b, COND_ERROR, buf);
+}
+
+static bool cond_getbool(xmlNode *node, const char *attr)
+{
+	char *s = xml_getprop(node, attr);
+	bool ret;
+
+	if (s == NULL)
+		return false;
+	ret = strcasecmp(s, "yes") == 0 || strcasecmp(s, "on") == 0 ||
+	      strcasecmp(s, "true") == 0 || strcmp(s, "1") == 0;
+	free(s);
+	return ret;
+}
+
+static const char *cond_text(const xmlNode *node)
+{
+	for (node = node->children; node != NULL; node = node->next)
+		if (node->type == XML_TEXT_NODE)
+			return signed_cast(const char *, node->content);
+	return NULL;
+}
+
+/* "N" or "N-M"; %COND_ERROR (silent) if neither */
+static void cond_compile_id(struct cond_builder *b, enum cond_op op,
+    const char *s)
+{
+	unsigned long lo, hi;
+	unsigned int idx;
+	char *delim;
+
+	lo = hi = strtoul(s, &delim, 0);
+	if (*delim != '\0') {
+		if (*delim != '-' || *++delim == '\0') {
+			cond_emit(b, COND_ERROR, NULL);
+			return;
+		}
+		hi = strtoul(delim, &delim, 0);
+		if (*delim != '\0') {
+			cond_emit(b, COND_ERROR, NULL);
+			return;
+		}
+	}
+	idx = cond_emit(b, op, NULL);
+	if (b->oom)
+		return;
+	b->insn[idx].lo = lo;
+	b->insn[idx].hi = hi;
+}
+
+/**
+ * cond_compile_list - compile <and>, <or>, <xor>, <not>
+ * @min, @max:	allowed number of child elements
+ * @err:	message if outside of that
+ */
+static void cond_compile_list(struct cond_builder *b, enum cond_op op,
+    xmlNode *node, unsigned int min, unsigned int max, const char *err)
+{
+	unsigned int idx, nargs = 0;
+	xmlNode *child;
+
+	for (child = node->children; child != NULL; child = child->next)
+		if (child->type == XML_ELEMENT_NODE)
+			++nargs;
+	if (nargs < min || nargs > max) {
+		cond_emit(b, COND_ERROR, err);
+		return;
+	}
+	idx = cond_emit(b, op, NULL);
+	for (child = node->children; child != NULL; child = child->next)
+		if (child->type == XML_ELEMENT_NODE)
+			cond_compile_elem(b, child);
+	if (b->oom)
+		return;
+	b->insn[idx].nargs = nargs;
+	cond_close(b, idx);
+}
+
+/* Mirrors the former rc_volume_cond_ext() */
+static void cond_compile_elem(struct cond_builder *b, xmlNode *node)
+{
+	const char *name = signed_cast(const char *, node->name);
+	const char *text = cond_text(node);
+	enum cond_op op;
+	unsigned int idx;
+
+	if (strcmp(name, "and") == 0) {
+		cond_compile_list(b, COND_AND, node, 1, UINT_MAX,
+			"config: <and> does not have any child elements\n");
+		return;
+	} else if (strcmp(name, "or") == 0) {
+		cond_compile_list(b, COND_OR, node, 1, UINT_MAX,
+			"config: <or> does not have any child elements\n");
+		return;
+	} else if (strcmp(name, "xor") == 0) {
+		cond_compile_list(b, COND_XOR, node, 2, 2,
+			"config: <xor> must have exactly two child elements\n");
+		return;
+	} else if (strcmp(name, "not") == 0) {
+		cond_compile_list(b, COND_NOT, node, 1, 1,
+			"config: <not> may only have one child element\n");
+		return;
+	} else if (strcmp(name, "uid") == 0 || strcmp(name, "gid") == 0) {
+		op = (*name == 'u') ? COND_UID : COND_GID;
+		if (text == NULL)
+			cond_error(b, "config: empty or invalid content "
+			           "for <%s>\n", name);
+		else
+			cond_compile_id(b, op, text);
+		return;
+	} else if (strcmp(name, "user") == 0) {
+		op = COND_USER;
+		if (text == NULL) {
+			/* never matches, but is no error */
+			cond_emit(b, COND_FALSE, NULL);
+			return;
+		}
+	} else if (strcmp(name, "pgrp") == 0) {
+		op = COND_PGRP;
+	} else if (strcmp(name, "sgrp") == 0) {
+		op = COND_SGRP;
+	} else if (strcmp(name, "service") == 0) {
+		op = COND_SERVICE;
+		b->has_service = true;
+	} else {
+		cond_error(b, "config: unknown element <%s>\n", name);
+		return;
+	}
+	if (text == NULL) {
+		cond_error(b, "config: empty or invalid content for <%s>\n",
+		           name);
+		return;
+	}
+	idx = cond_emit(b, op, text);
+	if (b->oom)
+		return;
+	b->insn[idx].icase = cond_getbool(node, "icase");
+	b->insn[idx].regex = cond_getbool(node, "regex");
+}
+
+/* Mirrors the former rc_volume_cond_simple() */
+static bool cond_compile_simple(struct cond_builder *b, xmlNode *node)
+{
+	char *user   = xml_getprop(node, "user");
+	char *invert = xml_getprop(node, "invert");
+	char *uid    = xml_getprop(node, "uid");
+	char *gid    = xml_getprop(node, "gid");
+	char *pgrp   = xml_getprop(node, "pgrp");
+	char *sgrp   = xml_getprop(node, "sgrp");
+	unsigned int idx, nargs = 1;
+
+	if (user == NULL && invert == NULL && uid == NULL && gid == NULL &&
+	    pgrp == NULL && sgrp == NULL)
+		return false;
+
+	idx = cond_emit(b, COND_SIMPLE, NULL);
+	if (user != NULL && strcmp(user, "*") != 0)
+		cond_emit(b, COND_USER, user);
+	else
+		/* The wildcard, explicit or implied, never matches root */
+		cond_emit(b, COND_NONROOT, NULL);
+	if (uid != NULL) {
+		cond_compile_id(b, COND_UID, uid);
+		++nargs;
+	}
+	if (gid != NULL) {
+		cond_compile_id(b, COND_GID, gid);
+		++nargs;
+	}
+	if (pgrp != NULL) {
+		cond_emit(b, COND_PGRP, pgrp);
+		++nargs;
+	}
+	if (sgrp != NULL) {
+		cond_emit(b, COND_SGRP, sgrp);
+		++nargs;
+	}
+	if (!b->oom) {
+		b->insn[idx].nargs = nargs;
+		if (invert != NULL) {
+			l0g("The \"invert\" attribute is deprecated, support "
+			    "will be removed in next version.\n");
+			b->insn[idx].flag = strtoul(invert, NULL, 0) != 0;
+		}
+		cond_close(b, idx);
+	}
+	free(user);
+	free(invert);
+	free(uid);
+	free(gid);
+	free(pgrp);
+	free(sgrp);
+	return true;
+}
+
+/**
+ * pmt_cond_compile - compile the user control of a volume
+ * @arena:	where to place the program
+ * @node:	XML <volume> node
+ *
+ * Returns %NULL on memory shortage.
+ */
+struct pmt_cond *pmt_cond_compile(struct pmt_arena *arena, xmlNode *node)
+{
+	struct cond_builder b = {.arena = arena};
+	struct pmt_cond *prog = NULL;
+	unsigned int idx;
+	char *services;
+
+	services = xml_getprop(node, "service");
+	idx = cond_emit(&b, COND_VOLUME, services);
+	b.has_service = services != NULL;
+	free(services);
+	if (cond_compile_simple(&b, node) && !b.oom)
+		++b.insn[idx].nargs;
+	if (node->children != NULL) {
+		/* Mirrors rc_volume_cond(): elements are implicitly ANDed */
+		cond_compile_list(&b, COND_AND, node, 1, UINT_MAX,
+			"config: <and> does not have any child elements\n");
+		if (!b.oom) {
+			++b.insn[idx].nargs;
+			b.insn[idx].flag = true;
+		}
+	}
+	cond_close(&b, idx);
+
+	if (!b.oom)
+		prog = pmt_arena_alloc(arena, sizeof(*prog) +
+		       sizeof(*b.insn) * b.count);
+	if (prog != NULL) {
+		prog->count       = b.count;
+		prog->has_service = b.has_service;
+		memcpy(prog->insn, b.insn, sizeof(*b.insn) * b.count);
+	}
+	free(b.insn);
+	return prog;
+}
+
+/**
+ * pmt_cond_has_service - whether the outcome depends on the PAM service
+ */
+bool pmt_cond_has_service(const struct pmt_cond *prog)
+{
+	return prog->has_service;
+}
+
+static int pmt_strregmatch(const char *s, const char *pattern, bool icase)
+{
+	const struct pmt_regex_ops *ops = ehd_backend_load("pmt-regex");
+
+	if (ops == NULL)
+		return -1;
+	return ops->match(s, pattern, icase);
+}
+
+static bool cond_match(const struct cond_insn *insn, const char *s)
+{
+	if (insn->regex)
+		return pmt_strregmatch(s, insn->str, insn->icase) > 0;
+	else if (insn->icase)
+		return strcasecmp(s, insn->str) == 0;
+	else
+		return strcmp(s, insn->str) == 0;
+}
+
+/**
+ * cond_services - check the service="" filter of a volume
+ * @list:	list of service names, separated by commas or whitespace
+ * @service:	PAM service, %NULL to stand for any service
+ *
+ * Unlike the user control attributes, the filter applies on top of
+ * whatever selects the user.
+ */
+static bool cond_services(const char *list, const char *service)
+{
+	const char *p;
+	size_t len;
+	bool ret = false;
+
+	if (list == NULL || service == NULL)
+		return true;
+	len = strlen(service);
+	for (p = list; *p != '\0' && !ret; p += strcspn(p, ", \t")) {
+		p += strspn(p, ", \t");
+		ret = *p != '\0' && strncmp(p, service, len) == 0 &&
+		      strchr(", \t", p[len]) != NULL;
+	}
+	return ret;
+}
+
+/**
+ * cond_sgroups - resolve the secondary groups of the user
+ *
+ * Done once per user, on the first <sgrp> or sgrp="" that is evaluated.
+ */
+static void cond_sgroups(struct cond_ctx *ctx)
+{
+	struct pmt_userinfo *ui = ctx->ui;
+	int i, ret, ngroups = 1;
+	const struct group *gent;
+	gid_t *grplist, grpbuf;
+	char *name;
+
+	ui->have_sgroups = true;
+	ret = getgrouplist(ui->name, -1, &grpbuf, &ngroups);
+	if (ret == 0 || (ret == 1 && grpbuf == static_cast(gid_t, -1)))
+		/* No secondary groups. */
+		return;
+	if ((grplist = malloc(sizeof(gid_t) * ngroups)) == NULL)
+		return;
+	if (getgrouplist(ui->name, -1, grplist, &ngroups) < 0) {
+		l0g("getgrouplist(%s) failed: %s\n", ui->name, strerror(errno));
+		free(grplist);
+		return;
+	}
+	ui->sgroups = pmt_arena_alloc(&ctx->config->arena,
+	              sizeof(*ui->sgroups) * ngroups);
+	for (i = 0; ui->sgroups != NULL && i < ngroups; ++i) {
+		if (grplist[i] == static_cast(gid_t, -1))
+			continue;
+		if ((gent = getgrgid(grplist[i])) == NULL)
+			continue;
+		name = pmt_arena_strdup(&ctx->config->arena, gent->gr_name);
+		if (name != NULL)
+			ui->sgroups[ui->nsgroups++] = name;
+	}
+	free(grplist);
+}
+
+static int cond_eval(const struct cond_insn *insn, struct cond_ctx *ctx)
+{
+	const struct pmt_userinfo *ui = ctx->ui;
+	const struct cond_insn *arg = insn + 1;
+	unsigned int i;
+	int ret, all;
+
+	switch (insn->op) {
+	case COND_ERROR:
+		if (insn->str != NULL)
+			l0g("%s", insn->str);
+		return -1;
+	case COND_FALSE:
+		return false;
+	case COND_SIMPLE:
+		/* Every attribute is looked at; the first error wins. */
+		for (i = 0, all = true; i < insn->nargs; ++i, arg += arg->len) {
+			ret = cond_eval(arg, ctx);
+			if (ret < 0)
+				return ret;
+			else if (ret == 0)
+				all = false;
+			else if (ret == COND_MAYBE && all)
+				all = COND_MAYBE;
+		}
+		if (all == COND_MAYBE || !insn->flag)
+			return all;
+		return !all;
+	case COND_AND:
+		for (i = 0, all = true; i < insn->nargs; ++i, arg += arg->len)
+			if ((ret = cond_eval(arg, ctx)) <= 0)
+				return ret;
+			else if (ret == COND_MAYBE)
+				all = COND_MAYBE;
+		return all;
+	case COND_OR:
+		for (i = 0, all = false; i < insn->nargs; ++i, arg += arg->len)
+			if ((ret = cond_eval(arg, ctx)) < 0)
+				return ret;
+			else if (ret == COND_MAYBE)
+				all = COND_MAYBE;
+			else if (ret > 0)
+				return true;
+		return all;
+	case COND_XOR:
+		if ((ret = cond_eval(arg, ctx)) < 0)
+			return ret;
+		arg += arg->len;
+		if ((all = cond_eval(arg, ctx)) < 0)
+			return all;
+		if (ret == COND_MAYBE || all == COND_MAYBE)
+			return COND_MAYBE;
+		return (ret > 0) ^ (all > 0);
+	case COND_NOT:
+		if ((ret = cond_eval(arg, ctx)) < 0)
+			return ret;
+		return (ret == COND_MAYBE) ? ret : !ret;
+	case COND_USER:
+		return cond_match(insn, ui->name);
+	case COND_NONROOT:
+		return ui->uid != 0 && strcmp(ui->name, "root") != 0;
+	case COND_UID:
+		return insn->lo <= ui->uid && ui->uid <= insn->hi;
+	case COND_GID:
+		return insn->lo <= ui->gid && ui->gid <= insn->hi;
+	case COND_PGRP:
+		return ui->group != NULL && cond_match(insn, ui->group);
+	case COND_SGRP:
+		if (ui->group != NULL && cond_match(insn, ui->group))
+			return true;
+		if (!ui->have_sgroups)
+			cond_sgroups(ctx);
+		for (i = 0; i < ui->nsgroups; ++i)
+			if (cond_match(insn, ui->sgroups[i]))
+				return true;
+		return false;
+	case COND_SERVICE:
+		if (ctx->service == NULL)
+			return COND_MAYBE;
+		return cond_match(insn, ctx->service);
+	}
+	return -1;
+}
+
+/**
+ * pmt_cond_eval - check if a volume applies to the user
+ * @prog:	compiled user control of the volume
+ * @config:	configuration, for the user logging in
+ * @service:	PAM service, %NULL to stand for any service
+ *
+ * Returns positive if it does (with %NULL: may, for some service), zero if
+ * not, negative on error.
+ */
+int pmt_cond_eval(const struct pmt_cond *prog, struct config *config,
+    const char *service)
+{
+	const struct cond_insn *root = prog->insn, *arg = root + 1;
+	struct cond_ctx ctx = {.config = config, .service = service};
+	int ret = -1;
+
+	config_userinfo(config);
+	ctx.ui = &config->uinfo;
+	if (!ctx.ui->have_pw || !cond_services(root->str, service))
+		return false;
+	if (root->nargs > 0 && arg->op == COND_SIMPLE) {
+		ret = cond_eval(arg, &ctx);
+		arg += arg->len;
+	}
+	if (ret < 0 && root->flag) {
+		/* When no attributes, but elements... */
+		ret = cond_eval(arg, &ctx);
+		if (ret < 0)
+			return -1;
+		return ret > 0;
+	} else if (ret == 0) {
+		/* Attributes but (hopefully) no elements. */
+		if (root->flag) {
+			l0g("You cannot have both simple and extended "
+			    "user control\n");
+			return -1;
+		}
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,566 @@
+/*
+ *	Index of the users that volumes can apply to
+ *
+ *	This file is part of pam_mount; you can redistribute it and/or
+ *	modify it under the terms of the GNU Lesser General Public License
+ *	as published by the Free Software Foundation; either version 2.1
+ *	of the License, or (at your option) any later version.
+ */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libxml/parser.h>
+#include <libHX/defs.h>
+#include <libHX/io.h>
+#include <libHX/libxml_helper.h>
+#include <libHX/string.h>
+#include "libcryptmount.h"
+#include "pam_mount.h"
+
+#ifdef __APPLE__
+#	define st_mtim st_mtimespec
+#endif
+
+/*
+ * Most PAM transactions (cron, sudo, su, service logins) are for users that
+ * no <volume> applies to. So that these need not parse the configuration at
+ * all, the volume conditions of the global configuration are condensed into
+ * a list of keys; a user has to satisfy at least one of them for any volume
+ * to possibly be theirs:
+ *
+ *	any			cannot tell (regex, <not>, <xor>, ...)
+ *	nonroot			every user but root
+ *	user NAME		user name (iuser: case-insensitive)
+ *	uid LO HI, gid LO HI	ID range
+ *	group NAME		primary or secondary group (igroup: ...)
+ *	service NAME		PAM service (iservice: case-insensitive)
+ *
+ * It is a superset - a user matching some key may still have no volumes -
+ * so pam_mount.conf.xml remains the only authority. The index is kept in the
+ * run directory, stamped with the identity of the file it was made from,
+ * and rebuilt by the first full parse after that has changed.
+ */
+static const char pmt_volindex_file[] = RUNDIR "/pam_mount/.volindex";
+static const char pmt_volindex_magic[] = "pam_mount-volindex 1";
+
+/**
+ * struct vi_groups - group names of the user, resolved on first use
+ */
+struct vi_groups {
+	bool valid;
+	int count;
+	char **name;
+};
+
+static bool vi_keys_elem(hxmc_t **, xmlNode *);
+
+static void vi_header(char *buf, size_t size, const char *file,
+    const struct stat *sb)
+{
+	snprintf(buf, size, "%s %llu %llu %lld %ld %lld %s", pmt_volindex_magic,
+	         static_cast(unsigned long long, sb->st_dev),
+	         static_cast(unsigned long long, sb->st_ino),
+	         static_cast(long long, sb->st_mtim.tv_sec),
+	         static_cast(long, sb->st_mtim.tv_nsec),
+	         static_cast(long long, sb->st_size), file);
+}
+
+static bool vi_getbool(xmlNode *node, const char *attr)
+{
+	char *s = xml_getprop(node, attr);
+	bool ret;
+
+	if (s == NULL)
+		return false;
+	ret = strcasecmp(s, "yes") == 0 || strcasecmp(s, "on") == 0 ||
+	      strcasecmp(s, "true") == 0 || strcmp(s, "1") == 0;
+	free(s);
+	return ret;
+}
+
+static const char *vi_text(const xmlNode *node)
+{
+	for (node = node->children; node != NULL; node = node->next)
+		if (node->type == XML_TEXT_NODE)
+			return signed_cast(const char *, node->content);
+	return NULL;
+}
+
+static bool vi_has_elements(const xmlNode *node)
+{
+	for (node = node->children; node != NULL; node = node->next)
+		if (node->type == XML_ELEMENT_NODE)
+			return true;
+	return false;
+}
+
+static bool vi_add_name(hxmc_t **keys, const char *type, const char *name)
+{
+	if (strchr(name, '\n') != NULL)
+		return false;
+	HXmc_strcat(keys, type);
+	HXmc_strcat(keys, " ");
+	HXmc_strcat(keys, name);
+	HXmc_strcat(keys, "\n");
+	return true;
+}
+
+/* Same syntax as __rc_volume_cond_id() */
+static bool vi_add_id(hxmc_t **keys, const char *type, const char *s)
+{
+	unsigned long lo, hi;
+	char *end, buf[64];
+
+	lo = hi = strtoul(s, &end, 0);
+	if (*end == '-' && end[1] != '\0')
+		hi = strtoul(end + 1, &end, 0);
+	if (*end != '\0')
+		return false;
+	snprintf(buf, sizeof(buf), "%s %lu %lu\n", type, lo, hi);
+	HXmc_strcat(keys, buf);
+	return true;
+}
+
+/**
+ * vi_keys_and - keys of an <and> element
+ *
+ * Every child has to match, so the keys of any one of them will do; the
+ * shortest list is taken.
+ */
+static bool vi_keys_and(hxmc_t **keys, xmlNode *node)
+{
+	hxmc_t *best = NULL, *sub;
+
+	for (node = node->children; node != NULL; node = node->next) {
+		if (node->type != XML_ELEMENT_NODE)
+			continue;
+		sub = HXmc_strinit("");
+		if (vi_keys_elem(&sub, node) && (best == NULL ||
+		    HXmc_length(sub) < HXmc_length(best))) {
+			HXmc_free(best);
+			best = sub;
+		} else {
+			HXmc_free(sub);
+		}
+	}
+	if (best == NULL)
+		return false;
+	HXmc_strcat(keys, best);
+	HXmc_free(best);
+	return true;
+}
+
+static bool vi_keys_or(hxmc_t **keys, xmlNode *node)
+{
+	for (node = node->children; node != NULL; node = node->next)
+		if (node->type == XML_ELEMENT_NODE &&
+		    !vi_keys_elem(keys, node))
+			return false;
+	return true;
+}
+
+/**
+ * vi_keys_elem - keys of an extended user control element
+ * @keys:	list to append to
+ * @node:	element
+ *
+ * Returns false if the element cannot be indexed. An element that never
+ * matches (e.g. an empty <user/>) adds no keys.
+ */
+static bool vi_keys_elem(hxmc_t **keys, xmlNode *node)
+{
+	const char *text;
+	bool icase;
+
+	if (xml_strcmp(node->name, "and") == 0)
+		return vi_keys_and(keys, node);
+	if (xml_strcmp(node->name, "or") == 0)
+		return vi_keys_or(keys, node);
+	if (xml_strcmp(node->name, "uid") == 0 ||
+	    xml_strcmp(node->name, "gid") == 0)
+		return (text = vi_text(node)) != NULL &&
+		       vi_add_id(keys, signed_cast(const char *, node->name),
+		       text);
+	if (xml_strcmp(node->name, "user") != 0 &&
+	    xml_strcmp(node->name, "service") != 0 &&
+	    xml_strcmp(node->name, "pgrp") != 0 &&
+	    xml_strcmp(node->name, "sgrp") != 0)
+		/* <not>, <xor> */
+		return false;
+	if (vi_getbool(node, "regex"))
+		return false;
+	if ((text = vi_text(node)) == NULL)
+		return true;
+	icase = vi_getbool(node, "icase");
+	if (xml_strcmp(node->name, "user") == 0)
+		return vi_add_name(keys, icase ? "iuser" : "user", text);
+	if (xml_strcmp(node->name, "service") == 0)
+		return vi_add_name(keys, icase ? "iservice" : "service", text);
+	return vi_add_name(keys, icase ? "igroup" : "group", text);
+}
+
+/**
+ * vi_keys_simple - keys of the simple user control attributes
+ *
+ * Returns -1 if @node has none of them, otherwise whether they could be
+ * indexed. As all attributes have to match, one of them is enough.
+ */
+static int vi_keys_simple(hxmc_t **keys, xmlNode *node)
+{
+	char *user   = xml_getprop(node, "user");
+	char *invert = xml_getprop(node, "invert");
+	char *uid    = xml_getprop(node, "uid");
+	char *gid    = xml_getprop(node, "gid");
+	char *pgrp   = xml_getprop(node, "pgrp");
+	char *sgrp   = xml_getprop(node, "sgrp");
+	int ret = true;
+
+	if (user == NULL && invert == NULL && uid == NULL && gid == NULL &&
+	    pgrp == NULL && sgrp == NULL)
+		ret = -1;
+	else if (invert != NULL)
+		ret = false;
+	else if (user != NULL && strcmp(user, "*") != 0)
+		ret = vi_add_name(keys, "user", user);
+	else if (uid != NULL)
+		ret = vi_add_id(keys, "uid", uid);
+	else if (gid != NULL)
+		ret = vi_add_id(keys, "gid", gid);
+	else if (pgrp != NULL)
+		ret = vi_add_name(keys, "group", pgrp);
+	else if (sgrp != NULL)
+		ret = vi_add_name(keys, "group", sgrp);
+	else
+		/* user="*" or no user= at all: the wildcard never matches root */
+		HXmc_strcat(keys, "nonroot\n");
+
+	free(user);
+	free(invert);
+	free(uid);
+	free(gid);
+	free(pgrp);
+	free(sgrp);
+	return ret;
+}
+
+/**
+ * vi_keys_services - keys of the service="" filter
+ *
+ * Returns false if @node has none, or it cannot be indexed.
+ */
+static bool vi_keys_services(hxmc_t **keys, xmlNode *node)
+{
+	char *list = xml_getprop(node, "service"), *p, *name;
+	bool ret = true;
+
+	if (list == NULL)
+		return false;
+	/* Same syntax as cond_services() */
+	for (p = list; ret && (name = HX_strsep(&p, ", \t")) != NULL; )
+		if (*name != '\0')
+			ret = vi_add_name(keys, "service", name);
+	free(list);
+	return ret;
+}
+
+static bool vi_keys_user(hxmc_t **keys, xmlNode *node)
+{
+	bool elements = vi_has_elements(node);
+	int ret = vi_keys_simple(keys, node);
+
+	if (ret >= 0)
+		return ret > 0 && !elements;
+	if (!elements)
+		/* A <volume> without any conditions applies to everyone. */
+		return false;
+	return vi_keys_and(keys, node);
+}
+
+/*
+ * Mirrors rc_volume_cond(). The service filter and the user conditions both
+ * have to match, so like for <and>, the shorter key list is taken.
+ */
+static bool vi_keys_volume(hxmc_t **keys, xmlNode *node)
+{
+	hxmc_t *user = HXmc_strinit(""), *svc = HXmc_strinit("");
+	bool have_user = vi_keys_user(&user, node);
+	bool have_svc  = vi_keys_services(&svc, node);
+
+	if (have_svc && (!have_user || HXmc_length(svc) < HXmc_length(user)))
+		HXmc_strcat(keys, svc);
+	else if (have_user)
+		HXmc_strcat(keys, user);
+	HXmc_free(user);
+	HXmc_free(svc);
+	return have_user || have_svc;
+}
+
+/**
+ * struct pmt_volindex_writer - index under construction
+ * @any:	some volume could not be indexed; @keys is moot
+ */
+struct pmt_volindex_writer {
+	hxmc_t *keys, *luserconf;
+	unsigned long debug;
+	bool any;
+};
+
+struct pmt_volindex_writer *pmt_volindex_new(void)
+{
+	struct pmt_volindex_writer *vi = calloc(1, sizeof(*vi));
+
+	if (vi == NULL)
+		return NULL;
+	vi->keys  = HXmc_strinit("");
+	vi->debug = 1;
+	if (vi->keys == NULL) {
+		free(vi);
+		return NULL;
+	}
+	return vi;
+}
+
+void pmt_volindex_free(struct pmt_volindex_writer *vi)
+{
+	if (vi == NULL)
+		return;
+	HXmc_free(vi->luserconf);
+	HXmc_free(vi->keys);
+	free(vi);
+}
+
+/**
+ * pmt_volindex_add - feed a top-level element of the configuration
+ * @vi:		index under construction
+ * @node:	child element of <pam_mount>
+ *
+ * The elements have to be passed in document order, and all of them, since
+ * the index must not miss a volume.
+ */
+void pmt_volindex_add(struct pmt_volindex_writer *vi, xmlNode *node)
+{
+	hxmc_t *sub;
+	char *s;
+
+	if (xml_strcmp(node->name, "debug") == 0) {
+		if ((s = xml_getprop(node, "enable")) != NULL)
+			vi->debug = strtoul(s, NULL, 0);
+		free(s);
+	} else if (xml_strcmp(node->name, "luserconf") == 0) {
+		if ((s = xml_getprop(node, "name")) != NULL)
+			HXmc_strcpy(&vi->luserconf, s);
+		free(s);
+	} else if (!vi->any && xml_strcmp(node->name, "volume") == 0) {
+		sub = HXmc_strinit("");
+		if (vi_keys_volume(&sub, node))
+			HXmc_strcat(&vi->keys, sub);
+		else
+			vi->any = true;
+		HXmc_free(sub);
+	}
+}
+
+/**
+ * pmt_volindex_write - store a completed index
+ * @vi:		index, freed by this function
+ * @file:	path of the global configuration file
+ * @sb:		its identity, as taken before it was parsed
+ *
+ * Replaces the index atomically; failure is not fatal, the next call will
+ * just try again.
+ */
+void pmt_volindex_write(struct pmt_volindex_writer *vi, const char *file,
+    const struct stat *sb)
+{
+	char header[PATH_MAX + 128], tmp[sizeof(pmt_volindex_file) + 16];
+	FILE *fp;
+	int fd;
+
+	HX_mkdir(RUNDIR "/pam_mount", S_IRUGO | S_IXUGO | S_IWUSR);
+	snprintf(tmp, sizeof(tmp), "%s.%u", pmt_volindex_file,
+	         static_cast(unsigned int, getpid()));
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		w4rn("could not write %s: %s\n", tmp, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+	vi_header(header, sizeof(header), file, sb);
+	fprintf(fp, "%s\ndebug %lu\n", header, vi->debug);
+	if (vi->luserconf != NULL && strchr(vi->luserconf, '\n') == NULL)
+		fprintf(fp, "luserconf %s\n", vi->luserconf);
+	fputs(vi->any ? "any\n" : vi->keys, fp);
+	if (fclose(fp) != 0 || rename(tmp, pmt_volindex_file) < 0) {
+		w4rn("could not write %s: %s\n", pmt_volindex_file,
+		     strerror(errno));
+		unlink(tmp);
+	} else {
+		w4rn("rebuilt %s\n", pmt_volindex_file);
+	}
+ out:
+	pmt_volindex_free(vi);
+}
+
+static void vi_groups_free(struct vi_groups *g)
+{
+	int i;
+
+	for (i = 0; i < g->count; ++i)
+		free(g->name[i]);
+	free(g->name);
+}
+
+static void vi_groups_get(struct vi_groups *g, const struct passwd *pw)
+{
+	const struct group *gr;
+	int i, ngroups = 32;
+	gid_t *list;
+
+	g->valid = true;
+	if ((list = malloc(sizeof(*list) * ngroups)) == NULL)
+		return;
+	if (getgrouplist(pw->pw_name, pw->pw_gid, list, &ngroups) < 0) {
+		free(list);
+		if ((list = malloc(sizeof(*list) * ngroups)) == NULL)
+			return;
+		if (getgrouplist(pw->pw_name, pw->pw_gid, list,
+		    &ngroups) < 0)
+			ngroups = 0;
+	}
+	g->name = calloc(ngroups, sizeof(*g->name));
+	for (i = 0; g->name != NULL && i < ngroups; ++i)
+		if ((gr = getgrgid(list[i])) != NULL &&
+		    (g->name[g->count] = strdup(gr->gr_name)) != NULL)
+			++g->count;
+	free(list);
+}
+
+static bool vi_in_group(struct vi_groups *g, const struct passwd *pw,
+    const char *group, bool icase)
+{
+	int i;
+
+	if (!g->valid)
+		vi_groups_get(g, pw);
+	for (i = 0; i < g->count; ++i)
+		if ((icase ? strcasecmp : strcmp)(g->name[i], group) == 0)
+			return true;
+	return false;
+}
+
+static bool vi_in_range(const char *s, unsigned long id)
+{
+	unsigned long lo, hi;
+
+	return sscanf(s, "%lu %lu", &lo, &hi) == 2 && lo <= id && id <= hi;
+}
+
+/**
+ * vi_match - check one line of the index
+ *
+ * Returns true if the key in @line may select a volume for @pw.
+ */
+static bool vi_match(const char *line, const struct passwd *pw,
+    const char *service, struct vi_groups *groups, unsigned int *debug)
+{
+	const char *arg = strchr(line, ' ');
+	char path[PATH_MAX];
+
+	arg = (arg != NULL) ? arg + 1 : "";
+	if (strcmp(line, "any") == 0)
+		return true;
+	else if (strcmp(line, "nonroot") == 0)
+		return pw->pw_uid != 0 && strcmp(pw->pw_name, "root") != 0;
+	else if (strncmp(line, "debug ", 6) == 0)
+		*debug = strtoul(arg, NULL, 0);
+	else if (strncmp(line, "luserconf ", 10) == 0) {
+		/* Same as rc_luserconf() */
+		if (*arg == '/')
+			HX_strlcpy(path, arg, sizeof(path));
+		else
+			snprintf(path, sizeof(path), "%s/%s", pw->pw_dir, arg);
+		return pmt_fileop_exists(path);
+	} else if (strncmp(line, "user ", 5) == 0)
+		return strcmp(pw->pw_name, arg) == 0;
+	else if (strncmp(line, "iuser ", 6) == 0)
+		return strcasecmp(pw->pw_name, arg) == 0;
+	else if (strncmp(line, "uid ", 4) == 0)
+		return vi_in_range(arg, pw->pw_uid);
+	else if (strncmp(line, "gid ", 4) == 0)
+		return vi_in_range(arg, pw->pw_gid);
+	else if (strncmp(line, "service ", 8) == 0)
+		return service == NULL || strcmp(service, arg) == 0;
+	else if (strncmp(line, "iservice ", 9) == 0)
+		return service == NULL || strcasecmp(service, arg) == 0;
+	else if (strncmp(line, "group ", 6) == 0)
+		return vi_in_group(groups, pw, arg, false);
+	else if (strncmp(line, "igroup ", 7) == 0)
+		return vi_in_group(groups, pw, arg, true);
+	else
+		/* from a newer version, perhaps */
+		return true;
+	return false;
+}
+
+/**
+ * pmt_volindex_lookup - check whether a user can have any volumes
+ * @file:	path of the global configuration file
+ * @user:	user logging in
+ * @service:	PAM service, may be %NULL
+ * @debug:	receives the <debug> setting on %PMT_VOLINDEX_NONE
+ *
+ * Only root can trust (and maintain) the index; everyone else always gets
+ * %PMT_VOLINDEX_MATCH, as do users that cannot be looked up.
+ */
+enum pmt_volindex pmt_volindex_lookup(const char *file, const char *user,
+    const char *service, unsigned int *debug)
+{
+	struct vi_groups groups = {.valid = false};
+	enum pmt_volindex ret = PMT_VOLINDEX_STALE;
+	char header[PATH_MAX + 128];
+	const struct passwd *pw;
+	struct stat sb, isb;
+	hxmc_t *line = NULL;
+	unsigned int dbg = 1;
+	FILE *fp;
+
+	if (geteuid() != 0 || stat(file, &sb) < 0)
+		return PMT_VOLINDEX_MATCH;
+	if ((fp = fopen(pmt_volindex_file, "re")) == NULL)
+		return PMT_VOLINDEX_STALE;
+	if (fstat(fileno(fp), &isb) < 0 || !S_ISREG(isb.st_mode) ||
+	    isb.st_uid != 0 || (isb.st_mode & (S_IWGRP | S_IWOTH)))
+		goto out;
+	vi_header(header, sizeof(header), file, &sb);
+	if (HX_getl(&line, fp) == NULL)
+		goto out;
+	HX_chomp(line);
+	if (strcmp(line, header) != 0)
+		goto out;
+
+	ret = PMT_VOLINDEX_MATCH;
+	if ((pw = getpwnam(user)) == NULL)
+		goto out;
+	while (HX_getl(&line, fp) != NULL) {
+		HX_chomp(line);
+		if (vi_match(line, pw, service, &groups, &dbg))
+			goto out;
+	}
+	*debug = dbg;
+	ret = PMT_VOLINDEX_NONE;
+ out:
+	HXmc_free(line);
+	vi_groups_free(&groups);
+	fclose(fp);
+	return ret;
+}